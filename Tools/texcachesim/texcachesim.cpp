@@ -0,0 +1,583 @@
+/**
+\file texcachesim.cpp
+Texture cache eviction policy simulator.
+
+Replays a texture cache trace written by the renderer (TexTrace START / TexTrace STOP console commands, see d3d12drv/textrace.h) against
+a number of eviction policies and memory budgets, and reports for each:
+- Misses: binds of textures that weren't resident and had to be uploaded again.
+- Re-upload bytes: data uploaded for those misses. The first upload of each texture isn't counted, as no policy can avoid it.
+- Worst frame: the frame with the most re-upload bytes.
+
+Policies:
+- LRU: evict the least recently used texture.
+- LFU: evict the least frequently used texture, least recently used among equals.
+- ARC: adaptive replacement cache, balancing recency and frequency using ghost lists of recently evicted textures. Sizes are counted in bytes.
+- GDSF: greedy dual size frequency; size-aware, prefers evicting large, rarely used textures.
+
+CPU only and portable; doesn't depend on Windows or the engine. Build with for example
+	cl /O2 /EHsc texcachesim.cpp
+	g++ -O2 -o texcachesim texcachesim.cpp
+
+Usage:
+	texcachesim trace.bin [-b MB,MB,...] [-p lru,lfu,arc,gdsf] [-csv]
+Without -b, budgets of 10%, 25%, 50% and 100% of the total size of all textures in the trace are simulated.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "../../d3d12drv/textrace.h"
+
+typedef unsigned long long UINT64;
+
+/**
+Eviction policy interface. Implementations keep track of which textures are resident within a budget in bytes.
+*/
+class Policy
+{
+public:
+	virtual ~Policy() {}
+	virtual const char *name() const = 0;
+
+	/**
+	Use a texture; on a miss it's made resident, evicting others as needed. Textures larger than the budget are never made resident.
+	\return true if the texture was resident.
+	*/
+	virtual bool access(UINT64 id, unsigned int bytes) = 0;
+
+	/**
+	Forget a texture, for example because it's recreated with a different size.
+	*/
+	virtual void remove(UINT64 id) = 0;
+};
+
+/**
+Least recently used.
+*/
+class LRUPolicy : public Policy
+{
+public:
+	LRUPolicy(UINT64 budget) : budget(budget), used(0) {}
+	const char *name() const { return "LRU"; }
+
+	bool access(UINT64 id, unsigned int bytes)
+	{
+		std::map<UINT64,std::list<Entry>::iterator>::iterator i = index.find(id);
+		if(i!=index.end())
+		{
+			order.splice(order.begin(),order,i->second);
+			return true;
+		}
+		if(bytes>budget)
+			return false;
+		while(used+bytes>budget)
+		{
+			used -= order.back().bytes;
+			index.erase(order.back().id);
+			order.pop_back();
+		}
+		Entry e = {id,bytes};
+		order.push_front(e);
+		index[id] = order.begin();
+		used += bytes;
+		return false;
+	}
+
+	void remove(UINT64 id)
+	{
+		std::map<UINT64,std::list<Entry>::iterator>::iterator i = index.find(id);
+		if(i==index.end())
+			return;
+		used -= i->second->bytes;
+		order.erase(i->second);
+		index.erase(i);
+	}
+
+private:
+	struct Entry
+	{
+		UINT64 id;
+		unsigned int bytes;
+	};
+	UINT64 budget;
+	UINT64 used;
+	std::list<Entry> order; /**< Most recently used first */
+	std::map<UINT64,std::list<Entry>::iterator> index;
+};
+
+/**
+Least frequently used, with least recently used as tie breaker. Use counts only cover the time a texture is resident.
+*/
+class LFUPolicy : public Policy
+{
+public:
+	LFUPolicy(UINT64 budget) : budget(budget), used(0), time(0) {}
+	const char *name() const { return "LFU"; }
+
+	bool access(UINT64 id, unsigned int bytes)
+	{
+		time++;
+		std::map<UINT64,Entry>::iterator i = entries.find(id);
+		if(i!=entries.end())
+		{
+			order.erase(key(id,i->second));
+			i->second.uses++;
+			i->second.lastUse = time;
+			order.insert(key(id,i->second));
+			return true;
+		}
+		if(bytes>budget)
+			return false;
+		while(used+bytes>budget)
+		{
+			remove(order.begin()->second);
+		}
+		Entry e = {bytes,1,time};
+		entries[id] = e;
+		order.insert(key(id,e));
+		used += bytes;
+		return false;
+	}
+
+	void remove(UINT64 id)
+	{
+		std::map<UINT64,Entry>::iterator i = entries.find(id);
+		if(i==entries.end())
+			return;
+		order.erase(key(id,i->second));
+		used -= i->second.bytes;
+		entries.erase(i);
+	}
+
+private:
+	struct Entry
+	{
+		unsigned int bytes;
+		UINT64 uses;
+		UINT64 lastUse;
+	};
+	typedef std::pair<std::pair<UINT64,UINT64>,UINT64> Key; /**< ((uses, last use), id); the first one in order is evicted */
+	static Key key(UINT64 id, const Entry &e) { return std::make_pair(std::make_pair(e.uses,e.lastUse),id); }
+
+	UINT64 budget;
+	UINT64 used;
+	UINT64 time;
+	std::map<UINT64,Entry> entries;
+	std::set<Key> order;
+};
+
+/**
+Adaptive replacement cache (Megiddo & Modha), generalized to textures of different sizes by counting all list sizes and the target in bytes.
+T1 holds textures used once recently, T2 textures used at least twice; B1 and B2 are ghost lists of textures evicted from those.
+A hit in a ghost list shifts the target size of T1 towards the list that would have kept the texture.
+*/
+class ARCPolicy : public Policy
+{
+public:
+	ARCPolicy(UINT64 budget) : budget(budget), target(0)
+	{
+		for(int i=0;i<NUM_LISTS;i++)
+			sizes[i] = 0;
+	}
+	const char *name() const { return "ARC"; }
+
+	bool access(UINT64 id, unsigned int bytes)
+	{
+		std::map<UINT64,Location>::iterator i = index.find(id);
+		if(i!=index.end() && (i->second.list==T1 || i->second.list==T2))
+		{
+			move(id,T2);
+			return true;
+		}
+		if(bytes>budget)
+			return false;
+
+		if(i!=index.end()) //Ghost hit; adapt the target and bring the texture back as frequently used
+		{
+			int ghost = i->second.list;
+			if(ghost==B1)
+			{
+				UINT64 delta = sizes[B1] && sizes[B2]>sizes[B1] ? (UINT64)bytes*sizes[B2]/sizes[B1] : bytes;
+				target = target+delta>budget ? budget : target+delta;
+			}
+			else
+			{
+				UINT64 delta = sizes[B2] && sizes[B1]>sizes[B2] ? (UINT64)bytes*sizes[B1]/sizes[B2] : bytes;
+				target = delta>target ? 0 : target-delta;
+			}
+			erase(id);
+			makeRoom(bytes,ghost==B2);
+			insert(id,bytes,T2);
+			return false;
+		}
+
+		//New texture; keep the ghost lists bounded to about the budget each
+		while(sizes[T1]+sizes[B1]+bytes>budget && !lists[B1].empty())
+			erase(lists[B1].back().id);
+		while(sizes[T1]+sizes[T2]+sizes[B1]+sizes[B2]+bytes>2*budget && !lists[B2].empty())
+			erase(lists[B2].back().id);
+		makeRoom(bytes,false);
+		insert(id,bytes,T1);
+		return false;
+	}
+
+	void remove(UINT64 id)
+	{
+		if(index.find(id)!=index.end())
+			erase(id);
+	}
+
+private:
+	enum {T1,T2,B1,B2,NUM_LISTS};
+	struct Entry
+	{
+		UINT64 id;
+		unsigned int bytes;
+	};
+	struct Location
+	{
+		int list;
+		std::list<Entry>::iterator it;
+	};
+
+	/** Evict from T1 or T2 into the ghost lists until there's room for a texture of the given size */
+	void makeRoom(unsigned int bytes, bool inB2)
+	{
+		while(sizes[T1]+sizes[T2]+bytes>budget)
+		{
+			if(!lists[T1].empty() && (sizes[T1]>target || (inB2 && sizes[T1]==target) || lists[T2].empty()))
+				move(lists[T1].back().id,B1);
+			else
+				move(lists[T2].back().id,B2);
+		}
+	}
+
+	void insert(UINT64 id, unsigned int bytes, int list)
+	{
+		Entry e = {id,bytes};
+		lists[list].push_front(e);
+		Location l = {list,lists[list].begin()};
+		index[id] = l;
+		sizes[list] += bytes;
+	}
+
+	void erase(UINT64 id)
+	{
+		std::map<UINT64,Location>::iterator i = index.find(id);
+		sizes[i->second.list] -= i->second.it->bytes;
+		lists[i->second.list].erase(i->second.it);
+		index.erase(i);
+	}
+
+	void move(UINT64 id, int list)
+	{
+		unsigned int bytes = index[id].it->bytes;
+		erase(id);
+		insert(id,bytes,list);
+	}
+
+	UINT64 budget;
+	UINT64 target; /**< Target size of T1 */
+	std::list<Entry> lists[NUM_LISTS]; /**< Most recent first */
+	UINT64 sizes[NUM_LISTS];
+	std::map<UINT64,Location> index;
+};
+
+/**
+Greedy dual size frequency (Cherkasova). Each resident texture has a priority of the inflation value plus its use count divided by its size;
+the lowest priority texture is evicted and the inflation value is raised to its priority, so textures not used for a while age out.
+*/
+class GDSFPolicy : public Policy
+{
+public:
+	GDSFPolicy(UINT64 budget) : budget(budget), used(0), inflation(0) {}
+	const char *name() const { return "GDSF"; }
+
+	bool access(UINT64 id, unsigned int bytes)
+	{
+		std::map<UINT64,Entry>::iterator i = entries.find(id);
+		if(i!=entries.end())
+		{
+			order.erase(std::make_pair(i->second.priority,id));
+			i->second.uses++;
+			i->second.priority = priority(i->second);
+			order.insert(std::make_pair(i->second.priority,id));
+			return true;
+		}
+		if(bytes>budget)
+			return false;
+		while(used+bytes>budget)
+		{
+			inflation = order.begin()->first;
+			remove(order.begin()->second);
+		}
+		Entry e = {bytes,1,0};
+		e.priority = priority(e);
+		entries[id] = e;
+		order.insert(std::make_pair(e.priority,id));
+		used += bytes;
+		return false;
+	}
+
+	void remove(UINT64 id)
+	{
+		std::map<UINT64,Entry>::iterator i = entries.find(id);
+		if(i==entries.end())
+			return;
+		order.erase(std::make_pair(i->second.priority,id));
+		used -= i->second.bytes;
+		entries.erase(i);
+	}
+
+private:
+	struct Entry
+	{
+		unsigned int bytes;
+		UINT64 uses;
+		double priority;
+	};
+	double priority(const Entry &e) const { return inflation+(double)e.uses*65536.0/(double)(e.bytes ? e.bytes : 1); }
+
+	UINT64 budget;
+	UINT64 used;
+	double inflation;
+	std::map<UINT64,Entry> entries;
+	std::set<std::pair<double,UINT64> > order;
+};
+
+/**
+Results of replaying a trace against one policy and budget.
+*/
+struct Result
+{
+	std::string policy;
+	UINT64 budget;
+	UINT64 binds;
+	UINT64 misses; /**< Binds of textures that were evicted before */
+	UINT64 reuploadBytes;
+	unsigned int worstFrame;
+	UINT64 worstFrameBytes;
+};
+
+/**
+Load a trace.
+\return false if the file is missing or not a trace.
+*/
+static bool loadTrace(const char *fileName, std::vector<TexTraceRecord> &records)
+{
+	FILE *f = fopen(fileName,"rb");
+	if(f==NULL)
+	{
+		fprintf(stderr,"Can't open %s.\n",fileName);
+		return false;
+	}
+	TexTraceHeader header;
+	if(fread(&header,sizeof(header),1,f)!=1 || header.magic!=TEXTRACE_MAGIC || header.version<1 || header.version>TEXTRACE_VERSION)
+	{
+		fprintf(stderr,"%s is not a texture cache trace of a supported version.\n",fileName);
+		fclose(f);
+		return false;
+	}
+	TexTraceRecord r;
+	while(fread(&r,sizeof(r),1,f)==1)
+	{
+		records.push_back(r);
+	}
+	fclose(f);
+	return true;
+}
+
+/**
+Replay a trace against a policy.
+\param records The trace.
+\param policy Policy to use; should be fresh.
+\param budget The policy's budget, for the report.
+*/
+static Result simulate(const std::vector<TexTraceRecord> &records, Policy &policy, UINT64 budget)
+{
+	Result result;
+	result.policy = policy.name();
+	result.budget = budget;
+	result.binds = 0;
+	result.misses = 0;
+	result.reuploadBytes = 0;
+	result.worstFrame = 0;
+	result.worstFrameBytes = 0;
+
+	std::map<UINT64,unsigned int> known; //Size of each texture seen so far
+	unsigned int frame = 0;
+	UINT64 frameBytes = 0;
+	for(size_t i=0;i<records.size();i++)
+	{
+		//Copy out of the packed record
+		int type = records[i].type;
+		UINT64 id = records[i].id;
+		unsigned int value = records[i].value;
+		if(type==TEXTRACE_FRAME)
+		{
+			frame = value;
+			frameBytes = 0;
+			continue;
+		}
+		if(type==TEXTRACE_DELETE) //Gone from the renderer for every policy; its next upload isn't a miss
+		{
+			policy.remove(id);
+			known.erase(id);
+			continue;
+		}
+
+		std::map<UINT64,unsigned int>::iterator k = known.find(id);
+		bool seen = k!=known.end();
+		if(seen && k->second!=value) //Recreated with a different size
+			policy.remove(id);
+		known[id] = value;
+
+		bool hit = policy.access(id,value);
+		if(type==TEXTRACE_BIND)
+		{
+			result.binds++;
+			if(!hit && seen)
+			{
+				result.misses++;
+				result.reuploadBytes += value;
+				frameBytes += value;
+				if(frameBytes>result.worstFrameBytes)
+				{
+					result.worstFrameBytes = frameBytes;
+					result.worstFrame = frame;
+				}
+			}
+		}
+	}
+	return result;
+}
+
+static Policy *createPolicy(const std::string &name, UINT64 budget)
+{
+	if(name=="lru")
+		return new LRUPolicy(budget);
+	if(name=="lfu")
+		return new LFUPolicy(budget);
+	if(name=="arc")
+		return new ARCPolicy(budget);
+	if(name=="gdsf")
+		return new GDSFPolicy(budget);
+	return NULL;
+}
+
+static std::vector<std::string> split(const char *s)
+{
+	std::vector<std::string> out;
+	std::string cur;
+	for(;;s++)
+	{
+		if(*s==',' || *s==0)
+		{
+			if(!cur.empty())
+				out.push_back(cur);
+			cur.clear();
+			if(*s==0)
+				break;
+		}
+		else
+			cur += *s;
+	}
+	return out;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc<2)
+	{
+		fprintf(stderr,"Usage: texcachesim trace.bin [-b MB,MB,...] [-p lru,lfu,arc,gdsf] [-csv]\n");
+		return 1;
+	}
+
+	std::vector<std::string> policies = split("lru,lfu,arc,gdsf");
+	std::vector<UINT64> budgets;
+	bool csv = false;
+	for(int i=2;i<argc;i++)
+	{
+		if(!strcmp(argv[i],"-b") && i+1<argc)
+		{
+			std::vector<std::string> mb = split(argv[++i]);
+			for(size_t j=0;j<mb.size();j++)
+				budgets.push_back((UINT64)(atof(mb[j].c_str())*1024*1024));
+		}
+		else if(!strcmp(argv[i],"-p") && i+1<argc)
+			policies = split(argv[++i]);
+		else if(!strcmp(argv[i],"-csv"))
+			csv = true;
+		else
+		{
+			fprintf(stderr,"Unknown argument %s.\n",argv[i]);
+			return 1;
+		}
+	}
+
+	std::vector<TexTraceRecord> records;
+	if(!loadTrace(argv[1],records))
+		return 1;
+
+	//Trace summary
+	std::map<UINT64,unsigned int> sizes;
+	UINT64 binds = 0, frames = 0;
+	for(size_t i=0;i<records.size();i++)
+	{
+		UINT64 id = records[i].id;
+		if(records[i].type==TEXTRACE_FRAME)
+			frames++;
+		else if(records[i].type!=TEXTRACE_DELETE)
+		{
+			sizes[id] = records[i].value;
+			if(records[i].type==TEXTRACE_BIND)
+				binds++;
+		}
+	}
+	UINT64 total = 0;
+	for(std::map<UINT64,unsigned int>::iterator i=sizes.begin();i!=sizes.end();i++)
+		total += i->second;
+	if(budgets.empty())
+	{
+		budgets.push_back(total/10);
+		budgets.push_back(total/4);
+		budgets.push_back(total/2);
+		budgets.push_back(total);
+	}
+
+	if(csv)
+		printf("policy,budget_mb,binds,misses,miss_rate,reupload_mb,worst_frame,worst_frame_mb\n");
+	else
+	{
+		printf("%llu frames, %llu binds, %u textures, %.1f MB total\n\n",frames,binds,(unsigned int)sizes.size(),total/1048576.0);
+		printf("%-6s %10s %10s %8s %12s %12s %14s\n","Policy","Budget MB","Misses","Miss %","Reupload MB","Worst frame","Worst frame MB");
+	}
+	for(size_t b=0;b<budgets.size();b++)
+	{
+		for(size_t p=0;p<policies.size();p++)
+		{
+			Policy *policy = createPolicy(policies[p],budgets[b]);
+			if(policy==NULL)
+			{
+				fprintf(stderr,"Unknown policy %s.\n",policies[p].c_str());
+				return 1;
+			}
+			Result r = simulate(records,*policy,budgets[b]);
+			delete policy;
+
+			double missRate = r.binds ? 100.0*r.misses/r.binds : 0;
+			if(csv)
+				printf("%s,%.2f,%llu,%llu,%.3f,%.2f,%u,%.2f\n",r.policy.c_str(),r.budget/1048576.0,r.binds,r.misses,missRate,r.reuploadBytes/1048576.0,r.worstFrame,r.worstFrameBytes/1048576.0);
+			else
+				printf("%-6s %10.1f %10llu %8.2f %12.1f %12u %14.2f\n",r.policy.c_str(),r.budget/1048576.0,r.misses,missRate,r.reuploadBytes/1048576.0,r.worstFrame,r.worstFrameBytes/1048576.0);
+		}
+		if(!csv)
+			printf("\n");
+	}
+	return 0;
+}
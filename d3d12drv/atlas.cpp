@@ -0,0 +1,164 @@
+/**
+\class Atlas
+Packs small rectangles into one large texture page. API independent; the D3D class owns the actual page textures.
+
+Used for lightmaps and fog maps: these are small, numerous and almost unique per surface. Having each in its own texture means
+every surface needs a texture switch, and so a commit, for its lightmap. With the maps sharing a page, the switch is skipped.
+
+A shelf packer is used: rectangles are placed left to right on horizontal shelves; a new shelf is opened when no existing one fits.
+Lightmap heights cluster around a handful of values, so this wastes little space while being very fast.
+Freed rectangles are kept in a list; an allocation that fits in one takes its top left corner and the rest goes back on the list. Freed
+neighbours are merged again, and slivers too small for any map are dropped. Pages are not defragmented in place; instead they're thrown away
+and rebuilt when the texture cache is flushed (i.e. on map change).
+*/
+
+#include <algorithm>
+#include "atlas.h"
+
+/** Shelves are only reused for rectangles at least this fraction of their height, to limit wasted space */
+static const float SHELF_FIT = 0.7f;
+
+/** Freed space narrower or lower than this is not kept; no map with its border is that small */
+static const int MIN_FREE_SIZE = 4;
+
+/**
+\param width Page width in texels.
+\param height Page height in texels.
+*/
+Atlas::Atlas(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	clear();
+}
+
+/**
+Find room for a rectangle.
+\param w Width.
+\param h Height.
+\param rect Receives the allocated rectangle's position and size.
+\return true if the rectangle fits; false if the page is full.
+*/
+bool Atlas::alloc(int w, int h, Atlas::Rect &rect)
+{
+	if(w>width || h>height)
+		return false;
+
+	//Reuse the smallest freed rectangle that fits
+	int best = -1;
+	for(unsigned int i=0;i<freeRects.size();i++)
+	{
+		if(freeRects[i].w>=w && freeRects[i].h>=h && (best==-1 || freeRects[i].w*freeRects[i].h < freeRects[best].w*freeRects[best].h))
+			best = i;
+	}
+	if(best!=-1)
+	{
+		//Take the top left corner; the part to the right (full height) and the part below go back on the list
+		Rect r = freeRects[best];
+		freeRects.erase(freeRects.begin()+best);
+		rect.x = r.x;
+		rect.y = r.y;
+		rect.w = w;
+		rect.h = h;
+		Rect right = {r.x+w,r.y,r.w-w,r.h};
+		Rect below = {r.x,r.y+h,w,r.h-h};
+		addFreeRect(right);
+		addFreeRect(below);
+		usedArea += w*h;
+		return true;
+	}
+
+	//Find the lowest existing shelf with room
+	int bestShelf = -1;
+	for(unsigned int i=0;i<shelves.size();i++)
+	{
+		Shelf &s = shelves[i];
+		if(s.height>=h && h>=s.height*SHELF_FIT && width-s.used>=w)
+		{
+			if(bestShelf==-1 || s.height<shelves[bestShelf].height)
+				bestShelf = i;
+		}
+	}
+
+	//Open a new shelf if needed
+	if(bestShelf==-1)
+	{
+		if(nextY+h>height)
+			return false;
+		Shelf s = {nextY,h,0};
+		shelves.push_back(s);
+		nextY += h;
+		bestShelf = shelves.size()-1;
+	}
+
+	Shelf &s = shelves[bestShelf];
+	rect.x = s.used;
+	rect.y = s.y;
+	rect.w = w;
+	rect.h = h;
+	s.used += w;
+	usedArea += w*h;
+	return true;
+}
+
+/**
+Return a rectangle to the page so it can be reused.
+*/
+void Atlas::free(const Atlas::Rect &rect)
+{
+	usedArea -= rect.w*rect.h;
+	addFreeRect(rect);
+}
+
+/**
+Put free space on the list, merged with free neighbours that share a whole edge with it. Merging repeats as long as the grown rectangle
+lines up with another one.
+*/
+void Atlas::addFreeRect(Atlas::Rect rect)
+{
+	bool merged = true;
+	while(merged)
+	{
+		merged = false;
+		for(unsigned int i=0;i<freeRects.size();i++)
+		{
+			const Rect &f = freeRects[i];
+			if(f.y==rect.y && f.h==rect.h && (f.x+f.w==rect.x || rect.x+rect.w==f.x)) //Side by side
+			{
+				rect.x = std::min(rect.x,f.x);
+				rect.w += f.w;
+			}
+			else if(f.x==rect.x && f.w==rect.w && (f.y+f.h==rect.y || rect.y+rect.h==f.y)) //Stacked
+			{
+				rect.y = std::min(rect.y,f.y);
+				rect.h += f.h;
+			}
+			else
+				continue;
+			freeRects.erase(freeRects.begin()+i);
+			merged = true;
+			break;
+		}
+	}
+	if(rect.w>=MIN_FREE_SIZE && rect.h>=MIN_FREE_SIZE)
+		freeRects.push_back(rect);
+}
+
+/**
+Empty the page.
+*/
+void Atlas::clear()
+{
+	nextY = 0;
+	usedArea = 0;
+	shelves.clear();
+	freeRects.clear();
+}
+
+/**
+\return Fraction of the page that's allocated.
+*/
+float Atlas::getUsage() const
+{
+	return (float)usedArea/(float)(width*height);
+}
@@ -0,0 +1,45 @@
+/**
+\file atlas.h
+*/
+
+#pragma once
+#include <vector>
+
+class Atlas
+{
+public:
+	/** Rectangle inside the atlas, in texels */
+	struct Rect
+	{
+		int x,y;
+		int w,h;
+	};
+
+	Atlas(int width, int height);
+
+	bool alloc(int w, int h, Atlas::Rect &rect);
+	void free(const Atlas::Rect &rect);
+	void clear();
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	float getUsage() const;
+
+private:
+	/** Horizontal strip of rectangles of (roughly) equal height */
+	struct Shelf
+	{
+		int y; /**< Top of the shelf */
+		int height; /**< Height of the shelf */
+		int used; /**< Width already allocated, from the left */
+	};
+
+	int width;
+	int height;
+	int nextY; /**< Top of the next shelf to open */
+	int usedArea;
+	std::vector<Atlas::Shelf> shelves;
+	std::vector<Atlas::Rect> freeRects; /**< Freed rectangles; allocations that fit take part of one, see alloc() */
+
+	void addFreeRect(Atlas::Rect rect);
+};
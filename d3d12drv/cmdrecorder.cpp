@@ -0,0 +1,248 @@
+/**
+\class CommandRecorder
+Records a frame's draw calls and clears into a D3D12 command list, as they are made.
+
+Draws carry their pipeline state and buffers, but textures, blend and depth state are still set through the effect framework on the
+device context, which takes effect right away. So draws are recorded immediately, in one list, and the list is executed before any
+other work that has to come after them, such as texture uploads; see execute(). Depth and color clears are recorded into the same
+list so they fall between the draws they were made between.
+Each frame in flight has its own allocators, which are reset once the fence shows the GPU is done with them.
+Besides the draw list there's a frame list, open during the whole frame, for work that has to come after all draws (copies etc.).
+*/
+
+#include "include/directx/d3dx12.h"
+#include "cmdrecorder.h"
+#include "d3d12drv.h"
+
+CommandRecorder::CommandRecorder() : numFrames(0), frame(0), fence(NULL), fenceEvent(NULL), hasViewport(false), hasLast(false), recorded(false)
+{
+	ZeroMemory(&setup,sizeof(setup));
+	ZeroMemory(&stats,sizeof(stats));
+	ZeroMemory(&lastStats,sizeof(lastStats));
+}
+
+/**
+Create the command allocators and lists.
+\param device Device to create them with.
+\param fence Fence that endFrame()'s values are signaled on.
+\param framesInFlight Number of frames the GPU may be behind; each needs its own allocators.
+\param setup Root signature and pipeline states the draws use; must stay valid.
+\return false on failure.
+*/
+bool CommandRecorder::init(ID3D12Device *device, ID3D12Fence *fence, int framesInFlight, const CommandRecorder::Setup &setup)
+{
+	HRESULT hr;
+	numFrames = framesInFlight<1 ? 1 : (framesInFlight>MAX_FRAMES ? MAX_FRAMES : framesInFlight);
+	for(int f=0;f<numFrames;f++)
+	{
+		for(int i=0;i<2;i++)
+		{
+			hr = device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,IID_PPV_ARGS(frames[f].allocators[i].GetAddressOf()));
+			if(FAILED(hr))
+			{
+				UD3D12RenderDevice::debugs("Error creating command allocator.");
+				return false;
+			}
+			Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList> &list = i==0 ? frames[f].drawList : frames[f].frameList;
+			hr = device->CreateCommandList(0,D3D12_COMMAND_LIST_TYPE_DIRECT,frames[f].allocators[i].Get(),nullptr,IID_PPV_ARGS(list.GetAddressOf()));
+			if(FAILED(hr))
+			{
+				UD3D12RenderDevice::debugs("Error creating command list.");
+				return false;
+			}
+			list->Close(); //Lists are reset before use
+		}
+		frames[f].fenceValue = 0;
+	}
+
+	fenceEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+	this->fence = fence;
+	this->setup = setup;
+	frame = 0;
+	hasViewport = false;
+	ZeroMemory(&stats,sizeof(stats));
+	ZeroMemory(&lastStats,sizeof(lastStats));
+	frames[frame].drawList->Reset(frames[frame].allocators[0].Get(),nullptr);
+	frames[frame].frameList->Reset(frames[frame].allocators[1].Get(),nullptr);
+	return true;
+}
+
+/**
+Release the allocators and lists. The GPU must be done with them.
+*/
+void CommandRecorder::uninit()
+{
+	for(int f=0;f<numFrames;f++)
+	{
+		frames[f].drawList.Reset();
+		frames[f].frameList.Reset();
+		for(int i=0;i<2;i++)
+		{
+			frames[f].allocators[i].Reset();
+		}
+	}
+	if(fenceEvent)
+		CloseHandle(fenceEvent);
+	fenceEvent = NULL;
+	numFrames = 0;
+}
+
+/**
+Set the targets for the frame's draws and set up the draw list. Call after init() and after each endFrame().
+*/
+void CommandRecorder::beginFrame(D3D12_CPU_DESCRIPTOR_HANDLE renderTarget, D3D12_CPU_DESCRIPTOR_HANDLE depthStencil)
+{
+	this->renderTarget = renderTarget;
+	this->depthStencil = depthStencil;
+	startList();
+}
+
+/**
+Set up the open draw list with the state every draw needs; nothing is assumed about what was set before.
+*/
+void CommandRecorder::startList()
+{
+	ID3D12GraphicsCommandList *list = frames[frame].drawList.Get();
+	list->SetGraphicsRootSignature(setup.rootSignature);
+	list->OMSetRenderTargets(1,&renderTarget,FALSE,&depthStencil);
+	if(hasViewport)
+	{
+		D3D12_RECT scissor = {(LONG)viewport.TopLeftX,(LONG)viewport.TopLeftY,(LONG)(viewport.TopLeftX+viewport.Width),(LONG)(viewport.TopLeftY+viewport.Height)};
+		list->RSSetViewports(1,&viewport);
+		list->RSSetScissorRects(1,&scissor);
+	}
+	topology = D3D_PRIMITIVE_TOPOLOGY_UNDEFINED;
+	surfaceTable = 0;
+	hasLast = false;
+}
+
+/**
+Set the viewport for the draws that follow; the scissor rectangle is set to match.
+*/
+void CommandRecorder::setViewport(const D3D12_VIEWPORT &viewport)
+{
+	this->viewport = viewport;
+	hasViewport = true;
+	D3D12_RECT scissor = {(LONG)viewport.TopLeftX,(LONG)viewport.TopLeftY,(LONG)(viewport.TopLeftX+viewport.Width),(LONG)(viewport.TopLeftY+viewport.Height)};
+	ID3D12GraphicsCommandList *list = frames[frame].drawList.Get();
+	list->RSSetViewports(1,&viewport);
+	list->RSSetScissorRects(1,&scissor);
+}
+
+/**
+Record a draw.
+\param d The draw.
+\note A viewport must have been set; the D3D class sets one covering the whole target at startup and on resize.
+*/
+void CommandRecorder::draw(const CommandRecorder::Draw &d)
+{
+	ID3D12GraphicsCommandList *list = frames[frame].drawList.Get();
+	if(!hasLast || d.pipelineState!=last.pipelineState)
+	{
+		list->SetPipelineState(setup.pipelineStates[d.pipelineState]);
+		if(setup.topologies[d.pipelineState]!=topology)
+		{
+			topology = setup.topologies[d.pipelineState];
+			list->IASetPrimitiveTopology(topology);
+		}
+	}
+	bool indexed = d.indexBuffer.BufferLocation!=0;
+	if(indexed && (!hasLast || memcmp(&d.indexBuffer,&last.indexBuffer,sizeof(d.indexBuffer))))
+		list->IASetIndexBuffer(&d.indexBuffer);
+	if(!hasLast || memcmp(&d.vertexBuffer,&last.vertexBuffer,sizeof(d.vertexBuffer)))
+		list->IASetVertexBuffers(0,1,&d.vertexBuffer);
+	if(d.surfaceTable!=0 && d.surfaceTable!=surfaceTable)
+	{
+		list->SetGraphicsRootShaderResourceView(1,d.surfaceTable);
+		surfaceTable = d.surfaceTable;
+	}
+	if(indexed)
+		list->DrawIndexedInstanced(d.numIndices,d.numInstances,d.startIndex,d.baseVertex,d.startInstance);
+	else
+		list->DrawInstanced(d.numIndices,d.numInstances,d.baseVertex,d.startInstance);
+	last = d;
+	hasLast = true;
+	recorded = true;
+	stats.draws++;
+}
+
+/**
+Record a clear of the render target, between the draws made before and after it.
+*/
+void CommandRecorder::clearRenderTarget(const float color[4])
+{
+	frames[frame].drawList->ClearRenderTargetView(renderTarget,color,0,nullptr);
+	recorded = true;
+	stats.clears++;
+}
+
+/**
+Record a clear of the depth buffer, between the draws made before and after it.
+*/
+void CommandRecorder::clearDepth()
+{
+	frames[frame].drawList->ClearDepthStencilView(depthStencil,D3D12_CLEAR_FLAG_DEPTH,1.0f,0,0,nullptr);
+	recorded = true;
+	stats.clears++;
+}
+
+/**
+Execute what was recorded so far and continue in a fresh list from the same allocator. Call before work outside the list that
+has to come after the draws made up to now, e.g. overwriting a texture they sample.
+\param queue Queue to execute on.
+*/
+void CommandRecorder::execute(ID3D12CommandQueue *queue)
+{
+	if(!recorded)
+		return;
+	ID3D12GraphicsCommandList *list = frames[frame].drawList.Get();
+	list->Close();
+	ID3D12CommandList *lists[] = {list};
+	queue->ExecuteCommandLists(1,lists);
+	list->Reset(frames[frame].allocators[0].Get(),nullptr);
+	startList();
+	recorded = false;
+	stats.lists++;
+}
+
+/**
+Close the draw list and the frame list and execute them, in that order.
+\param queue Queue to execute on.
+*/
+void CommandRecorder::executeFrame(ID3D12CommandQueue *queue)
+{
+	CommandRecorder::Frame &f = frames[frame];
+	f.drawList->Close();
+	f.frameList->Close();
+	ID3D12CommandList *lists[] = {f.drawList.Get(),f.frameList.Get()};
+	queue->ExecuteCommandLists(2,lists);
+	recorded = false;
+	stats.lists++;
+}
+
+/**
+End the frame and start the next, reusing the allocators of the oldest frame in flight once the GPU is done with them.
+The draw list has to be set up with beginFrame() before anything is recorded.
+\param fenceValue Fence value signaled after the frame's lists were executed.
+*/
+void CommandRecorder::endFrame(UINT64 fenceValue)
+{
+	frames[frame].fenceValue = fenceValue;
+	lastStats = stats;
+	ZeroMemory(&stats,sizeof(stats));
+
+	frame = (frame+1)%numFrames;
+	CommandRecorder::Frame &f = frames[frame];
+	if(fence->GetCompletedValue()<f.fenceValue)
+	{
+		fence->SetEventOnCompletion(f.fenceValue,fenceEvent);
+		WaitForSingleObject(fenceEvent,INFINITE);
+		stats.waits++;
+	}
+	for(int i=0;i<2;i++)
+	{
+		f.allocators[i]->Reset();
+	}
+	f.drawList->Reset(f.allocators[0].Get(),nullptr);
+	f.frameList->Reset(f.allocators[1].Get(),nullptr);
+}
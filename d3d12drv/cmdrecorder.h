@@ -0,0 +1,90 @@
+/**
+\file cmdrecorder.h
+*/
+
+#pragma once
+#include <d3d12.h>
+#include <wrl.h>
+
+class CommandRecorder
+{
+public:
+	static const int MAX_FRAMES = 8; /**< Most frames in flight */
+
+	/** A draw call along with the buffers it needs; the recorder only sets what changed since the previous draw in the list */
+	struct Draw
+	{
+		UINT pipelineState; /**< Index into Setup::pipelineStates */
+		D3D12_INDEX_BUFFER_VIEW indexBuffer; /**< All zero for draws without indices */
+		D3D12_VERTEX_BUFFER_VIEW vertexBuffer;
+		UINT numIndices; /**< Number of vertices for draws without indices */
+		UINT startIndex;
+		INT baseVertex; /**< First vertex for draws without indices */
+		UINT numInstances; /**< 1 for plain draws */
+		UINT startInstance;
+		D3D12_GPU_VIRTUAL_ADDRESS surfaceTable; /**< Map surface table, root parameter 1; 0 for draws that don't use it */
+	};
+
+	/** Objects the draw list is set up with */
+	struct Setup
+	{
+		ID3D12RootSignature *rootSignature;
+		ID3D12PipelineState *const *pipelineStates;
+		const D3D_PRIMITIVE_TOPOLOGY *topologies; /**< Primitive topology each pipeline state draws */
+	};
+
+	/** Recording counters for the last frame */
+	struct Stats
+	{
+		DWORD draws;
+		DWORD clears;
+		int lists; /**< Times the draw list was executed; more than once if work outside it had to follow its draws */
+		DWORD waits; /**< Times reusing a frame's command allocators had to wait for the GPU */
+	};
+
+	CommandRecorder();
+
+	bool init(ID3D12Device *device, ID3D12Fence *fence, int framesInFlight, const CommandRecorder::Setup &setup);
+	void uninit();
+
+	void beginFrame(D3D12_CPU_DESCRIPTOR_HANDLE renderTarget, D3D12_CPU_DESCRIPTOR_HANDLE depthStencil);
+	void setViewport(const D3D12_VIEWPORT &viewport);
+	void draw(const CommandRecorder::Draw &d);
+	void clearRenderTarget(const float color[4]);
+	void clearDepth();
+	void execute(ID3D12CommandQueue *queue);
+	ID3D12GraphicsCommandList *getFrameList() const { return frames[frame].frameList.Get(); }
+	void executeFrame(ID3D12CommandQueue *queue);
+	void endFrame(UINT64 fenceValue);
+	const CommandRecorder::Stats &getStats() const { return lastStats; }
+
+private:
+	/** Command allocators and lists for one frame in flight */
+	struct Frame
+	{
+		Microsoft::WRL::ComPtr<ID3D12CommandAllocator> allocators[2]; /**< For the draw list and the frame list */
+		Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList> drawList; /**< Draws and clears, in the order they were made */
+		Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList> frameList; /**< Open during the whole frame, for work done after the draws */
+		UINT64 fenceValue; /**< Signaled once the GPU is done with the frame's lists */
+	};
+
+	void startList();
+
+	Frame frames[MAX_FRAMES];
+	int numFrames;
+	int frame; /**< Frame being recorded */
+	ID3D12Fence *fence;
+	HANDLE fenceEvent;
+	CommandRecorder::Setup setup;
+	D3D12_CPU_DESCRIPTOR_HANDLE renderTarget;
+	D3D12_CPU_DESCRIPTOR_HANDLE depthStencil;
+	D3D12_VIEWPORT viewport; /**< Set on every list the frame's draws go into */
+	bool hasViewport;
+	CommandRecorder::Draw last; /**< Previous draw in the open list */
+	bool hasLast;
+	D3D_PRIMITIVE_TOPOLOGY topology;
+	D3D12_GPU_VIRTUAL_ADDRESS surfaceTable; /**< Kept across draws that don't use it */
+	bool recorded; /**< Whether anything was recorded since the draw list was last executed */
+	CommandRecorder::Stats stats;
+	CommandRecorder::Stats lastStats;
+};
@@ -9,7 +9,6 @@ An effort is made to reduce the amount of needed draw() calls. As such, state is
 
 TODO:
 Take out D3Dx?
-Different shaders/input layouts for different drawXXXX renderer calls for smaller vertex size?
 
 */
 #ifdef _DEBUG
@@ -22,11 +21,20 @@ Different shaders/input layouts for different drawXXXX renderer calls for smalle
 #include <DirectXPackedVector.h>
 #include <D3dcompiler.h> // D3DX11async.h -> D3dcompiler.h
 #include <wrl.h>
+#include <stdio.h>
+#include <stddef.h>
 #include <hash_map>
+#include <vector>
+#include <algorithm>
 #include "include/directx/d3dx12.h"
 #include "d3d12drv.h"
 #include "polyflags.h" //for polyflags
 #include "d3d.h"
+#include "textrace.h"
+#include "uploadring.h"
+#include "cmdrecorder.h"
+#include "vertexstaging.h"
+#include "misc.h"
 
 // Link necessary d3d12 libraries
 #pragma comment(lib,"d3dcompiler.lib")
@@ -52,14 +60,13 @@ static struct
 	ComPtr<ID3D12CommandAllocator> cmdAlloc;
 	ComPtr<ID3D12GraphicsCommandList> cmdList;
 	ComPtr<ID3D12RootSignature> rootSig;
-	ComPtr<ID3D12PipelineState> pipelineState;
+	ComPtr<ID3D12PipelineState> pipelineStates[D3D::DUMMY_NUM_VERTEX_FORMATS]; /**< One per vertex format */
 	ComPtr<ID3D12Resource> renderTargetView;
 	ComPtr<ID3D12Resource> depthStencilView;
-	ID3D11InputLayout* vertexLayout;
-	ComPtr<ID3D12Resource> vertexBuf = nullptr;
-	ComPtr<ID3D12Resource> vertexBufUploader = nullptr;
-	ComPtr<ID3D12Resource> indexBuf;
+	ID3D11InputLayout* vertexLayouts[D3D::DUMMY_NUM_VERTEX_FORMATS];
 	ID3DX11Effect* effect;
+	ComPtr<ID3D12Resource> indexTemplates; /**< Fan index templates, see createIndexTemplates() */
+	ComPtr<ID3D12Resource> geometryCache; /**< Static geometry cache vertices and indices, see drawCachedGeometry() */
 	ComPtr<ID3D12DescriptorHeap> rtvHeap;
 	ComPtr<ID3D12DescriptorHeap> dsvHeap;
 } D3DObjects;
@@ -70,9 +77,12 @@ Shader side variables
 static struct
 {
 	ID3DX11EffectMatrixVariable* projection; /**< projection matrix */
+	ID3DX11EffectMatrixVariable* view; /**< World to view transform, for world space map geometry */
 	ID3DX11EffectScalarVariable* projectionMode; /**< Projection transform mode (near/far) */
 	ID3DX11EffectScalarVariable* useTexturePass; /**< Bool whether to use each texture pass (shader side) */
 	ID3DX11EffectShaderResourceVariable* shaderTextures; /**< GPU side currently bound textures */
+	ID3DX11EffectScalarVariable* passFormat; /**< Storage format of each bound texture, see D3D::ShaderFormat */
+	ID3DX11EffectScalarVariable* passAlpha; /**< Constant alpha of each bound texture, for formats without alpha */
 	ID3DX11EffectVectorVariable* flashColor; /**< Flash color */
 	ID3DX11EffectScalarVariable* flashEnable; /**< Flash enabled? */
 	ID3DX11EffectScalarVariable* time; /**< Time for sin() etc */
@@ -105,7 +115,10 @@ Texture cache variables
 static struct
 {
 	DWORD64 boundTextureID[D3D::DUMMY_NUM_PASSES]; /**< CPU side bound texture IDs for the various passes as defined in the shader */
+	ID3D11ShaderResourceView* boundView[D3D::DUMMY_NUM_PASSES]; /**< Resource views bound for the passes; textures sharing an atlas page share a view */
 	BOOL enabled[D3D::DUMMY_NUM_PASSES]; /**< Bool whether to use each texture pass (CPU side, used to set shaderVars.useTexturePass) */
+	int format[D3D::DUMMY_NUM_PASSES]; /**< Storage format of each bound texture (CPU side, used to set shaderVars.passFormat) */
+	float alpha[D3D::DUMMY_NUM_PASSES]; /**< Constant alpha of each bound texture (CPU side, used to set shaderVars.passAlpha) */
 } texturePasses;
 
 /*
@@ -114,16 +127,618 @@ The texture cache
 stdext::hash_map <unsigned __int64,D3D::CachedTexture> textureCache;
 
 /*
-Triangle fans are drawn indexed. Their vertices and draw indexes are stored in mapped buffers.
-At the start of a frame or when the buffer is full, it gets emptied. Otherwise, the buffer is reused over multiple draw() calls.
+Atlas pages for lightmaps and fog maps. See the Atlas class.
+Each map is stored with a guard border of repeated edge texels so filtering doesn't pick up its neighbours.
 */
-const unsigned int I_BUFFER_SIZE = 20000; //20000 measured to be about max
+static const int ATLAS_PAGE_SIZE = 1024;
+static const int ATLAS_BORDER = 2;
+static const int ATLAS_MAX_SIZE = 256; //Larger maps get their own texture
+struct AtlasPage
+{
+	Atlas* packer;
+	ID3D11Texture2D* texture;
+	ID3D11ShaderResourceView* resourceView;
+	DXGI_FORMAT format;
+	float constAlpha; /**< Maps stored without alpha must agree on it to share a page */
+};
+static std::vector<AtlasPage> atlasPages;
+
+/**
+Bytes per texel for formats that can be stored in an atlas page.
+\return 0 if the format can't be atlased.
+*/
+static UINT atlasTexelSize(DXGI_FORMAT format)
+{
+	switch(format)
+	{
+		case DXGI_FORMAT_R8G8B8A8_UNORM:
+			return 4;
+		case DXGI_FORMAT_B5G6R5_UNORM:
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+/**
+Write a map into its atlas rectangle, repeating the edge texels into the guard border.
+\param page Atlas page.
+\param rect Rectangle including border.
+\param data Map data; size is the rectangle minus border.
+*/
+static void updateAtlasRect(AtlasPage &page, const Atlas::Rect &rect, D3D11_SUBRESOURCE_DATA &data)
+{
+	UINT texelSize = atlasTexelSize(page.format);
+	int w = rect.w-2*ATLAS_BORDER;
+	int h = rect.h-2*ATLAS_BORDER;
+	BYTE* bordered = new BYTE[rect.w*rect.h*texelSize];
+	for(int row=0;row<rect.h;row++)
+	{
+		int srcRow = row-ATLAS_BORDER;
+		CLAMP(srcRow,0,h-1);
+		const BYTE* src = (const BYTE*)data.pSysMem + srcRow*data.SysMemPitch;
+		BYTE* dst = bordered + row*rect.w*texelSize;
+		for(int col=0;col<ATLAS_BORDER;col++) //Left border
+			memcpy(dst+col*texelSize,src,texelSize);
+		memcpy(dst+ATLAS_BORDER*texelSize,src,w*texelSize);
+		for(int col=ATLAS_BORDER+w;col<rect.w;col++) //Right border
+			memcpy(dst+col*texelSize,src+(w-1)*texelSize,texelSize);
+	}
+
+	D3D11_BOX box = {rect.x,rect.y,0,rect.x+rect.w,rect.y+rect.h,1};
+	D3DObjects.deviceContext->UpdateSubresource(page.texture,0,&box,bordered,rect.w*texelSize,0);
+	delete [] bordered;
+}
+
+/*
+Mip streaming. Large static textures are created with only their small mips filled in, and a resource view clamped to those so sampling never
+touches the empty levels. The other mips are kept in system memory and uploaded a level at a time at the start of each frame, within a budget;
+each uploaded level gets the texture a new view with a lower clamp. Textures bound often and recently go first.
+*/
+static const UINT STREAM_MIN_SIZE = 256; //Textures smaller than this in both dimensions are uploaded whole
+static const UINT STREAM_RESIDENT_SIZE = 64; //Mips up to this size are uploaded right away
+struct StreamingTexture
+{
+	ID3D11Texture2D* texture;
+	std::vector<BYTE*> mips; /**< Copies of the mips still to upload, by level; NULL for uploaded ones */
+	std::vector<UINT> pitches;
+	std::vector<UINT> sizes;
+};
+static stdext::hash_map<DWORD64,StreamingTexture> streamingTextures;
+static DWORD frameCount; //For texture bind recency
+
+/**
+Work out the memory layout of a mip.
+\param format Texture format.
+\param width Mip width.
+\param height Mip height.
+\param rowBytes Receives the size of a row of texels (or blocks for compressed formats).
+\param rows Receives the number of rows.
+*/
+static void mipLayout(DXGI_FORMAT format, UINT width, UINT height, UINT &rowBytes, UINT &rows)
+{
+	switch(format)
+	{
+		case DXGI_FORMAT_BC1_UNORM:
+			rowBytes = max((width+3)/4,1)*8;
+			rows = max((height+3)/4,1);
+			return;
+		case DXGI_FORMAT_B5G6R5_UNORM:
+			rowBytes = width*2;
+			break;
+		case DXGI_FORMAT_R8_UNORM:
+			rowBytes = width;
+			break;
+		default:
+			rowBytes = width*4;
+	}
+	rows = height;
+}
+
+/**
+Create a resource view for a texture that skips its most detailed mips.
+\param texture Texture.
+\param mostDetailedMip First mip the view covers.
+\return NULL on failure.
+*/
+static ID3D11ShaderResourceView *createClampedView(ID3D11Texture2D *texture, UINT mostDetailedMip)
+{
+	D3D11_TEXTURE2D_DESC desc;
+	texture->GetDesc(&desc);
+	D3D11_SHADER_RESOURCE_VIEW_DESC srDesc;
+	srDesc.Format = desc.Format;
+	srDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+	srDesc.Texture2D.MostDetailedMip = mostDetailedMip;
+	srDesc.Texture2D.MipLevels = desc.MipLevels-mostDetailedMip;
+	ID3D11ShaderResourceView *view;
+	if(FAILED(D3DObjects.device->CreateShaderResourceView(texture,&srDesc,&view)))
+	{
+		UD3D12RenderDevice::debugs("Error creating streamed texture shader resource view.");
+		return NULL;
+	}
+	return view;
+}
+
+/**
+Stop streaming a texture, freeing its pending mips.
+*/
+static void releaseStreamingTexture(stdext::hash_map<DWORD64,StreamingTexture>::iterator i)
+{
+	for(unsigned int m=0;m<i->second.mips.size();m++)
+	{
+		delete [] i->second.mips[m];
+	}
+	SAFE_RELEASE(i->second.texture);
+	streamingTextures.erase(i);
+}
+
+/*
+Texture statistics, see D3D::TextureStats. Bytes are counted from the texture descriptions, so they're what was asked for, not what the driver allocates.
+*/
+static stdext::hash_map<DWORD64,D3D::TextureStats> textureStats;
+static D3D::CacheStats frameStats; //Counters for the frame being drawn
+static D3D::CacheStats lastFrameStats; //Counters for the last complete frame
+
+static FILE *traceFile; //Texture cache trace being written, see textrace.h
+
+/**
+Append a record to the texture cache trace, if one is being written.
+*/
+static void traceRecord(TexTraceRecordType type, DWORD64 id, UINT value)
+{
+	if(traceFile==NULL)
+		return;
+	TexTraceRecord r;
+	r.type = type;
+	r.id = id;
+	r.value = value;
+	fwrite(&r,sizeof(r),1,traceFile);
+}
+
+/**
+\return Statistics entry for a texture; created if needed.
+*/
+static D3D::TextureStats &getStats(DWORD64 id)
+{
+	stdext::hash_map<DWORD64,D3D::TextureStats>::iterator i = textureStats.find(id);
+	if(i!=textureStats.end())
+		return i->second;
+	D3D::TextureStats s;
+	memset(&s,0,sizeof(s));
+	s.id = id;
+	s.format = "";
+	return textureStats[id] = s;
+}
+
+/**
+\return Readable name for texture formats we use.
+*/
+static const char *formatName(DXGI_FORMAT format)
+{
+	switch(format)
+	{
+		case DXGI_FORMAT_R8G8B8A8_UNORM:
+			return "RGBA8";
+		case DXGI_FORMAT_BC1_UNORM:
+			return "BC1";
+		case DXGI_FORMAT_B5G6R5_UNORM:
+			return "B5G6R5";
+		case DXGI_FORMAT_R8_UNORM:
+			return "R8";
+		default:
+			return "Other";
+	}
+}
+
+/**
+\return Size of all mips of a texture.
+*/
+static UINT textureBytes(const D3D11_TEXTURE2D_DESC &desc)
+{
+	UINT bytes = 0;
+	for(UINT i=0;i<desc.MipLevels;i++)
+	{
+		UINT rowBytes, rows;
+		mipLayout(desc.Format,max(desc.Width>>i,1),max(desc.Height>>i,1),rowBytes,rows);
+		bytes += rowBytes*rows;
+	}
+	return bytes;
+}
+
+/**
+Record an upload of texture data.
+*/
+static void recordUpload(DWORD64 id, UINT bytes)
+{
+	D3D::TextureStats &s = getStats(id);
+	s.uploads++;
+	s.uploadBytes += bytes;
+	frameStats.uploads++;
+	frameStats.uploadBytes += bytes;
+}
+
+/**
+Record a texture being (re)created.
+\param id CacheID.
+\param desc Description of the texture as it would be created on its own.
+\param uploadBytes Data uploaded on creation.
+*/
+static void recordCreation(DWORD64 id, const D3D11_TEXTURE2D_DESC &desc, UINT uploadBytes)
+{
+	D3D::TextureStats &s = getStats(id);
+	s.format = formatName(desc.Format);
+	s.width = desc.Width;
+	s.height = desc.Height;
+	s.mips = desc.MipLevels;
+	s.bytes = textureBytes(desc);
+	s.creations++;
+	recordUpload(id,uploadBytes);
+	traceRecord(TEXTRACE_CREATE,id,s.bytes);
+}
+
+/**
+Record a texture bind.
+*/
+static void recordBind(DWORD64 id)
+{
+	D3D::TextureStats &s = getStats(id);
+	if(s.lastFrame!=frameCount)
+	{
+		s.lastFrame = frameCount;
+		s.frameBinds = 0;
+	}
+	s.binds++;
+	s.frameBinds++;
+	s.maxFrameBinds = max(s.maxFrameBinds,s.frameBinds);
+	frameStats.binds++;
+	traceRecord(TEXTRACE_BIND,id,s.bytes);
+}
+
+/**
+Record a commit of buffered geometry caused by a texture.
+*/
+static void recordCommit(DWORD64 id)
+{
+	getStats(id).commits++;
+	frameStats.commits++;
+}
+
+/*
+Triangle fans are drawn indexed. Their vertices and draw indexes are stored in a batch allocated from the upload ring; indices first, then vertices.
+At the start of a frame a new batch is allocated. Otherwise, the batch is reused over multiple draw() calls.
+A batch is made of chunks. When a chunk is full, the next one is allocated and buffering goes on in it; each draw run remembers its chunk,
+so there's no need to draw what was buffered so far. Chunks are sized at the start of each frame for the most geometry a recent frame used,
+between MIN_CHUNK_INDICES and I_BUFFER_SIZE indices (with proportional vertex room), so a typical frame fits in one chunk.
+With the ShortIndices option, batch and template indices are 16 bit; a chunk never holds more vertices than that can address.
+*/
+const unsigned int I_BUFFER_SIZE = 20000; //Largest chunk; 20000 measured to be about max per batch before chunks were chained
 const unsigned int V_BUFFER_SIZE = I_BUFFER_SIZE; //In worst case, one point for each index
-static unsigned int numVerts; //Number of buffered verts
+const unsigned int I_BUFFER_BYTES = I_BUFFER_SIZE*sizeof(int); //Index room with 32 bit indices; the most a chunk needs
+const unsigned int V_BUFFER_BYTES = V_BUFFER_SIZE*sizeof(D3D::Vertex); //Vertex buffer size; sized for the largest format, smaller ones fit more
+const unsigned int BATCH_BYTES = I_BUFFER_BYTES+V_BUFFER_BYTES;
+const unsigned int MIN_CHUNK_INDICES = 2048; //Smallest chunk; leaves room for any single fan
+const unsigned int CHUNK_GRANULARITY = 256; //Chunk index room is a multiple of this, which keeps the vertices after it aligned
+const unsigned int MAX_SHORT_INDEX_VERTICES = 65536; //Vertices 16 bit indices can reach; a chunk has room for more world vertices than that
+static UINT indexSize; //Bytes per batch and template index: 2 or 4
+static DXGI_FORMAT indexFormat; //Format of batch and template indices
+static UINT chunkIndices; //Index room per chunk; changed only between frames, as submitDraws() relies on all of a frame's chunks being alike
+static UINT chunkIndexBytes; //Index room at the start of each chunk
+static UINT chunkVertexBytes; //Vertex room after the indices
+static UINT peakIndices; //Slowly decaying peak of indices written per frame, which chunks are sized for
+static UINT peakVertexBytes;
+static UINT highWaterIndices; //Most indices written in any frame
+static UINT highWaterVertexBytes;
+const int RING_BATCHES_PER_FRAME = 8; //Upload ring is sized for this many full batches per frame in flight
+static UploadRing uploadRing;
+static CommandRecorder recorder; //Records the frame's draws and clears into a command list, in order
+static ID3D12PipelineState *recorderPipelineStates[D3D::DUMMY_NUM_VERTEX_FORMATS]; //Pipeline state per vertex format, for the recorder
+static BYTE *batchData; //Ring allocation for the current batch, NULL if none
+static D3D12_GPU_VIRTUAL_ADDRESS batchGPUAddress;
+static ID3D12Resource *batchResource; //Ring buffer the current batch is in; the ring may have grown into a new one since
+static unsigned int numVerts; //Number of buffered verts, counted in the current vertex format
+static D3D::VertexFormat vertexFormat; //Format of the vertices being buffered
+static const UINT vertexStrides[D3D::DUMMY_NUM_VERTEX_FORMATS] = {sizeof(D3D::Vertex),sizeof(D3D::WorldVertex),sizeof(D3D::MeshVertex),sizeof(D3D::TileVertex),sizeof(D3D::TileInstance),sizeof(D3D::LineVertex),sizeof(D3D::PointInstance)};
+static const D3D_PRIMITIVE_TOPOLOGY primitiveTopologies[D3D::DUMMY_NUM_VERTEX_FORMATS] = {D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST,D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
+	D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST,D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST,D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST,D3D_PRIMITIVE_TOPOLOGY_LINELIST,D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST};
 static unsigned int numIndices; //Number of buffered indices
 static unsigned int numUndrawnIndices; //Number of buffered indices not yet drawn
-//static D3D11_MAPPED_SUBRESOURCE mappedVBuffer; //Memmapped version of vertex buffer
-//static D3D11_MAPPED_SUBRESOURCE mappedIBuffer; //Memmapped version of index buffer
+static void *vertexData; //Where to write vertices; NULL between render() and map()
+static VertexStaging vertexStaging; //Builds vertices in cached memory and writes them to the chunk in whole lines; see newVertices()
+static void *indexData; //Where to write indices; NULL between render() and map()
+static bool ringFullReported; //Whether a failed chunk allocation was logged this frame
+static DWORD vertexEpoch; //Changes whenever buffered vertices can no longer be referenced by index; see D3D::beginSharedFan()
+static DWORD stateSerial; //Changes whenever a texture binding or the blend/depth state changes; see D3D::getStateSerial()
+static unsigned int sharedFanFirstVertex; //numVerts when the current shared fan was begun
+static D3D::SurfacePasses currentSurface; //Map surface being buffered, see D3D::setSurface()
+static bool surfaceInUse; //Whether world vertices refer to currentSurface; it's then copied into each new chunk
+static UINT numSurfaces; //Entries in the chunk's surface table, which grows down from the end of the vertex room
+static DWORD surfaceOffset; //Offset of currentSurface's entry from the start of the vertex room
+
+/*
+Fans of up to MAX_TEMPLATE_FAN vertices don't get indices written. Instead, runs of equally sized fans are drawn from a static index buffer
+holding TEMPLATE_FANS consecutive fans of each size, using the run's first vertex as base vertex.
+A run shorter than MIN_TEMPLATE_RUN fans gets its indices written after all, as the extra draw call would cost more than the writes save.
+*/
+const int MAX_TEMPLATE_FAN = 10;
+const unsigned int TEMPLATE_FANS = 1024;
+const unsigned int MIN_TEMPLATE_RUN = 4;
+static UINT fanTemplateStart[MAX_TEMPLATE_FAN+1]; //First index of the templates for each fan size
+static UINT templateBytes; //Size of the index template buffer
+static int pendingFanSize; //Vertex count of the fans in the pending run, 0 if none
+static unsigned int pendingFans; //Fans in the pending run
+static unsigned int pendingBaseVertex; //First vertex of the pending run
+
+/** Where a queued draw's indices and vertices come from */
+enum DrawSource {SOURCE_BATCH,SOURCE_TEMPLATE,SOURCE_CACHE,SOURCE_INSTANCES,SOURCE_VERTICES};
+
+/**
+Draw call queued up for render(); a range of the batch's written indices, of the index templates or of the geometry cache.
+For SOURCE_INSTANCES, it's a range of the batch's tile or point instances instead, each drawn as the quad from the index templates.
+For SOURCE_VERTICES, it's a range of the batch's vertices drawn without indices; lines are drawn like this.
+*/
+struct DrawRun
+{
+	DrawSource source;
+	UINT startIndex; /**< First instance for SOURCE_INSTANCES, first vertex for SOURCE_VERTICES */
+	UINT numIndices; /**< Number of instances for SOURCE_INSTANCES, of vertices for SOURCE_VERTICES */
+	INT baseVertex;
+	D3D12_GPU_VIRTUAL_ADDRESS chunk; /**< Batch chunk holding the vertices and written indices; for SOURCE_CACHE, the surface table to use */
+};
+static std::vector<DrawRun> drawRuns;
+static D3D::BatchStats batchStats; //Counters for the frame being drawn
+static D3D::BatchStats lastBatchStats; //Counters for the last complete frame
+
+/**
+\return Whether there is buffered geometry that render() would draw.
+*/
+static bool hasUndrawnGeometry()
+{
+	return numUndrawnIndices>0 || pendingFans>0 || !drawRuns.empty();
+}
+
+/**
+Queue the written indices buffered so far as a draw.
+*/
+static void closeWrittenRun()
+{
+	if(numUndrawnIndices>0)
+	{
+		DrawRun r = {SOURCE_BATCH,numIndices-numUndrawnIndices,numUndrawnIndices,0,batchGPUAddress};
+		drawRuns.push_back(r);
+		numUndrawnIndices = 0;
+	}
+}
+
+/**
+Turn a fan into a triangle list.
+\param out Where to write the indices; (num-2)*3 of them.
+\param num Number of vertices in the fan.
+\param firstVertex Index of the fan's center vertex.
+\return Just past the written indices.
+*/
+template<class Index> static Index *fanToList(Index *out, int num, unsigned int firstVertex)
+{
+	for(int i=1;i<num-1;i++)
+	{
+		*out++ = (Index)firstVertex; //Center point
+		*out++ = (Index)(firstVertex+i);
+		*out++ = (Index)(firstVertex+i+1);
+	}
+	return out;
+}
+
+/**
+Turn a fan of arbitrary vertices into a triangle list.
+\param out Where to write the indices; (num-2)*3 of them.
+\param vertices Index of each of the fan's vertices, center first.
+\param num Number of vertices in the fan.
+\param base Subtracted from each index.
+\return Just past the written indices.
+*/
+template<class Index> static Index *sharedFanToList(Index *out, const UINT *vertices, int num, UINT base)
+{
+	for(int i=1;i<num-1;i++)
+	{
+		*out++ = (Index)(vertices[0]-base);
+		*out++ = (Index)(vertices[i]-base);
+		*out++ = (Index)(vertices[i+1]-base);
+	}
+	return out;
+}
+
+/**
+Write the indices for a fan.
+\param num Number of vertices in the fan.
+\param firstVertex Index of the fan's center vertex.
+*/
+static void writeFanIndices(int num, unsigned int firstVertex)
+{
+	if(indexSize==sizeof(WORD))
+		fanToList((WORD*)indexData+numIndices,num,firstVertex);
+	else
+		fanToList((UINT*)indexData+numIndices,num,firstVertex);
+	numIndices += (num-2)*3;
+	numUndrawnIndices += (num-2)*3;
+	batchStats.writtenFans++;
+}
+
+/**
+End the pending run of equally sized fans; queue it as a template draw if it's long enough, write its indices otherwise.
+*/
+static void flushPendingFans()
+{
+	if(pendingFans>=MIN_TEMPLATE_RUN)
+	{
+		closeWrittenRun();
+		DrawRun r = {SOURCE_TEMPLATE,fanTemplateStart[pendingFanSize],pendingFans*(pendingFanSize-2)*3,(INT)pendingBaseVertex,batchGPUAddress};
+		drawRuns.push_back(r);
+		batchStats.templatedFans += pendingFans;
+	}
+	else
+	{
+		for(unsigned int i=0;i<pendingFans;i++)
+		{
+			writeFanIndices(pendingFanSize,pendingBaseVertex+i*pendingFanSize);
+		}
+	}
+	pendingFans = 0;
+	pendingFanSize = 0;
+}
+
+/*
+Deferred draws. State setters only record the state; render() captures it along with the batch's draw runs.
+Opaque draws that write depth are held back and submitted sorted by a state key at the next ordering barrier, so draws
+that share textures and pipeline state follow each other. Anything else is drawn in engine order and is itself a barrier,
+as are changes to state outside the key: depth clears, viewports, transforms, fog and texture updates.
+Depth testing is LESS_EQUAL, so where opaque draws meet at equal depth the last one wins and reordering them would change
+the picture. Only map surfaces are sorted, as they declare their planes (see setSurfacePlane()); a surface in the plane of a
+held back draw is a barrier, which keeps coplanar surfaces in engine order. Other opaque geometry is drawn in engine order.
+Runs of translucent draws are sorted the same way: they don't write depth, and their screen blend, 1-(1-src)(1-dst),
+gives the same result in any order. Only draws of one class are held back at a time; a draw of another class is a barrier.
+Modulated draws aren't sorted: their blend, 2*src*dst, can go past 1 and is clamped by the render target, so the order matters.
+*/
+enum DrawClass {CLASS_UNSORTED,CLASS_OPAQUE,CLASS_TRANSLUCENT};
+
+static const int BLEND_FLAGS = PF_Translucent | PF_Modulated |PF_Invisible |PF_Masked
+	#ifdef RUNE
+		| PF_AlphaBlend
+	#endif
+		;
+
+/** State set by the setters for the geometry being buffered; textures come from texturePasses */
+static struct
+{
+	D3D::ProjectionMode projectionMode;
+	ID3D11BlendState *blendState;
+	ID3D11DepthStencilState *depthState;
+	int flags; /**< Polyflags, see setFlags() */
+} currentState;
+
+struct DrawState
+{
+	D3D::VertexFormat format;
+	D3D::ProjectionMode projectionMode;
+	ID3D11BlendState *blendState;
+	ID3D11DepthStencilState *depthState;
+	ID3D11ShaderResourceView *views[D3D::DUMMY_NUM_PASSES];
+	BOOL enabled[D3D::DUMMY_NUM_PASSES];
+	int passFormat[D3D::DUMMY_NUM_PASSES];
+	float alpha[D3D::DUMMY_NUM_PASSES];
+};
+
+/** A group of draws held back for sorting */
+struct DeferredDraw
+{
+	UINT64 key; /**< See stateKey() */
+	DrawState state;
+	UINT firstRun; /**< Index of the group's first run in deferredRuns */
+	UINT numRuns;
+};
+static std::vector<DeferredDraw> deferredDraws;
+static std::vector<DrawRun> deferredRuns;
+static DrawClass deferredClass; //Class of the held back draws
+static DrawState appliedState; //State last submitted with
+static bool appliedStateValid; //Whether appliedState is set on the device
+static DrawState lastRenderedState; //State of the last render(), to count state changes in engine order
+static stdext::hash_map<DWORD64,bool> deferredPlanes; //Planes of the map surfaces in the held back draws; see D3D::setSurfacePlane()
+static std::vector<DWORD64> pendingPlanes; //Planes of the map surfaces buffered since the last render()
+
+/**
+Fill in a draw state from the current state.
+*/
+static void captureState(DrawState &state)
+{
+	memset(&state,0,sizeof(state)); //Padding is compared too
+	state.format = vertexFormat;
+	state.projectionMode = currentState.projectionMode;
+	state.blendState = currentState.blendState;
+	state.depthState = currentState.depthState;
+	memcpy(state.views,texturePasses.boundView,sizeof(state.views));
+	memcpy(state.enabled,texturePasses.enabled,sizeof(state.enabled));
+	memcpy(state.passFormat,texturePasses.format,sizeof(state.passFormat));
+	memcpy(state.alpha,texturePasses.alpha,sizeof(state.alpha));
+}
+
+/**
+\return Whether two draw states need the same device state.
+*/
+static bool sameState(const DrawState &a, const DrawState &b)
+{
+	return memcmp(&a,&b,sizeof(DrawState))==0;
+}
+
+/**
+Pack a draw state into a sort key. The vertex format, and with it the pipeline state, goes in the top bits as it's the most expensive to switch;
+then the projection mode; the rest is a hash of the texture set.
+Blend and depth state aren't in the key: the draws sorted together are all of one class, and share them.
+*/
+static UINT64 stateKey(const DrawState &state)
+{
+	UINT64 textures = Misc::hashBytes(Misc::HASH_INIT,state.views,sizeof(state.views));
+	textures = Misc::hashBytes(textures,state.enabled,sizeof(state.enabled));
+	textures = Misc::hashBytes(textures,state.passFormat,sizeof(state.passFormat));
+	textures = Misc::hashBytes(textures,state.alpha,sizeof(state.alpha));
+	return ((UINT64)state.format<<60) | ((UINT64)state.projectionMode<<56) | (textures & 0x00FFFFFFFFFFFFFFULL);
+}
+
+/**
+Sort predicate for held back draws.
+*/
+static bool deferredDrawLess(const DeferredDraw &a, const DeferredDraw &b)
+{
+	return a.key<b.key;
+}
+
+/*
+Static geometry cache. Map surfaces are drawn in world space, so their vertices stay the same from frame to frame.
+The vertices and indices of each cached facet are kept in a default heap buffer; a cache hit only queues a draw.
+On a miss the facet is drawn from the batch as usual and its data is copied into the cache at the end of the frame,
+after the frame's draws, so space can be handed out again without waiting on the GPU. When the cache is full it is emptied.
+*/
+/** A cached facet */
+struct CachedGeometry
+{
+	UINT baseVertex; /**< First vertex, in WorldVertex units */
+	UINT numVertices;
+	UINT startIndex;
+	UINT numIndices;
+	UINT64 surfaceTable; /**< Offset into the cache that the vertices' surface offset is relative to; the entry itself is after the indices */
+	std::vector<D3D::Vec3> check; /**< World positions of the facet's points; guards against key collisions */
+	DWORD usableFrame; /**< Frame from which the copy into the cache has been done */
+};
+/** Copy from the upload ring into the cache, recorded at the end of the frame */
+struct GeometryCopy
+{
+	ID3D12Resource *src; /**< Upload ring buffer; kept by the ring until the frame is done, even if it grew since */
+	UINT64 srcOffset;
+	UINT64 dstOffset;
+	UINT64 bytes;
+};
+/** Indices of a new cache entry, staged on the CPU; they go into the upload ring at the end of the frame, after the last chunk is closed */
+struct IndexCopy
+{
+	DWORD64 key; /**< Entry that is dropped if the indices can't be uploaded */
+	UINT64 srcOffset; /**< Into cacheIndexStaging, in bytes */
+	UINT64 dstOffset;
+	UINT64 bytes;
+};
+static stdext::hash_map<DWORD64,CachedGeometry> geometryCache;
+static std::vector<GeometryCopy> geometryCopies;
+static std::vector<IndexCopy> indexCopies;
+static std::vector<UINT> cacheIndexStaging;
+static UINT64 geometryCacheSize;
+static UINT64 geometryCacheUsed;
+static struct
+{
+	bool active; /**< Between beginCachedGeometry() and endCachedGeometry() */
+	bool aborted; /**< Batch was drawn and restarted while capturing; data is no longer in one piece */
+	DWORD64 key;
+	std::vector<D3D::Vec3> check;
+	unsigned int firstVertex;
+	std::vector<UINT> indices; /**< Triangle list indices, relative to firstVertex */
+} capture;
+static D3D::GeometryCacheStats geometryStats; //Counters for the frame being drawn
+static D3D::GeometryCacheStats lastGeometryStats; //Counters for the last complete frame
 
 /*
 Misc
@@ -158,6 +773,22 @@ int D3D::init(HWND hWnd,D3D::Options &createOptions)
 	CLAMP(options.aniso,0,16);
 	CLAMP(options.VSync,0,1);
 	CLAMP(options.LODBias,-10,10);
+	CLAMP(options.framesInFlight,1,8);
+	CLAMP(options.geometryCacheSize,0,1024);
+	CLAMP(options.sortDraws,0,1);
+	CLAMP(options.sortTranslucentDraws,0,1);
+	CLAMP(options.shortIndices,0,1);
+	CLAMP(options.instancedTiles,0,1);
+	CLAMP(options.stageVertices,0,1);
+	CLAMP(options.shareVertices,0,1);
+	CLAMP(options.parallelVertices,0,1);
+	CLAMP(options.cullDetail,0,1);
+	indexSize = options.shortIndices ? sizeof(WORD) : sizeof(UINT);
+	indexFormat = options.shortIndices ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+	chunkIndices = I_BUFFER_SIZE;
+	chunkIndexBytes = I_BUFFER_SIZE*indexSize;
+	chunkVertexBytes = V_BUFFER_BYTES;
+	peakIndices = peakVertexBytes = highWaterIndices = highWaterVertexBytes = 0;
 	UD3D12RenderDevice::debugs("Initializing Direct3D 12.");
 
 	// Enable the debug layer for debug builds
@@ -392,11 +1023,14 @@ int D3D::init(HWND hWnd,D3D::Options &createOptions)
 
 	//Get shader params
 	shaderVars.projection = D3DObjects.effect->GetVariableByName("projection")->AsMatrix();
+	shaderVars.view = D3DObjects.effect->GetVariableByName("view")->AsMatrix();
 	shaderVars.projectionMode = D3DObjects.effect->GetVariableByName("projectionMode")->AsScalar(); 	
 	shaderVars.flashColor = D3DObjects.effect->GetVariableByName("flashColor")->AsVector();
 	shaderVars.flashEnable = D3DObjects.effect->GetVariableByName("flashEnable")->AsScalar();
 	shaderVars.useTexturePass = D3DObjects.effect->GetVariableByName("useTexturePass")->AsScalar();
 	shaderVars.shaderTextures = D3DObjects.effect->GetVariableByName("textures")->AsShaderResource();
+	shaderVars.passFormat = D3DObjects.effect->GetVariableByName("passFormat")->AsScalar();
+	shaderVars.passAlpha = D3DObjects.effect->GetVariableByName("passAlpha")->AsScalar();
 	shaderVars.time = D3DObjects.effect->GetVariableByName("time")->AsScalar();
 	shaderVars.viewportHeight = D3DObjects.effect->GetVariableByName("viewportHeight")->AsScalar();
 	shaderVars.viewportWidth = D3DObjects.effect->GetVariableByName("viewportWidth")->AsScalar();
@@ -417,8 +1051,8 @@ int D3D::init(HWND hWnd,D3D::Options &createOptions)
 	//Apply shader variable options
 	setBrightness(options.brightness);
 
-	//Set the vertex layout
-    D3D12_INPUT_ELEMENT_DESC elementDesc[] =
+	//Set the vertex layouts, one per vertex format
+    D3D12_INPUT_ELEMENT_DESC genericDesc[] =
     {
 		{ "POSITION",     0, DXGI_FORMAT_R32G32B32_FLOAT,    0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
 		{ "COLOR",        0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
@@ -431,12 +1065,51 @@ int D3D::init(HWND hWnd,D3D::Options &createOptions)
 		{ "TEXCOORD",     4, DXGI_FORMAT_R32G32_FLOAT,       0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
 		{ "BLENDINDICES", 0, DXGI_FORMAT_R32_UINT,           0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
     };
+    D3D12_INPUT_ELEMENT_DESC worldDesc[] = //Pass texture coordinates come from the surface table
+    {
+		{ "POSITION",     0, DXGI_FORMAT_R32G32B32_FLOAT,    0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "TEXCOORD",     0, DXGI_FORMAT_R32G32_FLOAT,       0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "BLENDINDICES", 0, DXGI_FORMAT_R32_UINT,           0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "BLENDINDICES", 1, DXGI_FORMAT_R32_UINT,           0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+    };
+    D3D12_INPUT_ELEMENT_DESC meshDesc[] = //Also used for tiles
+    {
+		{ "POSITION",     0, DXGI_FORMAT_R32G32B32_FLOAT,    0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "COLOR",        0, DXGI_FORMAT_R8G8B8A8_UNORM,     0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "COLOR",        1, DXGI_FORMAT_R8G8B8A8_UNORM,     0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "TEXCOORD",     0, DXGI_FORMAT_R32G32_FLOAT,       0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "BLENDINDICES", 0, DXGI_FORMAT_R32_UINT,           0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+    };
+    D3D12_INPUT_ELEMENT_DESC tileInstanceDesc[] = //Per instance; the vertex shader picks the corner by vertex index
+    {
+		{ "POSITION",     0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+		{ "TEXCOORD",     0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+		{ "POSITION",     1, DXGI_FORMAT_R32_FLOAT,          0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+		{ "COLOR",        0, DXGI_FORMAT_R8G8B8A8_UNORM,     0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+		{ "COLOR",        1, DXGI_FORMAT_R8G8B8A8_UNORM,     0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+		{ "BLENDINDICES", 0, DXGI_FORMAT_R32_UINT,           0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+    };
+    D3D12_INPUT_ELEMENT_DESC lineDesc[] =
+    {
+		{ "POSITION",     0, DXGI_FORMAT_R32G32B32_FLOAT,    0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "COLOR",        0, DXGI_FORMAT_R8G8B8A8_UNORM,     0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+    };
+    D3D12_INPUT_ELEMENT_DESC pointInstanceDesc[] = //Per instance, as for tiles
+    {
+		{ "POSITION",     0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+		{ "POSITION",     1, DXGI_FORMAT_R32_FLOAT,          0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+		{ "COLOR",        0, DXGI_FORMAT_R8G8B8A8_UNORM,     0, D3D12_APPEND_ALIGNED_ELEMENT, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1 },
+    };
 
-	D3D12_INPUT_LAYOUT_DESC ilDesc = {
-		elementDesc,
-		sizeof(elementDesc)/sizeof(elementDesc[0])
+	D3D12_INPUT_LAYOUT_DESC ilDescs[D3D::DUMMY_NUM_VERTEX_FORMATS] = {
+		{genericDesc, sizeof(genericDesc)/sizeof(genericDesc[0])},
+		{worldDesc, sizeof(worldDesc)/sizeof(worldDesc[0])},
+		{meshDesc, sizeof(meshDesc)/sizeof(meshDesc[0])},
+		{meshDesc, sizeof(meshDesc)/sizeof(meshDesc[0])},
+		{tileInstanceDesc, sizeof(tileInstanceDesc)/sizeof(tileInstanceDesc[0])},
+		{lineDesc, sizeof(lineDesc)/sizeof(lineDesc[0])},
+		{pointInstanceDesc, sizeof(pointInstanceDesc)/sizeof(pointInstanceDesc[0])},
     };
-    UINT numElements = sizeof(layoutDesc) / sizeof(layoutDesc[0]);
 
 	// msuzz: I don't think we need these, replaced by pso
 	/*
@@ -454,64 +1127,55 @@ int D3D::init(HWND hWnd,D3D::Options &createOptions)
 		return 0;
 	}
 	p->GetDesc(&passDesc);
-	hr = D3DObjects.device->CreateInputLayout(layoutDesc, numElements, passDesc.pIAInputSignature, passDesc.IAInputSignatureSize, &D3DObjects.vertexLayout);
+	hr = D3DObjects.device->CreateInputLayout(layoutDesc, numElements, passDesc.pIAInputSignature, passDesc.IAInputSignatureSize, &D3DObjects.vertexLayouts[0]);
 	if (FAILED(hr))
 	{
 		UD3D12RenderDevice::debugs("Error creating input layout.");
 		return 0;
 	} */
 	
-	//Set up vertex buffer
-	// Create default buffer resource
-	hr = D3DObjects.device->CreateCommittedResource(
-		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
-		D3D12_HEAP_FLAG_NONE,
-		&CD3DX12_RESOURCE_DESC::Buffer(V_BUFFER_SIZE*sizeof(Vertex)), // may be incorrect
-		D3D12_RESOURCE_STATE_COMMON,
-		nullptr,
-		IID_PPV_ARGS(D3DObjects.vertexBuf.GetAddressOf())
-	);
-
-	// Create intermediate upload heap
-	hr = D3DObjects.device->CreateCommittedResource(
-		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
-		D3D12_HEAP_FLAG_NONE,
-		&CD3DX12_RESOURCE_DESC::Buffer(V_BUFFER_SIZE*sizeof(Vertex)), // may be incorrect
-		D3D12_RESOURCE_STATE_GENERIC_READ,
-		nullptr,
-		IID_PPV_ARGS(D3DObjects.vertexBufUploader.GetAddressOf())
-	);
-
-	// Describe the data we want to copy into the default buffer
-	D3D12_SUBRESOURCE_DATA subResourceData = {};
-	subResourceData.pData = initData;
-	subResourceData.RowPitch = sizeof(Vertex);
-	subResourceData.SlicePitch = subResourceData.RowPitch;
-	
-	//Create index buffer
-	D3D12_RESOURCE_DESC ibDesc;
-	ibDesc.Usage = D3D11_USAGE_DYNAMIC;
-	ibDesc.ByteWidth = sizeof(int)*I_BUFFER_SIZE;
-	ibDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-	ibDesc.CPUAccessFlags   = D3D11_CPU_ACCESS_WRITE;
-    ibDesc.MiscFlags        = 0;
-	hr = D3DObjects.device->CreateCommittedResource( &ibDesc,NULL, &D3DObjects.indexBuf);
-	if (FAILED(hr))
+	//Set up upload ring for vertex and index data
+	if(!uploadRing.init(D3DObjects.device.Get(),D3DObjects.fence.Get(),(UINT64)BATCH_BYTES*RING_BATCHES_PER_FRAME*options.framesInFlight))
+	{
+		return 0;
+	}
+	if(!createIndexTemplates())
 	{
-		UD3D12RenderDevice::debugs("Error creating index buffer.");
 		return 0;
 	}
 
+	//Static geometry cache; vertices and indices share the buffer, so it's in both states
+	geometryCacheSize = (UINT64)options.geometryCacheSize*1024*1024;
+	if(geometryCacheSize>0)
+	{
+		hr = D3DObjects.device->CreateCommittedResource(
+			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+			D3D12_HEAP_FLAG_NONE,
+			&CD3DX12_RESOURCE_DESC::Buffer(geometryCacheSize),
+			D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER|D3D12_RESOURCE_STATE_INDEX_BUFFER,
+			nullptr,
+			IID_PPV_ARGS(D3DObjects.geometryCache.GetAddressOf())
+		);
+		if(FAILED(hr))
+		{
+			UD3D12RenderDevice::debugs("Error creating geometry cache; disabling it.");
+			geometryCacheSize = 0;
+		}
+	}
+
 	// Root signature descriptor
 	// Create a root parameter that expects a descriptor table of 1 constant view buffer, that
 	// gets bound to constant buffer register 0 in the HLSL code.
-	CD3DX12_ROOT_PARAMETER slotRootParameter[1];
+	// The second is the map surface table, a raw buffer in the upload ring or geometry cache bound by address per draw (register t5).
+	CD3DX12_ROOT_PARAMETER slotRootParameter[2];
 	CD3DX12_DESCRIPTOR_RANGE cbvTable;
 	cbvTable.Init(
 		D3D12_DESCRIPTOR_RANGE_TYPE_CBV,
 		1,	// number of desriptors in table
 		0); // base shader register arguments are bound to for this root parmeter
-	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(1, slotRootParameter, 0, nullptr);
+	slotRootParameter[0].InitAsDescriptorTable(1,&cbvTable);
+	slotRootParameter[1].InitAsShaderResourceView(5,0,D3D12_SHADER_VISIBILITY_VERTEX);
+	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(2, slotRootParameter, 0, nullptr);
 
 	// Serialise root signature
 	ComPtr<ID3DBlob> sRootSig = nullptr;
@@ -539,10 +1203,9 @@ int D3D::init(HWND hWnd,D3D::Options &createOptions)
 		return 0;
 	}
 
-	// Pipeline state object descriptor
+	// Pipeline state object descriptor; a pipeline state is made for each vertex format, differing in input layout and, for lines, topology
 	D3D12_GRAPHICS_PIPELINE_STATE_DESC psoDesc;
 	ZeroMemory(&psoDesc, sizeof(D3D12_GRAPHICS_PIPELINE_STATE_DESC));
-	psoDesc.InputLayout = ilDesc;
 	psoDesc.pRootSignature = D3DObjects.rootSig.Get();
 	psoDesc.VS = { reinterpret_cast<BYTE*>(shadBlob->GetBufferPointer()), shadBlob->GetBufferSize() };
 	psoDesc.PS = { reinterpret_cast<BYTE*>(shadBlob->GetBufferPointer()), shadBlob->GetBufferSize() };
@@ -557,16 +1220,35 @@ int D3D::init(HWND hWnd,D3D::Options &createOptions)
 	psoDesc.SampleDesc.Quality = 0; // fix?
 	psoDesc.DSVFormat = DEPTH_STENCIL_FORMAT;
 
-	// Create the pipeline state
-	hr = D3DObjects.device->CreateGraphicsPipelineState(
-		&psoDesc,
-		IID_PPV_ARGS(&D3DObjects.pipelineState)
-	);
-	if (FAILED(hr))
+	// Create the pipeline states
+	for(int i=0;i<D3D::DUMMY_NUM_VERTEX_FORMATS;i++)
+	{
+		psoDesc.InputLayout = ilDescs[i];
+		psoDesc.PrimitiveTopologyType = primitiveTopologies[i]==D3D_PRIMITIVE_TOPOLOGY_LINELIST ? D3D12_PRIMITIVE_TOPOLOGY_TYPE_LINE : D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
+		hr = D3DObjects.device->CreateGraphicsPipelineState(
+			&psoDesc,
+			IID_PPV_ARGS(&D3DObjects.pipelineStates[i])
+		);
+		if (FAILED(hr))
+		{
+			UD3D12RenderDevice::debugs("Error creating pipeline state object.");
+			return 0;
+		}
+		recorderPipelineStates[i] = D3DObjects.pipelineStates[i].Get();
+	}
+
+	CommandRecorder::Setup setup = {D3DObjects.rootSig.Get(),recorderPipelineStates,primitiveTopologies};
+	if(!recorder.init(D3DObjects.device.Get(),D3DObjects.fence.Get(),options.framesInFlight,setup))
 	{
-		UD3D12RenderDevice::debugs("Error creating pipeline state object.");
 		return 0;
 	}
+	recorder.beginFrame(currentRenderTargetView(),currentDepthStencilView());
+
+	//Draw to the whole target until the renderer sets a viewport
+	DXGI_SWAP_CHAIN_DESC targetDesc;
+	D3DObjects.swapChain->GetDesc(&targetDesc);
+	D3D12_VIEWPORT fullViewport = {0,0,(FLOAT)targetDesc.BufferDesc.Width,(FLOAT)targetDesc.BufferDesc.Height,0,1};
+	recorder.setViewport(fullViewport);
 
 #ifdef _DEBUGDX
 	//Disable certain debug output
@@ -701,6 +1383,7 @@ Cleanup
 */
 void D3D::uninit()
 {
+	stopTextureTrace();
 	UD3D12RenderDevice::debugs("Uninit.");
 	D3D::flush();
 	D3DObjects.swapChain->SetFullscreenState(FALSE,NULL); //Go windowed so swapchain can be released
@@ -710,9 +1393,24 @@ void D3D::uninit()
 	D3DObjects.deviceContext->Flush();
 
 	// TODO: Ensure all new D3DObjects are here
-	SAFE_RELEASE(D3DObjects.vertexLayout);
-	SAFE_RELEASE(D3DObjects.vertexBuffer);
-	SAFE_RELEASE(D3DObjects.indexBuffer);
+	for(int i=0;i<D3D::DUMMY_NUM_VERTEX_FORMATS;i++)
+	{
+		SAFE_RELEASE(D3DObjects.vertexLayouts[i]);
+	}
+	//Make sure the GPU is done reading the upload ring
+	currentFence++;
+	D3DObjects.cmdQueue->Signal(D3DObjects.fence.Get(),currentFence);
+	uploadRing.endFrame(currentFence);
+	HANDLE idle = CreateEvent(NULL,FALSE,FALSE,NULL);
+	D3DObjects.fence->SetEventOnCompletion(currentFence,idle);
+	WaitForSingleObject(idle,INFINITE);
+	CloseHandle(idle);
+	uploadRing.uninit();
+	recorder.uninit();
+	batchData = NULL;
+	D3DObjects.indexTemplates.Reset();
+	clearGeometryCache();
+	D3DObjects.geometryCache.Reset();
 	SAFE_RELEASE(D3DObjects.effect);
 	SAFE_RELEASE(states.dstate_Enable);
 	SAFE_RELEASE(states.dstate_Disable);
@@ -820,9 +1518,83 @@ int D3D::resize(int X, int Y, bool fullScreen)
 	vp.TopLeftX = 0;
 	vp.TopLeftY = 0;
 	D3DObjects.deviceContext->RSSetViewports(1,&vp);
+	D3D12_VIEWPORT fullViewport = {0,0,(FLOAT)X,(FLOAT)Y,0,1};
+	recorder.setViewport(fullViewport);
 	return 1;
 }
 
+/**
+Add currentSurface to the chunk's surface table. It's written straight to the ring, in one go, as it doesn't follow the vertices.
+*/
+static void writeSurface()
+{
+	numSurfaces++;
+	surfaceOffset = chunkVertexBytes-numSurfaces*sizeof(D3D::SurfacePasses);
+	memcpy(batchData+chunkIndexBytes+surfaceOffset,&currentSurface,sizeof(D3D::SurfacePasses));
+	batchStats.surfaces++;
+}
+
+/**
+\param num Number of vertices.
+\return Whether num more vertices of the current format fit in the chunk, below its surface table, and can be reached by its indices.
+*/
+static bool hasVertexRoom(UINT num)
+{
+	if(indexSize==sizeof(WORD) && numVerts+num>MAX_SHORT_INDEX_VERTICES)
+		return false;
+	return (numVerts+num)*vertexStrides[vertexFormat]+numSurfaces*sizeof(D3D::SurfacePasses)<=chunkVertexBytes;
+}
+
+/**
+Start writing in a fresh chunk from the upload ring, which grows if this frame has filled it.
+\return false if the ring had to grow and couldn't.
+*/
+static bool allocChunk()
+{
+	numVerts=0;
+	numIndices=0;
+	vertexEpoch++;
+	batchData = uploadRing.alloc(chunkIndexBytes+chunkVertexBytes,batchGPUAddress);
+	batchResource = uploadRing.getResource();
+	vertexStaging.begin(batchData ? batchData+chunkIndexBytes : NULL);
+	numSurfaces = 0;
+	if(batchData==NULL)
+	{
+		if(!ringFullReported) //Once a frame; every primitive until then is dropped
+			UD3D12RenderDevice::debugs("Upload ring couldn't grow; geometry dropped.");
+		ringFullReported = true;
+		return false;
+	}
+	if(surfaceInUse) //The surface being buffered continues in this chunk
+		writeSurface();
+	return true;
+}
+
+/**
+Size the chunks of the coming frame for the most geometry recent frames used, and keep track of the high-water mark.
+Called between frames; sizes stay as they are while a chunk or held back draws still use them.
+*/
+static void sizeChunks()
+{
+	UINT frameIndices = batchStats.indexBytes/indexSize;
+	UINT frameVertexBytes = batchStats.vertexBytes;
+	highWaterIndices = max(highWaterIndices,frameIndices);
+	highWaterVertexBytes = max(highWaterVertexBytes,frameVertexBytes);
+	peakIndices = max(frameIndices,peakIndices-peakIndices/16);
+	peakVertexBytes = max(frameVertexBytes,peakVertexBytes-peakVertexBytes/16);
+
+	if(batchData!=NULL || !deferredDraws.empty())
+		return;
+
+	//A quarter extra as headroom, and keep indices and vertices in the same proportion as the largest chunk
+	UINT wanted = max(peakIndices,(UINT)((UINT64)peakVertexBytes*I_BUFFER_SIZE/V_BUFFER_BYTES));
+	wanted += wanted/4;
+	wanted = (wanted+CHUNK_GRANULARITY-1)/CHUNK_GRANULARITY*CHUNK_GRANULARITY;
+	chunkIndices = wanted<MIN_CHUNK_INDICES ? MIN_CHUNK_INDICES : (wanted>I_BUFFER_SIZE ? I_BUFFER_SIZE : wanted);
+	chunkIndexBytes = chunkIndices*indexSize;
+	chunkVertexBytes = (UINT)((UINT64)chunkIndices*V_BUFFER_BYTES/I_BUFFER_SIZE);
+}
+
 /**
 Set up things for rendering a new frame. For example, update shader time.
 */
@@ -831,6 +1603,23 @@ void D3D::newFrame()
 	static float time;
 	shaderVars.time->SetFloat(time);
 	time += TIME_STEP;
+	frameCount++;
+	lastFrameStats = frameStats;
+	memset(&frameStats,0,sizeof(frameStats));
+	sizeChunks();
+	batchStats.chunkIndices = chunkIndices;
+	batchStats.chunkVertexBytes = chunkVertexBytes;
+	batchStats.highWaterIndices = highWaterIndices;
+	batchStats.highWaterVertexBytes = highWaterVertexBytes;
+	lastBatchStats = batchStats;
+	memset(&batchStats,0,sizeof(batchStats));
+	geometryStats.entries = geometryCache.size();
+	geometryStats.usedBytes = (DWORD)geometryCacheUsed;
+	lastGeometryStats = geometryStats;
+	memset(&geometryStats,0,sizeof(geometryStats));
+	traceRecord(TEXTRACE_FRAME,0,frameCount);
+	ringFullReported = false;
+	streamMips();
 }
 
 /**
@@ -839,7 +1628,9 @@ Clear backbuffer(s)
 */
 void D3D::clear(D3D::Vec4& clearColor)
 {
-	D3DObjects.deviceContext->ClearRenderTargetView(D3DObjects.renderTargetView,(float*) &clearColor);
+	commit();
+	flushDraws();
+	recorder.clearRenderTarget((float*)&clearColor);
 }
 
 /**
@@ -848,43 +1639,100 @@ Clear depth
 void D3D::clearDepth()
 {
 	commit();
-	D3DObjects.deviceContext->ClearDepthStencilView(D3DObjects.depthStencilView, D3D11_CLEAR_DEPTH, 1.0, 0);
+	flushDraws();
+	recorder.clearDepth(); //Recorded with the draws, so it falls between those before and after it
 }
 
 /**
-Memory map index and vertex buffer for writing.
+Get memory to write index and vertex data to. The upload ring is persistently mapped; this only picks the batch to write in.
 
-\param Clear Sets whether the buffer is restarted from the beginning;
-This is done when the buffers are about to overflow, and at the start of a new frame (Microsoft recommendation).
+\param Clear Sets whether a new batch is started;
+This is done when the batch is about to overflow, and at the start of a new frame. Otherwise writing continues after the data drawn so far.
 */
 void D3D::map(bool clear)
 {	
-	HRESULT hr, hr2;
-	if(mappedIBuffer.pData!=NULL||mappedVBuffer.pData!=NULL)
+	if(indexData!=NULL||vertexData!=NULL)
 	{
 		//UD3D12RenderDevice::debugs("map() without render");
 		return;
 	}
 
-	D3D11_MAP m;
 	if(clear)
 	{
-		numVerts=0;
-		numIndices=0;
+		closeBatch();
+		capture.aborted = true;
 		numUndrawnIndices=0;
-		m = D3D11_MAP_WRITE_DISCARD;
+		pendingFans=0;
+		pendingFanSize=0;
+		drawRuns.clear();
 	}
-	else
+	if(batchData==NULL) //Also after a failed chunk allocation; runs queued before it are still to be drawn, so they're kept
 	{
-		m = D3D11_MAP_WRITE_NO_OVERWRITE;
+		chainChunk();
+		return;
 	}
 	
-	hr=D3DObjects.deviceContext->Map(D3DObjects.vertexBuffer,0,m,0,&mappedVBuffer);
-	hr2=D3DObjects.deviceContext->Map(D3DObjects.indexBuffer,0,m,0,&mappedIBuffer);
-	if(FAILED(hr) || FAILED(hr2))
+	indexData = batchData;
+	vertexData = batchData+chunkIndexBytes;
+}
+
+/**
+Continue the batch in a new chunk because the current one is full. What was buffered is queued as draw runs that refer to the old chunk,
+to be drawn along with the rest at the next render(); the buffer stays mapped. The new chunk comes from the upload ring like any other,
+so it grows the ring if the frame has filled it, and the old chunk stays valid even if the ring moves to a new buffer.
+Also tried when there's no chunk at all, at the start of a batch or because an earlier allocation failed.
+\return false if the ring couldn't grow. Nothing is mapped then, and the primitive that needed the room must be dropped; the queued runs are still drawn.
+*/
+bool D3D::chainChunk()
+{
+	if(batchData!=NULL)
 	{
-		UD3D12RenderDevice::debugs("Failed to map index and/or vertex buffer.");
+		flushPendingFans(); //Room for its indices was reserved
+		closeWrittenRun();
+		closeBatch();
+		batchStats.chainedChunks++;
 	}
+	capture.aborted = true;
+	if(!allocChunk())
+	{
+		//The old chunk went back to the ring; nothing may be written to it anymore
+		indexData = NULL;
+		vertexData = NULL;
+		return false;
+	}
+	indexData = batchData;
+	vertexData = batchData+chunkIndexBytes;
+	return true;
+}
+
+/**
+Hand the unused end of the current chunk back to the upload ring. Done when a new batch or chunk is started and at the end of a frame.
+*/
+void D3D::closeBatch()
+{
+	if(batchData==NULL)
+		return;
+	vertexStaging.flush();
+	if(numSurfaces==0) //The surface table is at the end
+		uploadRing.shrink(batchData,chunkIndexBytes+numVerts*vertexStrides[vertexFormat]);
+	batchData = NULL;
+	batchStats.batches++;
+	batchStats.indexBytes += numIndices*indexSize;
+	batchStats.vertexBytes += numVerts*vertexStrides[vertexFormat]+numSurfaces*sizeof(D3D::SurfacePasses);
+}
+
+/**
+\return How the draws being buffered may be reordered, from the current state.
+*/
+static DrawClass currentDrawClass()
+{
+	if((currentState.flags&PF_Occlude) && !(currentState.flags&BLEND_FLAGS)) //Only map surfaces declare the planes they're in
+		return options.sortDraws && vertexFormat==D3D::VF_WORLD ? CLASS_OPAQUE : CLASS_UNSORTED;
+	if(!options.sortTranslucentDraws || currentState.depthState!=states.dstate_Disable)
+		return CLASS_UNSORTED;
+	if(currentState.blendState==states.bstate_Translucent)
+		return CLASS_TRANSLUCENT;
+	return CLASS_UNSORTED;
 }
 
 /**
@@ -892,15 +1740,18 @@ Draw current buffer contents.
 */
 void D3D::render()
 {	
-	if(mappedVBuffer.pData==NULL || mappedIBuffer.pData == NULL) //No buffer mapped, do nothing
+	if(vertexData==NULL || indexData == NULL) //No buffer mapped; only runs queued before a failed chunk allocation can be left to draw
 	{
-		return;
+		if(drawRuns.empty())
+			return;
+	}
+	else
+	{
+		flushPendingFans();
+		vertexStaging.flush();
+		vertexData=NULL;
+		indexData=NULL;
 	}
-
-	D3DObjects.deviceContext->Unmap(D3DObjects.vertexBuffer,0);
-	mappedVBuffer.pData=NULL;
-	D3DObjects.deviceContext->Unmap(D3DObjects.indexBuffer,0);
-	mappedIBuffer.pData=NULL;
 /*
 	static unsigned int maxi;
 	if(numUndrawnIndices>maxi)
@@ -914,13 +1765,163 @@ void D3D::render()
 	{
 		UD3D12RenderDevice::debugs("Buffer error.");
 		numUndrawnIndices=0;
+		drawRuns.clear();
 		return;
 	}
+	closeWrittenRun();
+	if(drawRuns.empty())
+		return;
 
-	D3D::switchToPass(0)->Apply(0,D3DObjects.deviceContext);
-	D3DObjects.deviceContext->DrawIndexed(numUndrawnIndices,numIndices-numUndrawnIndices,0);
+	DrawState state;
+	captureState(state);
+	batchStats.groups++;
+	if(!sameState(state,lastRenderedState))
+		batchStats.unsortedStateChanges++;
+	lastRenderedState = state;
 
-	numUndrawnIndices=0;
+	DrawClass drawClass = currentDrawClass();
+	if(drawClass!=CLASS_UNSORTED)
+	{
+		if(drawClass!=deferredClass)
+			flushDraws(); //Draws of different classes don't commute
+		deferredClass = drawClass;
+		DeferredDraw d;
+		d.key = stateKey(state);
+		d.state = state;
+		d.firstRun = deferredRuns.size();
+		d.numRuns = drawRuns.size();
+		deferredRuns.insert(deferredRuns.end(),drawRuns.begin(),drawRuns.end());
+		deferredDraws.push_back(d);
+		batchStats.sortedGroups++;
+		if(drawClass!=CLASS_OPAQUE)
+			batchStats.sortedTranslucentGroups++;
+		else
+		{
+			for(std::vector<DWORD64>::iterator p=pendingPlanes.begin();p!=pendingPlanes.end();p++)
+			{
+				deferredPlanes[*p] = true;
+			}
+		}
+	}
+	else
+	{
+		flushDraws(); //Held back draws come first
+		submitDraws(state,&drawRuns[0],drawRuns.size());
+	}
+	drawRuns.clear();
+	pendingPlanes.clear();
+}
+
+/**
+Set the device up for a draw state, where it differs from the last one submitted, and issue draw calls.
+\param state State to draw with.
+\param runs Draws to issue.
+\param numRuns Number of draws.
+*/
+void D3D::submitDraws(const DrawState &state, const DrawRun *runs, UINT numRuns)
+{
+	if(!appliedStateValid || !sameState(state,appliedState))
+	{
+		if(!appliedStateValid || state.projectionMode!=appliedState.projectionMode)
+			shaderVars.projectionMode->SetInt(state.projectionMode);
+		if(!appliedStateValid || state.blendState!=appliedState.blendState)
+			D3DObjects.deviceContext->OMSetBlendState(state.blendState,NULL,0xffffffff);
+		if(!appliedStateValid || state.depthState!=appliedState.depthState)
+			D3DObjects.deviceContext->OMSetDepthStencilState(state.depthState,1);
+		if(!appliedStateValid || memcmp(state.views,appliedState.views,sizeof(state.views)))
+			shaderVars.shaderTextures->SetResourceArray((ID3D11ShaderResourceView**)state.views,0,D3D::DUMMY_NUM_PASSES);
+		if(!appliedStateValid || memcmp(state.enabled,appliedState.enabled,sizeof(state.enabled)))
+			shaderVars.useTexturePass->SetBoolArray((BOOL*)state.enabled,0,D3D::DUMMY_NUM_PASSES);
+		if(!appliedStateValid || memcmp(state.passFormat,appliedState.passFormat,sizeof(state.passFormat)) || memcmp(state.alpha,appliedState.alpha,sizeof(state.alpha)))
+		{
+			shaderVars.passFormat->SetIntArray((int*)state.passFormat,0,D3D::DUMMY_NUM_PASSES);
+			shaderVars.passAlpha->SetFloatArray((float*)state.alpha,0,D3D::DUMMY_NUM_PASSES);
+		}
+		appliedState = state;
+		appliedStateValid = true;
+		batchStats.stateChanges++;
+	}
+
+	D3D::switchToPass(state.format)->Apply(0,D3DObjects.deviceContext);
+
+	//Views into the batch; rebound every submission as batches move through the ring
+	//Index buffer view per draw source; templates use the batch's vertices. The batch views point at each run's chunk.
+	D3D12_INDEX_BUFFER_VIEW ibv[3];
+	D3D12_VERTEX_BUFFER_VIEW vbv[3];
+	ibv[SOURCE_BATCH].SizeInBytes = chunkIndexBytes;
+	ibv[SOURCE_TEMPLATE].BufferLocation = D3DObjects.indexTemplates->GetGPUVirtualAddress();
+	ibv[SOURCE_TEMPLATE].SizeInBytes = templateBytes;
+	vbv[SOURCE_BATCH].SizeInBytes = chunkVertexBytes;
+	vbv[SOURCE_BATCH].StrideInBytes = vertexStrides[state.format];
+	if(D3DObjects.geometryCache)
+	{
+		ibv[SOURCE_CACHE].BufferLocation = vbv[SOURCE_CACHE].BufferLocation = D3DObjects.geometryCache->GetGPUVirtualAddress();
+		ibv[SOURCE_CACHE].SizeInBytes = vbv[SOURCE_CACHE].SizeInBytes = (UINT)geometryCacheSize;
+		vbv[SOURCE_CACHE].StrideInBytes = sizeof(D3D::WorldVertex);
+	}
+	ibv[SOURCE_BATCH].Format = ibv[SOURCE_TEMPLATE].Format = indexFormat;
+	ibv[SOURCE_CACHE].Format = DXGI_FORMAT_R32_UINT;
+
+	//Recorded right away, as the effect state just set applies to them; the recorder only rebinds what changed
+	for(const DrawRun *r=runs;r!=runs+numRuns;r++)
+	{
+		CommandRecorder::Draw d;
+		d.pipelineState = state.format;
+		ibv[SOURCE_BATCH].BufferLocation = r->chunk;
+		vbv[SOURCE_BATCH].BufferLocation = r->chunk+chunkIndexBytes;
+		d.vertexBuffer = vbv[r->source==SOURCE_CACHE ? SOURCE_CACHE : SOURCE_BATCH];
+		d.surfaceTable = 0;
+		if(state.format==D3D::VF_WORLD)
+			d.surfaceTable = r->source==SOURCE_CACHE ? r->chunk : vbv[SOURCE_BATCH].BufferLocation; //Chunk tables are at the end of the vertex room
+		if(r->source==SOURCE_INSTANCES)
+		{
+			//The first 4-vertex template fan is the quad 0,1,2 0,2,3
+			d.indexBuffer = ibv[SOURCE_TEMPLATE];
+			d.numIndices = 6;
+			d.startIndex = fanTemplateStart[4];
+			d.baseVertex = 0;
+			d.numInstances = r->numIndices;
+			d.startInstance = r->startIndex;
+		}
+		else if(r->source==SOURCE_VERTICES)
+		{
+			ZeroMemory(&d.indexBuffer,sizeof(d.indexBuffer)); //Not indexed
+			d.numIndices = r->numIndices;
+			d.startIndex = 0;
+			d.baseVertex = r->startIndex;
+			d.numInstances = 1;
+			d.startInstance = 0;
+		}
+		else
+		{
+			d.indexBuffer = ibv[r->source];
+			d.numIndices = r->numIndices;
+			d.startIndex = r->startIndex;
+			d.baseVertex = r->baseVertex;
+			d.numInstances = 1;
+			d.startInstance = 0;
+		}
+		recorder.draw(d);
+	}
+	batchStats.draws += numRuns;
+}
+
+/**
+Submit the held back draws, sorted by state. Call this at ordering barriers: before drawing anything that isn't sorted,
+and before changing state that isn't part of the sort key.
+*/
+void D3D::flushDraws()
+{
+	if(deferredDraws.empty())
+		return;
+	std::stable_sort(deferredDraws.begin(),deferredDraws.end(),deferredDrawLess);
+	for(std::vector<DeferredDraw>::iterator d=deferredDraws.begin();d!=deferredDraws.end();d++)
+	{
+		submitDraws(d->state,&deferredRuns[d->firstRun],d->numRuns);
+	}
+	deferredDraws.clear();
+	deferredRuns.clear();
+	deferredPlanes.clear();
 }
 
 /**
@@ -928,7 +1929,7 @@ Commit buffered polys; i.e. draw and remap. Do this before changing state.
 */
 void D3D::commit()
 {
-	if(numUndrawnIndices>0)
+	if(hasUndrawnGeometry())
 	{
 		render();
 		map(false);
@@ -949,22 +1950,13 @@ ID3DX11EffectPass *D3D::switchToPass(int index)
 
 	if(index!=currIndex)
 	{
-		UINT stride;
-		UINT offset;
-		
-		switch (index)
+		//Passes are per vertex format
+		if(index>=0 && index<D3D::DUMMY_NUM_VERTEX_FORMATS)
 		{
-			case 0: //Geometry
-			{
-				stride=sizeof(Vertex);
-				offset = 0;
-				D3DObjects.deviceContext->IASetInputLayout(D3DObjects.vertexLayout);
-				D3DObjects.deviceContext->IASetVertexBuffers( 0, 1, &D3DObjects.vertexBuffer, &stride, &offset );
-				D3DObjects.deviceContext->IASetIndexBuffer(D3DObjects.indexBuffer,DXGI_FORMAT_R32_UINT,0);
-				D3DObjects.deviceContext->OMSetRenderTargets(1,&D3DObjects.renderTargetView,D3DObjects.depthStencilView);	
-				D3DObjects.deviceContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-				break;
-			}
+			//Pipeline state, vertex and index buffers are set per draw by the command recorder
+			D3DObjects.deviceContext->IASetInputLayout(D3DObjects.vertexLayouts[index]);
+			D3DObjects.deviceContext->OMSetRenderTargets(1,&D3DObjects.renderTargetView,D3DObjects.depthStencilView);	
+			D3DObjects.deviceContext->IASetPrimitiveTopology(primitiveTopologies[index]);
 		}
 		currIndex = index;
 
@@ -978,7 +1970,22 @@ Postprocess and Flip
 void D3D::present()
 {
 	HRESULT hr;
+	flushDraws();
+	recordGeometryCopies();
+
+	//The rest of the frame's draws, then the frame list
+	recorder.executeFrame(D3DObjects.cmdQueue.Get());
+
 	hr = D3DObjects.swapChain->Present((options.VSync!=0),0);
+
+	//Upload ring space and command allocators used this frame can be reused once the GPU passes this fence
+	closeBatch();
+	currentFence++;
+	D3DObjects.cmdQueue->Signal(D3DObjects.fence.Get(),currentFence);
+	uploadRing.endFrame(currentFence);
+	recorder.endFrame(currentFence);
+	recorder.beginFrame(currentRenderTargetView(),currentDepthStencilView());
+
 	if(FAILED(hr))
 	{
 		UD3D12RenderDevice::debugs("Present error.");
@@ -989,52 +1996,390 @@ void D3D::present()
 
 /**
 Generate index data so a triangle fan with 'num' vertices is converted to a triangle list. Should be called BEFORE those vertices are buffered.
+Small fans are drawn from the index templates instead if enough equally sized ones follow each other; see flushPendingFans().
 \param num Number of vertices in the triangle fan.
+\return false if there's no room because the upload ring couldn't grow; the fan must be dropped, without buffering its vertices.
 */
-void D3D::indexTriangleFan(int num)
+bool D3D::indexTriangleFan(int num)
 {		
-	//Make sure there's index and vertex buffer room for a triangle fan; if not, the current buffer content is drawn and discarded
-	//Index buffer is checked only, as there's equal or more indices than vertices. There.s 3*(n-1) indices for n vertices.
+	//Make sure there's index and vertex buffer room for a triangle fan; if not, the batch goes on in a new chunk
+	//Index buffer room is also reserved for the pending run, in case it turns out too short for the templates.
 	int newIndices = (num-2)*3;
+	unsigned int pendingIndices = pendingFans*(pendingFanSize-2)*3;
 	
-	if(numIndices+newIndices>I_BUFFER_SIZE)
+	if(batchData==NULL || numIndices+pendingIndices+newIndices>chunkIndices || !hasVertexRoom(num))
 	{
-		D3D::render();
-		D3D::map(true);	
+		if(!D3D::chainChunk())
+			return false;
 	}
 
-	//Generate fan indices
-	int* iBufPtr = (int*)mappedIBuffer.pData;
-	for(int i=1;i<num-1;i++)
+	if(capture.active)
+	{
+		size_t n = capture.indices.size();
+		capture.indices.resize(n+newIndices);
+		fanToList(&capture.indices[n],num,numVerts-capture.firstVertex);
+	}
+
+	//Extend the pending run if possible, otherwise start a new one
+	if(num==pendingFanSize && pendingFans<TEMPLATE_FANS)
+	{
+		pendingFans++;
+		return true;
+	}
+	flushPendingFans();
+	if(options.indexTemplates && num<=MAX_TEMPLATE_FAN)
 	{
-		iBufPtr[numIndices++] = numVerts; //Center point
-		iBufPtr[numIndices++] = numVerts+i;
-		iBufPtr[numIndices++] = numVerts+i+1;		
+		pendingFanSize = num;
+		pendingFans = 1;
+		pendingBaseVertex = numVerts;
+		return true;
 	}
 
-	numUndrawnIndices += newIndices;
+	writeFanIndices(num,numVerts);
+	return true;
 }
 
 /**
-Generate index data for a quad. See indexTriangleFan().
+Start a fan that may reuse vertices buffered for earlier fans, e.g. the corners polygons of a surface have in common. Call this BEFORE
+buffering the fan's new vertices, then index the fan with indexSharedFan(). Room is made for all of the fan's vertices to be new.
+\param num Number of vertices in the fan.
+\param epoch Receives the vertex epoch. Vertex indices remembered from earlier fans may only be used while it stays the same; it changes when
+the batch continues in a new chunk or the vertex format changes.
+\return false if there's no room because the upload ring couldn't grow; the fan must be dropped.
 */
-void D3D::indexQuad()
+bool D3D::beginSharedFan(int num, DWORD &epoch)
+{
+	int newIndices = (num-2)*3;
+	unsigned int pendingIndices = pendingFans*(pendingFanSize-2)*3;
+	
+	if(batchData==NULL || numIndices+pendingIndices+newIndices>chunkIndices || !hasVertexRoom(num))
+	{
+		if(!D3D::chainChunk())
+			return false;
+	}
+
+	//The fan's new vertices would break up a pending template run
+	flushPendingFans();
+	sharedFanFirstVertex = numVerts;
+	epoch = vertexEpoch;
+	return true;
+}
+
+/**
+\return Index the next buffered vertex gets, for use with indexSharedFan().
+*/
+UINT D3D::vertexIndex()
+{
+	return numVerts;
+}
+
+/**
+Write the indices for a fan started with beginSharedFan(). Its indices are always written; the templates only cover consecutive vertices.
+\param vertices Index of each of the fan's vertices, center first; from vertexIndex() for the ones buffered since beginSharedFan().
+\param num Number of vertices in the fan.
+*/
+void D3D::indexSharedFan(const UINT *vertices, int num)
+{
+	if(indexSize==sizeof(WORD))
+		sharedFanToList((WORD*)indexData+numIndices,vertices,num,0);
+	else
+		sharedFanToList((UINT*)indexData+numIndices,vertices,num,0);
+	numIndices += (num-2)*3;
+	numUndrawnIndices += (num-2)*3;
+	batchStats.writtenFans++;
+	batchStats.sharedVertices += num-(numVerts-sharedFanFirstVertex);
+
+	if(capture.active)
+	{
+		for(int i=0;i<num;i++)
+		{
+			if(vertices[i]<capture.firstVertex) //Shared with geometry from before the capture; can't be cached on its own
+			{
+				capture.aborted = true;
+				return;
+			}
+		}
+		size_t n = capture.indices.size();
+		capture.indices.resize(n+(num-2)*3);
+		sharedFanToList(&capture.indices[n],vertices,num,capture.firstVertex);
+	}
+}
+
+/**
+Generate index data for a quad. A quad is a fan of four, see indexTriangleFan().
+\return false if the quad must be dropped.
+*/
+bool D3D::indexQuad()
 {	
-	const int newIndices = 6;
-	if(numIndices+newIndices>I_BUFFER_SIZE)
+	return indexTriangleFan(4);
+}
+
+/**
+Create the static index buffer with fan index templates: for each fan size up to MAX_TEMPLATE_FAN, TEMPLATE_FANS fans with consecutive vertices.
+The data is copied in from the upload ring.
+\return 0 on failure.
+*/
+int D3D::createIndexTemplates()
+{
+	HRESULT hr;
+	UINT numTemplateIndices = 0;
+	for(int n=3;n<=MAX_TEMPLATE_FAN;n++)
+	{
+		fanTemplateStart[n] = numTemplateIndices;
+		numTemplateIndices += TEMPLATE_FANS*(n-2)*3;
+	}
+	UINT bytes = templateBytes = numTemplateIndices*indexSize;
+
+	hr = D3DObjects.device->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(bytes),
+		D3D12_RESOURCE_STATE_COPY_DEST,
+		nullptr,
+		IID_PPV_ARGS(D3DObjects.indexTemplates.GetAddressOf())
+	);
+	if(FAILED(hr))
+	{
+		UD3D12RenderDevice::debugs("Error creating index template buffer.");
+		return 0;
+	}
+
+	D3D12_GPU_VIRTUAL_ADDRESS uploadAddress;
+	BYTE *indices = uploadRing.alloc(bytes,uploadAddress);
+	if(indices==NULL)
+	{
+		UD3D12RenderDevice::debugs("Error allocating index template upload.");
+		return 0;
+	}
+	WORD *shortIndices = (WORD*)indices;
+	UINT *longIndices = (UINT*)indices;
+	for(int n=3;n<=MAX_TEMPLATE_FAN;n++)
+	{
+		for(unsigned int f=0;f<TEMPLATE_FANS;f++)
+		{
+			if(indexSize==sizeof(WORD))
+				shortIndices = fanToList(shortIndices,n,f*n);
+			else
+				longIndices = fanToList(longIndices,n,f*n);
+		}
+	}
+
+	//Copy; done once at startup. No wait is needed: the queue runs the copy before any draw that uses the templates, and the upload ring
+	//only hands its memory out again once the fence passes, see uploadRing.endFrame().
+	ID3D12Resource *ring = uploadRing.getResource();
+	D3DObjects.cmdAlloc->Reset();
+	D3DObjects.cmdList->Reset(D3DObjects.cmdAlloc.Get(),nullptr);
+	D3DObjects.cmdList->CopyBufferRegion(D3DObjects.indexTemplates.Get(),0,ring,uploadAddress-ring->GetGPUVirtualAddress(),bytes);
+	D3DObjects.cmdList->ResourceBarrier(
+		1,
+		&CD3DX12_RESOURCE_BARRIER::Transition(
+			D3DObjects.indexTemplates.Get(),
+			D3D12_RESOURCE_STATE_COPY_DEST,
+			D3D12_RESOURCE_STATE_INDEX_BUFFER
+		)
+	);
+	D3DObjects.cmdList->Close();
+	ID3D12CommandList *lists[] = {D3DObjects.cmdList.Get()};
+	D3DObjects.cmdQueue->ExecuteCommandLists(1,lists);
+	currentFence++;
+	D3DObjects.cmdQueue->Signal(D3DObjects.fence.Get(),currentFence);
+	uploadRing.endFrame(currentFence);
+	return 1;
+}
+
+/**
+\return Batching counters for the last complete frame.
+*/
+const D3D::BatchStats &D3D::getBatchStats()
+{
+	return lastBatchStats;
+}
+
+/**
+\return Index and vertex bytes written to batches so far this frame. Unlike the batching counters this includes the chunk being written.
+*/
+UINT64 D3D::getWrittenBatchBytes()
+{
+	UINT64 bytes = batchStats.indexBytes+batchStats.vertexBytes;
+	if(batchData!=NULL)
+		bytes += numIndices*indexSize+numVerts*vertexStrides[vertexFormat]+numSurfaces*sizeof(D3D::SurfacePasses);
+	return bytes;
+}
+
+/**
+Draw a facet from the static geometry cache.
+\param key Identifies the facet's polygons and everything its texture coordinates depend on.
+\param check World positions of all of the facet's polygon points, in order.
+\param numCheck Number of positions.
+\return false if the facet isn't cached (yet); it should then be buffered between beginCachedGeometry() and endCachedGeometry().
+\note Geometry must be in the VF_WORLD format.
+*/
+bool D3D::drawCachedGeometry(DWORD64 key, const D3D::Vec3 *check, unsigned int numCheck)
+{
+	if(geometryCacheSize==0)
+		return false;
+
+	stdext::hash_map<DWORD64,CachedGeometry>::iterator i = geometryCache.find(key);
+	if(i==geometryCache.end() || i->second.usableFrame>frameCount || vertexData==NULL)
+	{
+		geometryStats.misses++;
+		return false;
+	}
+	const CachedGeometry &g = i->second;
+	const float tolerance = 0.5f; //View to world transform isn't exact
+	bool same = g.check.size()==numCheck;
+	for(unsigned int p=0;same && p<numCheck;p++)
+	{
+		same = fabs(g.check[p].x-check[p].x)<=tolerance && fabs(g.check[p].y-check[p].y)<=tolerance && fabs(g.check[p].z-check[p].z)<=tolerance;
+	}
+	if(!same)
+	{
+		geometryStats.misses++;
+		return false;
+	}
+
+	flushPendingFans();
+	closeWrittenRun();
+	DrawRun r = {SOURCE_CACHE,g.startIndex,g.numIndices,(INT)g.baseVertex,D3DObjects.geometryCache->GetGPUVirtualAddress()+g.surfaceTable};
+	drawRuns.push_back(r);
+	geometryStats.hits++;
+	geometryStats.savedBytes += g.numIndices*sizeof(int)+g.numVertices*sizeof(D3D::WorldVertex)+sizeof(D3D::SurfacePasses);
+	return true;
+}
+
+/**
+Start buffering a facet that is to be added to the static geometry cache. See drawCachedGeometry().
+*/
+void D3D::beginCachedGeometry(DWORD64 key, const D3D::Vec3 *check, unsigned int numCheck)
+{
+	if(geometryCacheSize==0)
+		return;
+	capture.active = true;
+	capture.aborted = false;
+	capture.key = key;
+	capture.check.assign(check,check+numCheck);
+	capture.firstVertex = numVerts;
+	capture.indices.clear();
+}
+
+/**
+Finish buffering a facet; its vertices are copied into the cache at the end of the frame, along with freshly generated indices.
+*/
+void D3D::endCachedGeometry()
+{
+	if(!capture.active)
+		return;
+	capture.active = false;
+	if(capture.aborted || capture.indices.empty() || batchData==NULL || !surfaceInUse)
+		return;
+
+	UINT numVertices = numVerts-capture.firstVertex;
+	UINT numCacheIndices = capture.indices.size();
+	UINT64 vertexBytes = numVertices*sizeof(D3D::WorldVertex);
+	UINT64 indexBytes = numCacheIndices*sizeof(int);
+	UINT64 entryBytes = indexBytes+sizeof(D3D::SurfacePasses);
+
+	//Vertices start at a multiple of the vertex size so they can be addressed by base vertex; the indices and the surface table entry follow.
+	//The vertices keep their offset from the batch's table, so the entry goes at least that far into the cache: the table base, the entry
+	//minus that offset, must lie inside the cache. That only leaves a gap while the cache holds less than a chunk's vertex room.
+	if(max(vertexBytes+indexBytes,(UINT64)surfaceOffset)+sizeof(D3D::SurfacePasses)>geometryCacheSize)
+		return;
+	UINT64 start = (geometryCacheUsed+sizeof(D3D::WorldVertex)-1)/sizeof(D3D::WorldVertex)*sizeof(D3D::WorldVertex);
+	UINT64 entry = max(start+vertexBytes+indexBytes,(UINT64)surfaceOffset);
+	if(entry+sizeof(D3D::SurfacePasses)>geometryCacheSize)
+	{
+		clearGeometryCache();
+		start = 0;
+		entry = max(vertexBytes+indexBytes,(UINT64)surfaceOffset);
+	}
+
+	//The indices can't be allocated from the ring here: the open chunk is the most recent allocation and is shrunk when it's closed
+	IndexCopy indexCopy = {capture.key,cacheIndexStaging.size()*sizeof(UINT),start+vertexBytes,indexBytes};
+	cacheIndexStaging.insert(cacheIndexStaging.end(),capture.indices.begin(),capture.indices.end());
+	indexCopies.push_back(indexCopy);
+
+	D3D12_GPU_VIRTUAL_ADDRESS ringAddress = batchResource->GetGPUVirtualAddress();
+	GeometryCopy vertexCopy = {batchResource,batchGPUAddress+chunkIndexBytes+capture.firstVertex*sizeof(D3D::WorldVertex)-ringAddress,start,vertexBytes};
+	GeometryCopy surfaceCopy = {batchResource,batchGPUAddress+chunkIndexBytes+surfaceOffset-ringAddress,entry,sizeof(D3D::SurfacePasses)};
+	geometryCopies.push_back(vertexCopy);
+	geometryCopies.push_back(surfaceCopy);
+
+	CachedGeometry g;
+	g.baseVertex = (UINT)(start/sizeof(D3D::WorldVertex));
+	g.numVertices = numVertices;
+	g.startIndex = (UINT)((start+vertexBytes)/sizeof(int));
+	g.numIndices = numCacheIndices;
+	g.surfaceTable = entry-surfaceOffset; //The vertices keep their offset from the batch
+	g.check = capture.check;
+	g.usableFrame = frameCount+1;
+	geometryCache[capture.key] = g;
+	geometryCacheUsed = entry+sizeof(D3D::SurfacePasses);
+	geometryStats.uploadBytes += (DWORD)(vertexBytes+entryBytes);
+}
+
+/**
+Record the copies of this frame's new cache entries in the frame list, which executes after all of the frame's draws and before its fence is signaled, so the
+upload ring data is still there and entries that were overwritten have been drawn.
+The staged indices are uploaded first, once the current chunk is closed.
+*/
+void D3D::recordGeometryCopies()
+{
+	if(!indexCopies.empty())
+	{
+		closeBatch();
+		D3D12_GPU_VIRTUAL_ADDRESS indexAddress;
+		UINT64 bytes = cacheIndexStaging.size()*sizeof(UINT);
+		BYTE *indices = uploadRing.alloc(bytes,indexAddress);
+		for(std::vector<IndexCopy>::iterator i=indexCopies.begin();i!=indexCopies.end();i++)
+		{
+			if(indices==NULL) //Entries without indices can't be drawn; their vertex and surface copies are harmless
+			{
+				geometryCache.erase(i->key);
+				continue;
+			}
+			GeometryCopy c = {uploadRing.getResource(),indexAddress-uploadRing.getResource()->GetGPUVirtualAddress()+i->srcOffset,i->dstOffset,i->bytes};
+			geometryCopies.push_back(c);
+		}
+		if(indices!=NULL)
+			memcpy(indices,&cacheIndexStaging[0],bytes);
+		indexCopies.clear();
+		cacheIndexStaging.clear();
+	}
+	if(geometryCopies.empty())
+		return;
+	ID3D12Resource *cache = D3DObjects.geometryCache.Get();
+	ID3D12GraphicsCommandList *list = recorder.getFrameList();
+	list->ResourceBarrier(1,&CD3DX12_RESOURCE_BARRIER::Transition(cache,
+		D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER|D3D12_RESOURCE_STATE_INDEX_BUFFER,D3D12_RESOURCE_STATE_COPY_DEST));
+	for(std::vector<GeometryCopy>::iterator i=geometryCopies.begin();i!=geometryCopies.end();i++)
 	{
-		D3D::render();
-		D3D::map(true);	
+		list->CopyBufferRegion(cache,i->dstOffset,i->src,i->srcOffset,i->bytes);
 	}
-	int* iBufPtr = (int*) mappedIBuffer.pData;
-	iBufPtr[numIndices++] = numVerts;
-	iBufPtr[numIndices++] = numVerts+1;
-	iBufPtr[numIndices++] = numVerts+2;
-	iBufPtr[numIndices++] = numVerts+2;
-	iBufPtr[numIndices++] = numVerts+3;
-	iBufPtr[numIndices++] = numVerts;
+	list->ResourceBarrier(1,&CD3DX12_RESOURCE_BARRIER::Transition(cache,
+		D3D12_RESOURCE_STATE_COPY_DEST,D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER|D3D12_RESOURCE_STATE_INDEX_BUFFER));
+	geometryCopies.clear();
+}
+
+/**
+Empty the static geometry cache.
+\note Copies already queued this frame are dropped; draws from the old data this frame still happen before anything is overwritten.
+*/
+void D3D::clearGeometryCache()
+{
+	geometryStats.evictions += geometryCache.size();
+	geometryCache.clear();
+	geometryCopies.clear();
+	indexCopies.clear();
+	cacheIndexStaging.clear();
+	geometryCacheUsed = 0;
+}
 
-	numUndrawnIndices += newIndices;
+/**
+\return Static geometry cache counters for the last complete frame.
+*/
+const D3D::GeometryCacheStats &D3D::getGeometryCacheStats()
+{
+	return lastGeometryStats;
 }
 
 /**
@@ -1048,6 +2393,7 @@ void D3D::setViewPort(int X, int Y, int left, int top)
 	{
 		
 		commit();
+		flushDraws();
 
 		D3D12_VIEWPORT vp;
 		vp.Width = X;
@@ -1056,6 +2402,7 @@ void D3D::setViewPort(int X, int Y, int left, int top)
 		vp.MaxDepth = 1.0;
 		vp.TopLeftX = left;
 		vp.TopLeftY = top;
+		recorder.setViewport(vp);
 
 		D3DObjects.deviceContext->RSSetViewports(1,&vp);
 		shaderVars.viewportHeight->SetFloat(Y);
@@ -1064,6 +2411,22 @@ void D3D::setViewPort(int X, int Y, int left, int top)
 	oldLeft = left; oldTop = top; oldX = X; oldY = Y;
 }
 
+/**
+Hand out room for the next vertices in the batch. With the StageVertices option they're built in cached memory and written to
+the write-combined upload ring later, in whole cache lines; callers are free to fill them in any order, and to read them back.
+\param num Number of vertices.
+\param stride Size of a vertex in the current format.
+\return Where to write the vertices; valid until the next call.
+*/
+static inline void *newVertices(UINT num, UINT stride)
+{
+	UINT offset = numVerts*stride;
+	numVerts += num;
+	if(options.stageVertices)
+		return vertexStaging.reserve(offset,num*stride);
+	return (BYTE*)vertexData+offset;
+}
+
 /**
 Returns a pointer to the next vertex in the buffer; this can then be set to buffer a model etc.
 \return Vertex pointer.
@@ -1071,7 +2434,178 @@ Returns a pointer to the next vertex in the buffer; this can then be set to buff
 D3D::Vertex *D3D::getVertex()
 {
 	//Return a pointer to a vertex which can be filled in.
-	return (D3D::Vertex*) &((D3D::Vertex*)mappedVBuffer.pData)[numVerts++];
+	return (D3D::Vertex*)newVertices(1,sizeof(D3D::Vertex));
+}
+
+/**
+\return A world vertex to fill in; the vertex format must be VF_WORLD.
+*/
+D3D::WorldVertex *D3D::getWorldVertex()
+{
+	return (D3D::WorldVertex*)newVertices(1,sizeof(D3D::WorldVertex));
+}
+
+/**
+\param num Number of vertices.
+\return num consecutive world vertices to fill in; the vertex format must be VF_WORLD.
+*/
+D3D::WorldVertex *D3D::getWorldVertices(int num)
+{
+	return (D3D::WorldVertex*)newVertices(num,sizeof(D3D::WorldVertex));
+}
+
+/**
+Make room for world vertices that are written later, straight to the upload ring, e.g. by worker threads. They must be written before
+present(), by which time the pointer is still valid.
+\param num Number of vertices.
+\return num consecutive world vertices; the vertex format must be VF_WORLD. NULL if nothing is mapped because the upload ring couldn't grow; room
+should have been made with indexTriangleFan() or beginSharedFan() first, which report that already.
+*/
+D3D::WorldVertex *D3D::reserveWorldVertices(int num)
+{
+	if(vertexData==NULL)
+		return NULL;
+	UINT offset = numVerts*sizeof(D3D::WorldVertex);
+	numVerts += num;
+	vertexStaging.skip(offset+num*sizeof(D3D::WorldVertex)); //Staged vertices mustn't overwrite them
+	return (D3D::WorldVertex*)((BYTE*)vertexData+offset);
+}
+
+/**
+Set the map surface whose world vertices are buffered next. Its texture coordinate transforms go into a table at the end of the chunk,
+which is bound along with the chunk's draws; each chunk the surface's vertices end up in gets a copy.
+\param passes The surface's texture coordinate transforms.
+\note The vertex format must be VF_WORLD. Vertices refer to the entry by offset; see getSurfaceOffset().
+*/
+void D3D::setSurface(const D3D::SurfacePasses &passes)
+{
+	currentSurface = passes;
+	surfaceInUse = false; //The old surface isn't carried over if the batch moves on now
+	if(batchData==NULL)
+		return;
+	//Room for the entry (in vertices) and a small fan, so it isn't written just before the batch has to move on
+	if(!hasVertexRoom((sizeof(D3D::SurfacePasses)+sizeof(D3D::WorldVertex)-1)/sizeof(D3D::WorldVertex)+MAX_TEMPLATE_FAN))
+	{
+		if(!D3D::chainChunk())
+			return;
+	}
+	writeSurface();
+	surfaceInUse = true;
+}
+
+/**
+Declare the plane of the map surface buffered next, before anything of it is buffered or drawn from the cache. If a held back draw has a surface
+in the same plane, the held back draws are submitted first: coplanar surfaces meet at equal depth, so their order decides which one shows.
+\param normal Plane normal, in world space.
+\param distance Distance of the plane from the origin along the normal.
+\note Planes are compared to 1/256 of the normal and a unit of distance; surfaces that are only close to a held back one's plane cause a barrier
+that wasn't needed, but no coplanar ones are sorted.
+*/
+void D3D::setSurfacePlane(const D3D::Vec3 &normal, float distance)
+{
+	if(!options.sortDraws)
+		return;
+	int quantized[4] = {(int)floor(normal.x*256.0f+0.5f),(int)floor(normal.y*256.0f+0.5f),(int)floor(normal.z*256.0f+0.5f),(int)floor(distance+0.5f)};
+	DWORD64 plane = Misc::hashBytes(Misc::HASH_INIT,quantized,sizeof(quantized));
+	if(deferredPlanes.find(plane)!=deferredPlanes.end())
+	{
+		commit();
+		flushDraws();
+		batchStats.planeBarriers++;
+	}
+	pendingPlanes.push_back(plane);
+}
+
+/**
+\return Value for the WorldVertex::surface of the current surface's vertices. Can change whenever room is made for vertices, as the batch may
+go on in a new chunk; get it after indexTriangleFan() or beginSharedFan().
+*/
+DWORD D3D::getSurfaceOffset()
+{
+	return surfaceOffset;
+}
+
+/**
+\return A mesh vertex to fill in; the vertex format must be VF_MESH.
+*/
+D3D::MeshVertex *D3D::getMeshVertex()
+{
+	return (D3D::MeshVertex*)newVertices(1,sizeof(D3D::MeshVertex));
+}
+
+/**
+\return A tile vertex to fill in; the vertex format must be VF_TILE.
+*/
+D3D::TileVertex *D3D::getTileVertex()
+{
+	return (D3D::TileVertex*)newVertices(1,sizeof(D3D::TileVertex));
+}
+
+/**
+Queue the next vertices for a draw without indices, extending the last run of such vertices if they follow it. Room must have been made.
+\param source SOURCE_INSTANCES or SOURCE_VERTICES.
+\param num Number of vertices (instances).
+*/
+static void addUnindexedRun(DrawSource source, UINT num)
+{
+	if(!drawRuns.empty() && drawRuns.back().source==source && drawRuns.back().chunk==batchGPUAddress && drawRuns.back().startIndex+drawRuns.back().numIndices==numVerts)
+	{
+		drawRuns.back().numIndices += num;
+	}
+	else
+	{
+		DrawRun r = {source,numVerts,num,0,batchGPUAddress};
+		drawRuns.push_back(r);
+	}
+}
+
+/**
+Add a tile to the batch; consecutive tiles are drawn with a single instanced draw call. No indices are needed, so unlike other geometry
+there's no indexTriangleFan() call to make room first.
+\return A tile instance to fill in; the vertex format must be VF_TILE_INSTANCE. NULL if the upload ring couldn't grow; the primitive must be dropped.
+*/
+D3D::TileInstance *D3D::getTileInstance()
+{
+	if(batchData==NULL || !hasVertexRoom(1))
+	{
+		if(!D3D::chainChunk())
+			return NULL;
+	}
+	addUnindexedRun(SOURCE_INSTANCES,1);
+	batchStats.tileInstances++;
+	return (D3D::TileInstance*)newVertices(1,sizeof(D3D::TileInstance));
+}
+
+/**
+Add a line to the batch; consecutive lines are drawn with a single line list draw call, without indices.
+\return The line's two vertices to fill in; the vertex format must be VF_LINE. NULL if the upload ring couldn't grow; the primitive must be dropped.
+*/
+D3D::LineVertex *D3D::getLineVertices()
+{
+	if(batchData==NULL || !hasVertexRoom(2))
+	{
+		if(!D3D::chainChunk())
+			return NULL;
+	}
+	addUnindexedRun(SOURCE_VERTICES,2);
+	batchStats.lines++;
+	return (D3D::LineVertex*)newVertices(2,sizeof(D3D::LineVertex));
+}
+
+/**
+Add a point to the batch; like tiles, consecutive points are drawn with a single instanced draw call.
+\return A point instance to fill in; the vertex format must be VF_POINT_INSTANCE. NULL if the upload ring couldn't grow; the primitive must be dropped.
+*/
+D3D::PointInstance *D3D::getPointInstance()
+{
+	if(batchData==NULL || !hasVertexRoom(1))
+	{
+		if(!D3D::chainChunk())
+			return NULL;
+	}
+	addUnindexedRun(SOURCE_INSTANCES,1);
+	batchStats.points++;
+	return (D3D::PointInstance*)newVertices(1,sizeof(D3D::PointInstance));
 }
 
 /**
@@ -1086,6 +2620,7 @@ void D3D::setProjection(float aspect, float XoverZ)
 	if(aspect!=oldAspect || oldXoverZ != XoverZ)
 	{
 		commit();
+		flushDraws();
 		float xzProper = XoverZ*options.zNear; //Scale so larger near Z does not lead to zoomed in view
 		m = XMMatrixPerspectiveOffCenterLH(-xzProper,xzProper,-aspect*xzProper,aspect*xzProper,options.zNear, 32760.0f); //Similar to glFrustum
 		shaderVars.projection->SetMatrix(&m.m[0][0]);
@@ -1094,6 +2629,29 @@ void D3D::setProjection(float aspect, float XoverZ)
 	}
 }
 
+/**
+Set the world to view transform applied to map geometry, which is sent in world space.
+\param origin Viewer position.
+\param xAxis, yAxis, zAxis View axes in world space.
+*/
+void D3D::setView(const D3D::Vec3 &origin, const D3D::Vec3 &xAxis, const D3D::Vec3 &yAxis, const D3D::Vec3 &zAxis)
+{
+	static D3D::Vec3 old[4];
+	D3D::Vec3 v[4] = {origin,xAxis,yAxis,zAxis};
+	if(memcmp(v,old,sizeof(v)))
+	{
+		commit();
+		flushDraws();
+		XMMATRIX m(
+			xAxis.x, yAxis.x, zAxis.x, 0,
+			xAxis.y, yAxis.y, zAxis.y, 0,
+			xAxis.z, yAxis.z, zAxis.z, 0,
+			-(origin.x*xAxis.x+origin.y*xAxis.y+origin.z*xAxis.z), -(origin.x*yAxis.x+origin.y*yAxis.y+origin.z*yAxis.z), -(origin.x*zAxis.x+origin.y*zAxis.y+origin.z*zAxis.z), 1);
+		shaderVars.view->SetMatrix(&m.m[0][0]);
+		memcpy(old,v,sizeof(v));
+	}
+}
+
 /*
 Set shader projection mode. Only changes setting if new parameter differs from current state.
 \param mode Mode (see D3D::ProjectionMode)
@@ -1102,16 +2660,34 @@ The 2nd option results in a switch every time instead of only when starting to d
 */
 void D3D::setProjectionMode(D3D::ProjectionMode mode)
 {
-	static D3D::ProjectionMode m;
-	if(m!=mode)
+	if(currentState.projectionMode!=mode)
 	{
 		commit();
-		shaderVars.projectionMode->SetInt(mode);
-		m= mode;
+		currentState.projectionMode = mode;
 	}
 }
 
 
+/**
+Set the format of the vertices that are to be buffered. Buffered geometry in another format is drawn first.
+Vertices of different formats share the vertex buffer; the vertex count is rounded up so the next vertex starts past the previous ones in the new stride.
+\param format Format (see D3D::VertexFormat).
+\note Like setProjectionMode(), call this at the start of each type of primitive draw call.
+*/
+void D3D::setVertexFormat(D3D::VertexFormat format)
+{
+	if(vertexFormat!=format)
+	{
+		commit();
+		UINT oldStride = vertexStrides[vertexFormat];
+		UINT newStride = vertexStrides[format];
+		numVerts = (numVerts*oldStride+newStride-1)/newStride;
+		vertexFormat = format;
+		vertexEpoch++;
+		surfaceInUse = false;
+	}
+}
+
 /** Handle flags that change depth or blend state. See polyflags.h.
 Only done if flag is different from current.
 If there's any buffered geometry, it will drawn before setting the new flags.
@@ -1122,15 +2698,9 @@ If there's any buffered geometry, it will drawn before setting the new flags.
 **/
 void D3D::setFlags(int flags, int D3DFlags)
 {
-	const int BLEND_FLAGS = PF_Translucent | PF_Modulated |PF_Invisible |PF_Masked
-	#ifdef RUNE
-		| PF_AlphaBlend
-	#endif
-		;
 	const int RELEVANT_FLAGS = BLEND_FLAGS|PF_Occlude;
 	const int RELEVANT_D3D_FLAGS = 0;
 	
-	static int currFlags=0;
 	static int currD3DFlags;
 
 	
@@ -1139,7 +2709,7 @@ void D3D::setFlags(int flags, int D3DFlags)
 		flags |= PF_Occlude;
 	}
 
-	int changedFlags = currFlags ^ flags;
+	int changedFlags = currentState.flags ^ flags;
 	int changedD3DFlags = currD3DFlags ^ D3DFlags;
 	if (changedFlags&RELEVANT_FLAGS || changedD3DFlags & RELEVANT_D3D_FLAGS) //only blend flag changes are relevant	
 	{
@@ -1187,7 +2757,7 @@ void D3D::setFlags(int flags, int D3DFlags)
 			{
 				blendState = states.bstate_NoBlend;
 			}
-			D3DObjects.deviceContext->OMSetBlendState(blendState,NULL,0xffffffff);
+			currentState.blendState = blendState;
 	
 		}
 		
@@ -1199,14 +2769,24 @@ void D3D::setFlags(int flags, int D3DFlags)
 				depthState = states.dstate_Enable;
 			else
 				depthState = states.dstate_Disable;
-			D3DObjects.deviceContext->OMSetDepthStencilState(depthState,1);
+			currentState.depthState = depthState;
 		}
 
-		currFlags = flags;
+		currentState.flags = flags;
 		currD3DFlags = D3DFlags;
+		stateSerial++;
 	}
 }
 
+/**
+\return Number that changes whenever setTexture() binds another texture, setFlags() changes blend or depth state, or a texture is deleted.
+While it stays the same, a caller that set up state for a texture and flags can draw with them again without setting them again.
+*/
+DWORD D3D::getStateSerial()
+{
+	return stateSerial;
+}
+
 /**
 Return D3D12_CPU_DESCRIPTOR_HANDLE with RTV of the current back buffer.
 */
@@ -1256,20 +2836,39 @@ Update a single texture mip using a copy operation.
 void D3D::updateMip(DWORD64 id,int mipNum,D3D11_SUBRESOURCE_DATA &data)
 {
 	ID3D11Resource* resource;
+	D3D::CachedTexture *tex = &textureCache[id];
 
-	//If texture is currently bound, draw buffers before updating
+	//If texture is currently bound, draw buffers before updating. An atlased texture's page is bound along with it, and stays bound when
+	//another texture in the page is switched to without a commit (see setTexture()), so buffered geometry may use it while another id is bound.
 	for(int i=0;i<D3D::DUMMY_NUM_PASSES;i++)
 	{
-		if(texturePasses.boundTextureID[i]==id)
+		if(texturePasses.boundTextureID[i]==id || (tex->resourceView!=NULL && texturePasses.boundView[i]==tex->resourceView))
 		{
+			if(hasUndrawnGeometry())
+				recordCommit(id);
 			commit();
 			break;
 		}
 	}
+	flushDraws(); //Held back draws may use the texture as well
+	recorder.execute(D3DObjects.cmdQueue.Get()); //The update takes effect right away; draws recorded so far must see the old data
 
-	//Update
-	(&textureCache[id])->resourceView->GetResource(&resource);
+	//Update; the upload is the mip's own rows, or rows of blocks for compressed formats
+	UINT rowBytes, rows;
+	if(tex->atlasPage!=-1) //Atlased; write to the texture's rectangle in its page
+	{
+		mipLayout(atlasPages[tex->atlasPage].format,tex->atlasRect.w-2*ATLAS_BORDER,tex->atlasRect.h-2*ATLAS_BORDER,rowBytes,rows);
+		recordUpload(id,data.SysMemPitch*rows);
+		updateAtlasRect(atlasPages[tex->atlasPage],tex->atlasRect,data);
+		return;
+	}
+	tex->resourceView->GetResource(&resource);
+	D3D11_TEXTURE2D_DESC desc;
+	((ID3D11Texture2D*)resource)->GetDesc(&desc);
+	mipLayout(desc.Format,max(desc.Width>>mipNum,1),max(desc.Height>>mipNum,1),rowBytes,rows);
+	recordUpload(id,data.SysMemPitch*rows);
 	D3DObjects.deviceContext->UpdateSubresource(resource,mipNum,NULL,(void*) data.pSysMem,data.SysMemPitch,0);
+	SAFE_RELEASE(resource);
 
 }
 
@@ -1304,16 +2903,192 @@ void D3D::cacheTexture(unsigned __int64 id,TextureMetaData &metadata,ID3D11Textu
 	D3D::CachedTexture c;
 	c.metadata = metadata;
 	c.resourceView = r;
+	c.atlasPage = -1;
+	c.residentMip = 0;
+	c.binds = 0;
+	c.lastBindFrame = frameCount;
 	textureCache[id]=c;	
+	recordCreation(id,desc,textureBytes(desc));
 }
 
 /**
-Returns true if texture is in cache.
+Try to place a lightmap or fog map in an atlas page instead of giving it its own texture.
+On success the metadata's texture coordinate scale and offset are adjusted to address the map's rectangle in the page.
+\param id CacheID to insert texture with.
+\param metadata Texture metadata.
+\param desc Description of the texture as it would be created on its own.
+\param data Mip 0 data.
+
+\return false if the texture is unsuitable for atlasing or no room could be made; caller should create a normal texture.
+*/
+bool D3D::cacheAtlasTexture(DWORD64 id,TextureMetaData &metadata,D3D11_TEXTURE2D_DESC &desc,D3D11_SUBRESOURCE_DATA &data)
+{
+	HRESULT hr;
+
+	if(!options.lightmapAtlas || desc.MipLevels!=1 || desc.Width>ATLAS_MAX_SIZE || desc.Height>ATLAS_MAX_SIZE || atlasTexelSize(desc.Format)==0)
+		return false;
+
+	int w = desc.Width+2*ATLAS_BORDER;
+	int h = desc.Height+2*ATLAS_BORDER;
+
+	//Find a page of the right format with room
+	Atlas::Rect rect;
+	int page = -1;
+	for(unsigned int i=0;i<atlasPages.size();i++)
+	{
+		if(atlasPages[i].format==desc.Format && atlasPages[i].constAlpha==metadata.constAlpha && atlasPages[i].packer->alloc(w,h,rect))
+		{
+			page = i;
+			break;
+		}
+	}
+
+	//None found, start a new page
+	if(page==-1)
+	{
+		AtlasPage p;
+		D3D11_TEXTURE2D_DESC pageDesc = desc;
+		pageDesc.Width = ATLAS_PAGE_SIZE;
+		pageDesc.Height = ATLAS_PAGE_SIZE;
+		pageDesc.MipLevels = 1;
+		pageDesc.Usage = D3D11_USAGE_DEFAULT; //Maps are written into it over time
+		hr = D3DObjects.device->CreateTexture2D(&pageDesc,NULL,&p.texture);
+		if(FAILED(hr))
+		{
+			UD3D12RenderDevice::debugs("Error creating atlas page.");
+			return false;
+		}
+		D3D11_SHADER_RESOURCE_VIEW_DESC srDesc;
+		srDesc.Format = pageDesc.Format;
+		srDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+		srDesc.Texture2D.MostDetailedMip = 0;
+		srDesc.Texture2D.MipLevels = 1;
+		hr = D3DObjects.device->CreateShaderResourceView(p.texture,&srDesc,&p.resourceView);
+		if(FAILED(hr))
+		{
+			UD3D12RenderDevice::debugs("Error creating atlas page shader resource view.");
+			SAFE_RELEASE(p.texture);
+			return false;
+		}
+		p.format = pageDesc.Format;
+		p.constAlpha = metadata.constAlpha;
+		p.packer = new Atlas(ATLAS_PAGE_SIZE,ATLAS_PAGE_SIZE);
+		p.packer->alloc(w,h,rect);
+		atlasPages.push_back(p);
+		page = atlasPages.size()-1;
+	}
+
+	recorder.execute(D3DObjects.cmdQueue.Get()); //The rectangle may have been freed by a texture that draws recorded so far still sample
+	updateAtlasRect(atlasPages[page],rect,data);
+
+	//Map [0,1] of the map to its rectangle in the page
+	float pageSize = (float)ATLAS_PAGE_SIZE;
+	metadata.multU *= desc.Width/pageSize;
+	metadata.multV *= desc.Height/pageSize;
+	metadata.offsetU = (rect.x+ATLAS_BORDER)/pageSize;
+	metadata.offsetV = (rect.y+ATLAS_BORDER)/pageSize;
+
+	//Cache texture; each entry holds a reference to the page's view so it can be released as usual
+	D3D::CachedTexture c;
+	c.metadata = metadata;
+	c.resourceView = atlasPages[page].resourceView;
+	c.resourceView->AddRef();
+	c.atlasPage = page;
+	c.atlasRect = rect;
+	c.residentMip = 0;
+	c.binds = 0;
+	c.lastBindFrame = frameCount;
+	textureCache[id]=c;
+	recordCreation(id,desc,rect.w*rect.h*atlasTexelSize(desc.Format));
+	return true;
+}
+
+/**
+Cache a large static texture with only its small mips uploaded; the rest is streamed in over the following frames by streamMips().
+\param id CacheID to insert texture with.
+\param metadata Texture metadata.
+\param desc Description of the texture as it would be created on its own.
+\param data Data for each mip. Pending mips are copied, so the caller keeps ownership.
+
+\return false if the texture is unsuitable for streaming (small, dynamic, single mip or streaming turned off); caller should create a normal texture.
+*/
+bool D3D::cacheStreamedTexture(DWORD64 id,TextureMetaData &metadata,D3D11_TEXTURE2D_DESC &desc,D3D11_SUBRESOURCE_DATA *data)
+{
+	HRESULT hr;
+
+	if(options.mipStreamBudget<=0 || desc.MipLevels<2 || desc.Usage!=D3D11_USAGE_IMMUTABLE || (desc.Width<STREAM_MIN_SIZE && desc.Height<STREAM_MIN_SIZE))
+		return false;
+
+	//Find the first mip that's small enough to upload now
+	UINT resident = 0;
+	while(resident<desc.MipLevels-1 && max(desc.Width>>resident,desc.Height>>resident)>STREAM_RESIDENT_SIZE)
+		resident++;
+
+	D3D11_TEXTURE2D_DESC streamDesc = desc;
+	streamDesc.Usage = D3D11_USAGE_DEFAULT; //Filled in over time
+	StreamingTexture s;
+	hr = D3DObjects.device->CreateTexture2D(&streamDesc,NULL,&s.texture);
+	if(FAILED(hr))
+	{
+		UD3D12RenderDevice::debugs("Error creating streamed texture.");
+		return false;
+	}
+
+	s.mips.resize(desc.MipLevels,NULL);
+	s.pitches.resize(desc.MipLevels,0);
+	s.sizes.resize(desc.MipLevels,0);
+	for(UINT i=0;i<desc.MipLevels;i++)
+	{
+		if(i>=resident)
+		{
+			D3DObjects.deviceContext->UpdateSubresource(s.texture,i,NULL,data[i].pSysMem,data[i].SysMemPitch,0);
+			continue;
+		}
+		//Copy up to the end of the last row only; the pitch can skip data that mustn't be read (see TexConversion)
+		UINT rowBytes, rows;
+		mipLayout(desc.Format,max(desc.Width>>i,1),max(desc.Height>>i,1),rowBytes,rows);
+		s.sizes[i] = (rows-1)*data[i].SysMemPitch+rowBytes;
+		s.pitches[i] = data[i].SysMemPitch;
+		s.mips[i] = new BYTE[s.sizes[i]];
+		memcpy(s.mips[i],data[i].pSysMem,s.sizes[i]);
+	}
+
+	D3D::CachedTexture c;
+	c.resourceView = createClampedView(s.texture,resident);
+	if(c.resourceView==NULL)
+	{
+		for(UINT i=0;i<resident;i++)
+			delete [] s.mips[i];
+		SAFE_RELEASE(s.texture);
+		return false;
+	}
+	c.metadata = metadata;
+	c.atlasPage = -1;
+	c.residentMip = resident;
+	c.binds = 0;
+	c.lastBindFrame = frameCount;
+	textureCache[id]=c;
+	streamingTextures[id]=s;
+	UINT pendingBytes = 0;
+	for(UINT i=0;i<resident;i++)
+		pendingBytes += s.sizes[i];
+	recordCreation(id,desc,textureBytes(desc)-pendingBytes);
+	return true;
+}
+
+/**
+Returns true if texture is in cache. Counted as a cache hit or miss.
 \param id CacheID for texture.
 */
 bool D3D::textureIsCached(DWORD64 id)
 {	
-	return textureCache.find(id) != textureCache.end();
+	if(textureCache.find(id) != textureCache.end())
+	{
+		frameStats.hits++;
+		return true;
+	}
+	frameStats.misses++;
+	return false;
 }
 
 /**
@@ -1339,29 +3114,51 @@ D3D::TextureMetaData *D3D::setTexture(D3D::TexturePass pass,DWORD64 id)
 	if(id!=texturePasses.boundTextureID[pass]) //If different texture than previous one, draw geometry in buffer and switch to new texture
 	{			
 		texturePasses.boundTextureID[pass]=id;
+		stateSerial++;
+
+		//Texture in the same atlas page as the current one; only the metadata changes, no need to commit
+		if(id!=NULL && texturePasses.boundView[pass]!=NULL)
+		{
+			stdext::hash_map<DWORD64,D3D::CachedTexture>::iterator i = textureCache.find(id);
+			if(i!=textureCache.end() && i->second.resourceView==texturePasses.boundView[pass])
+			{
+				i->second.binds++;
+				i->second.lastBindFrame = frameCount;
+				recordBind(id);
+				metadata[pass] = &i->second.metadata;
+				return metadata[pass];
+			}
+		}
 		
+		if(hasUndrawnGeometry() && id!=NULL)
+			recordCommit(id);
 		commit();
 
 		if(id==NULL) //Turn off texture
 		{
 			texturePasses.enabled[pass]=FALSE;
+			texturePasses.boundView[pass]=NULL;
 			metadata[pass]=NULL;	
-			shaderVars.useTexturePass->SetBoolArray(texturePasses.enabled,0,D3D::DUMMY_NUM_PASSES);
 		}
 		else
 		{
 			//Turn on and switch to new texture			
-			D3D::CachedTexture *tex;
-			if(!textureIsCached(id)) //Texture not in cache, conversion probably went wrong.
+			stdext::hash_map<DWORD64,D3D::CachedTexture>::iterator i = textureCache.find(id);
+			if(i==textureCache.end()) //Texture not in cache, conversion probably went wrong.
+			{
+				texturePasses.boundView[pass]=NULL;
 				return NULL;
-			tex = &textureCache[id];			
+			}
+			D3D::CachedTexture *tex = &i->second;
+			tex->binds++;
+			tex->lastBindFrame = frameCount;
+			recordBind(id);
 		
-			shaderVars.shaderTextures->SetResourceArray(&tex->resourceView,pass,1);	
-			if(!texturePasses.enabled[pass]) //Only updating this on change is faster than always doing it
-			{				
-				texturePasses.enabled[pass]=TRUE;
-				shaderVars.useTexturePass->SetBoolArray(texturePasses.enabled,0,D3D::DUMMY_NUM_PASSES); 
-			}			
+			//Shader variables are set by submitDraws()
+			texturePasses.boundView[pass]=tex->resourceView;
+			texturePasses.enabled[pass]=TRUE;
+			texturePasses.format[pass]=tex->metadata.shaderFormat;
+			texturePasses.alpha[pass]=tex->metadata.constAlpha;
 			metadata[pass] = &tex->metadata;
 		}
 		
@@ -1378,8 +3175,17 @@ void D3D::deleteTexture(DWORD64 id)
 	stdext::hash_map<DWORD64,D3D::CachedTexture>::iterator i = textureCache.find(id);
 	if(i==textureCache.end())
 		return;
+	flushDraws(); //Held back draws may use the view
+	if(i->second.atlasPage!=-1)
+		atlasPages[i->second.atlasPage].packer->free(i->second.atlasRect);
+	stdext::hash_map<DWORD64,StreamingTexture>::iterator s = streamingTextures.find(id);
+	if(s!=streamingTextures.end())
+		releaseStreamingTexture(s);
 	SAFE_RELEASE(i->second.resourceView);
 	textureCache.erase(i);
+	frameStats.evictions++;
+	traceRecord(TEXTRACE_DELETE,id,getStats(id).bytes);
+	stateSerial++; //Metadata returned by setTexture() for it is gone
 }
 
 /**
@@ -1387,6 +3193,8 @@ Clear texture cache.
 */
 void D3D::flush()
 {
+	commit();
+	flushDraws();
 	for(int i=0;i<D3D::DUMMY_NUM_PASSES;i++)
 	{
 		setTexture((D3D::TexturePass)i,NULL);
@@ -1397,8 +3205,91 @@ void D3D::flush()
 	{	
 		while(i->second.resourceView)
 			SAFE_RELEASE(i->second.resourceView);
+		traceRecord(TEXTRACE_DELETE,i->first,getStats(i->first).bytes);
 	}
+	frameStats.evictions += textureCache.size();
 	textureCache.clear();
+	stateSerial++;
+
+	//New map; cached geometry is of no use anymore
+	clearGeometryCache();
+	while(!streamingTextures.empty())
+		releaseStreamingTexture(streamingTextures.begin());
+
+	//Throw away atlas pages; they're rebuilt (without fragmentation) as maps get recached
+	for(unsigned int i=0;i<atlasPages.size();i++)
+	{
+		delete atlasPages[i].packer;
+		SAFE_RELEASE(atlasPages[i].resourceView);
+		SAFE_RELEASE(atlasPages[i].texture);
+	}
+	atlasPages.clear();
+}
+
+/**
+Upload pending mips of streamed textures, most detailed last, until the per frame budget is used up.
+Textures are handled in order of priority: times bound, divided by the number of frames since they were last bound.
+At least one mip is uploaded each frame so streaming always progresses.
+*/
+void D3D::streamMips()
+{
+	if(streamingTextures.empty())
+		return;
+
+	LARGE_INTEGER frequency, start, now;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	std::vector<std::pair<float,DWORD64>> order;
+	for(stdext::hash_map<DWORD64,StreamingTexture>::iterator i=streamingTextures.begin();i!=streamingTextures.end();i++)
+	{
+		D3D::CachedTexture &c = textureCache[i->first];
+		order.push_back(std::make_pair((float)(c.binds+1)/(float)(frameCount-c.lastBindFrame+1),i->first));
+	}
+	std::sort(order.rbegin(),order.rend());
+
+	UINT budget = options.mipStreamBudget*1024;
+	UINT uploaded = 0;
+	for(unsigned int t=0;t<order.size();t++)
+	{
+		stdext::hash_map<DWORD64,StreamingTexture>::iterator s = streamingTextures.find(order[t].second);
+		D3D::CachedTexture &c = textureCache[order[t].second];
+		while(c.residentMip>0)
+		{
+			if(uploaded>0)
+			{
+				QueryPerformanceCounter(&now);
+				if(uploaded>=budget || (options.mipStreamTime>0 && (now.QuadPart-start.QuadPart)*1000000/frequency.QuadPart>=options.mipStreamTime))
+					return;
+			}
+
+			int mip = c.residentMip-1;
+			ID3D11ShaderResourceView *view = createClampedView(s->second.texture,mip);
+			if(view==NULL)
+				break;
+			recorder.execute(D3DObjects.cmdQueue.Get()); //Draws recorded so far sample the texture without this mip
+			D3DObjects.deviceContext->UpdateSubresource(s->second.texture,mip,NULL,s->second.mips[mip],s->second.pitches[mip],0);
+			uploaded += s->second.sizes[mip];
+			recordUpload(s->first,s->second.sizes[mip]);
+			delete [] s->second.mips[mip];
+			s->second.mips[mip] = NULL;
+
+			//Switch to the new view, also where it's bound
+			for(int pass=0;pass<D3D::DUMMY_NUM_PASSES;pass++)
+			{
+				if(texturePasses.boundView[pass]==c.resourceView)
+				{
+					commit();
+					texturePasses.boundView[pass] = view;
+				}
+			}
+			SAFE_RELEASE(c.resourceView);
+			c.resourceView = view;
+			c.residentMip = mip;
+		}
+		if(c.residentMip==0)
+			releaseStreamingTexture(s);
+	}
 }
 
 
@@ -1418,6 +3309,7 @@ Set the shader's fog settings.
 void D3D::fog(float dist, D3D::Vec4 *color)
 {
 	commit(); //Draw previous stuff that required different fog settings.
+	flushDraws();
 	shaderVars.fogDist->SetFloat(dist);
 	if(dist>0)
 	{		
@@ -1599,4 +3491,127 @@ void D3D::setBrightness(float brightness)
 {
 	if(shaderVars.brightness->IsValid())
 		shaderVars.brightness->SetFloat(brightness);
-}
\ No newline at end of file
+}
+
+/**
+Returns the options in effect (after clamping to what's supported).
+*/
+const D3D::Options &D3D::getOptions()
+{
+	return options;
+}
+
+/**
+Add time spent converting a texture to its statistics.
+\param id CacheID.
+\param ms Milliseconds.
+*/
+void D3D::addConversionTime(DWORD64 id,double ms)
+{
+	getStats(id).convertTime += ms;
+}
+
+/**
+Get the statistics of all textures cached since the last reset.
+\param stats Receives the statistics, in no particular order.
+*/
+void D3D::getTextureStats(std::vector<D3D::TextureStats> &stats)
+{
+	stats.clear();
+	stats.reserve(textureStats.size());
+	for(stdext::hash_map<DWORD64,D3D::TextureStats>::iterator i=textureStats.begin();i!=textureStats.end();i++)
+	{
+		stats.push_back(i->second);
+	}
+}
+
+/**
+Forget the per texture statistics.
+*/
+void D3D::resetTextureStats()
+{
+	textureStats.clear();
+}
+
+/**
+\return Texture cache counters for the last complete frame.
+*/
+const D3D::CacheStats &D3D::getCacheStats()
+{
+	return lastFrameStats;
+}
+
+/**
+\return Upload ring usage and GPU wait counters.
+*/
+const UploadRing::Stats &D3D::getRingStats()
+{
+	return uploadRing.getStats();
+}
+
+/**
+\return Command list recording counters for the last frame.
+*/
+const CommandRecorder::Stats &D3D::getRecordStats()
+{
+	return recorder.getStats();
+}
+
+/**
+\return Vertex staging counters since startup.
+*/
+const VertexStaging::Stats &D3D::getStagingStats()
+{
+	return vertexStaging.getStats();
+}
+
+/**
+Time writing vertices to upload ring memory, directly and through staging; see VertexStaging::benchmark().
+The memory used is taken from the ring and handed back with the frame.
+\param directMBs Receives the direct write throughput, in MB/s.
+\param stagedMBs Receives the staged throughput, in MB/s.
+\return false if the ring had no room.
+*/
+bool D3D::benchmarkStaging(double &directMBs, double &stagedMBs)
+{
+	const UINT BENCH_BYTES = 1024*1024;
+	D3D12_GPU_VIRTUAL_ADDRESS address;
+	BYTE *memory = uploadRing.alloc(BENCH_BYTES,address);
+	if(memory==NULL)
+		return false;
+	VertexStaging::benchmark(memory,BENCH_BYTES,50,directMBs,stagedMBs);
+	return true;
+}
+
+/**
+Start writing a texture cache trace: every frame, texture bind, texture creation and texture deletion is logged with the texture's size.
+Replay it with Tools/texcachesim to compare eviction policies and budgets.
+\param fileName File to write to; overwritten.
+\return false if the file couldn't be opened.
+*/
+bool D3D::startTextureTrace(const char *fileName)
+{
+	stopTextureTrace();
+	if(fopen_s(&traceFile,fileName,"wb")!=0)
+	{
+		traceFile = NULL;
+		return false;
+	}
+	setvbuf(traceFile,NULL,_IOFBF,1<<20);
+	TexTraceHeader header = {TEXTRACE_MAGIC,TEXTRACE_VERSION};
+	fwrite(&header,sizeof(header),1,traceFile);
+	traceRecord(TEXTRACE_FRAME,0,frameCount);
+	return true;
+}
+
+/**
+Stop writing the texture cache trace.
+*/
+void D3D::stopTextureTrace()
+{
+	if(traceFile)
+	{
+		fclose(traceFile);
+		traceFile = NULL;
+	}
+}
@@ -8,6 +8,14 @@
 
 #include <d3d12.h>
 #include "include/directx/d3dx12.h"
+#include <vector>
+#include "atlas.h"
+#include "uploadring.h"
+#include "cmdrecorder.h"
+#include "vertexstaging.h"
+
+struct DrawState; /**< State a set of draws is submitted with, see d3d.cpp */
+struct DrawRun; /**< A single draw call, see d3d.cpp */
 
 class D3D
 {
@@ -16,9 +24,17 @@ private:
 	static int createRenderTargetViews();
 	static int findAALevel();
 	static void commit();
+	static void closeBatch();
+	static bool chainChunk();
+	static int createIndexTemplates();
+	static void recordGeometryCopies();
+	static void clearGeometryCache();
+	static void submitDraws(const DrawState &state, const DrawRun *runs, UINT numRuns);
+	static void flushDraws();
 	static ID3DX11EffectPass* switchToPass(int index); // TODO: Find D3D12 replacement
 	static D3D12_CPU_DESCRIPTOR_HANDLE currentRenderTargetView();
 	static D3D12_CPU_DESCRIPTOR_HANDLE currentDepthStencilView();
+	static void streamMips();
 	
 public:
 	/**
@@ -35,6 +51,14 @@ public:
 	*/
 	enum ProjectionMode {PROJ_NORMAL,PROJ_Z_ONLY,PROJ_COMPENSATE_Z_NEAR};
 
+	/**
+	How a texture's data is stored, so the shader can decode it.
+	SHADERFMT_RGBA is a normal texture; BGRA7 lightmaps and fog maps are stored like this too, and swizzled/scaled in the shader.
+	SHADERFMT_BGRA7_COMPACT is a B5G6R5 lightmap or fog map scaled to the full range; alpha comes from a constant.
+	SHADERFMT_GRAY is a single channel grayscale texture; alpha comes from a constant.
+	*/
+	enum ShaderFormat {SHADERFMT_RGBA,SHADERFMT_BGRA7_COMPACT,SHADERFMT_GRAY};
+
 	/**
 	Custom flags to set render state from renderer interface.
 	*/
@@ -75,6 +99,72 @@ public:
 		DWORD flags;
 	};
 
+	/**
+	Vertex formats, one per type of draw call, so each only uploads what it uses. Every format has its own input layout, vertex shader and pipeline state.
+	VF_GENERIC is the full Vertex; VF_WORLD is for map surfaces, VF_MESH for models and fog surfaces, VF_TILE for tiles.
+	VF_TILE_INSTANCE holds one TileInstance per tile instead of vertices; its draws are instanced quads.
+	VF_LINE and VF_POINT_INSTANCE are the editor's untextured lines and points; VF_LINE is the only format drawn as a line list.
+	\note Order matches the passes in the effect's technique.
+	*/
+	enum VertexFormat {VF_GENERIC,VF_WORLD,VF_MESH,VF_TILE,VF_TILE_INSTANCE,VF_LINE,VF_POINT_INSTANCE,DUMMY_NUM_VERTEX_FORMATS};
+
+	/**
+	Map surface vertex, in world space; lighting comes from the light map so there's no color, and no normal as the geometry shader works it out.
+	Only the surface's base texture coordinates are sent; the vertex shader derives each pass' from them using the surface's SurfacePasses.
+	*/
+	struct WorldVertex
+	{
+		Vec3 Pos;
+		Vec2 TexCoord; /**< Position along the surface's texture axes, relative to its map origin */
+		DWORD flags;
+		DWORD surface; /**< Byte offset of the surface's SurfacePasses in the surface table drawn with; see setSurface() */
+	};
+
+	/** Per pass texture coordinates of a map surface, as a scale and bias of the WorldVertex coordinates; all zero for unused passes */
+	struct SurfacePasses
+	{
+		Vec4 pass[D3D::DUMMY_NUM_PASSES]; /**< U scale, V scale, U bias, V bias */
+	};
+
+	/** Model and fog surface vertex; 8 bit color and fog (see packColor()), diffuse texture only */
+	struct MeshVertex
+	{
+		Vec3 Pos;
+		DWORD Color;
+		DWORD Fog;
+		Vec2 TexCoord;
+		DWORD flags;
+	};
+
+	/** Tile vertex; laid out as MeshVertex, but projected by the vertex shader as a screen space element */
+	typedef MeshVertex TileVertex;
+
+	/** A whole tile; the vertex shader expands it to a quad, taking the corner from the vertex index */
+	struct TileInstance
+	{
+		Vec4 Rect; /**< Left, top, right, bottom in screen space */
+		Vec4 TexRect; /**< Texture coordinates of the same corners */
+		FLOAT Z;
+		DWORD Color; /**< See packColor() */
+		DWORD Fog;
+		DWORD flags;
+	};
+
+	/** Line end, in screen space like tiles; untextured */
+	struct LineVertex
+	{
+		Vec3 Pos;
+		DWORD Color; /**< See packColor() */
+	};
+
+	/** An editor point: an untextured screen space rectangle, expanded to a quad by the vertex shader like a TileInstance */
+	struct PointInstance
+	{
+		Vec4 Rect; /**< Left, top, right, bottom in screen space */
+		FLOAT Z;
+		DWORD Color; /**< See packColor() */
+	};
+
 	/** Most basic vertex for post processing */
 	struct SimpleVertex
 	{
@@ -90,7 +180,12 @@ public:
 		/** Precalculated parameters with which to normalize texture coordinates */
 		FLOAT multU;
 		FLOAT multV;
+		/** Offset added after scaling with mult; places the coordinates inside the texture's rectangle for atlased textures, 0 otherwise */
+		FLOAT offsetU;
+		FLOAT offsetV;
 		bool masked; /**< Tracked to fix masking issues, see UD3D11RenderDevice::PrecacheTexture */
+		D3D::ShaderFormat shaderFormat; /**< How the shader should decode the texture */
+		FLOAT constAlpha; /**< Alpha for formats that don't store it */
 	};
 
 	/** Cached, API format texture */
@@ -98,6 +193,82 @@ public:
 	{
 		TextureMetaData metadata;
 		ID3D11ShaderResourceView* resourceView;
+		int atlasPage; /**< Atlas page the texture lives in, -1 if it has its own texture */
+		Atlas::Rect atlasRect; /**< Rectangle in the atlas page, including guard border */
+		int residentMip; /**< Most detailed mip the resource view covers; above 0 while the higher mips are still streaming in */
+		DWORD binds; /**< Number of times the texture was bound */
+		DWORD lastBindFrame; /**< Frame the texture was last bound in */
+	};
+
+	/** Statistics kept per texture for the texture cache report. Kept when the texture is deleted, so recaching shows up */
+	struct TextureStats
+	{
+		DWORD64 id; /**< CacheID */
+		const char *format; /**< Storage format name */
+		UINT width;
+		UINT height;
+		UINT mips;
+		UINT bytes; /**< Memory used by all mips */
+		double convertTime; /**< Total time spent converting, in milliseconds */
+		DWORD creations; /**< Times the texture was (re)created */
+		DWORD uploads; /**< Uploads, including creation and streamed mips */
+		DWORD64 uploadBytes;
+		DWORD binds;
+		DWORD maxFrameBinds; /**< Most binds in a single frame */
+		DWORD commits; /**< Buffer commits (batch breaks) caused by binding or updating the texture */
+		DWORD frameBinds; /**< Binds in frame lastFrame */
+		DWORD lastFrame;
+	};
+
+	/** Texture cache counters for a frame */
+	struct CacheStats
+	{
+		DWORD hits; /**< Lookups of textures that were cached */
+		DWORD misses; /**< Lookups of textures that weren't */
+		DWORD evictions; /**< Textures deleted for recaching or by a flush */
+		DWORD uploads;
+		DWORD uploadBytes;
+		DWORD binds;
+		DWORD commits; /**< Commits caused by texture switches and updates */
+	};
+
+	/** Vertex and index batching counters for a frame */
+	struct BatchStats
+	{
+		DWORD batches; /**< Upload ring batch chunks filled */
+		DWORD chainedChunks; /**< Chunks started because the previous one was full, continuing the batch */
+		DWORD chunkIndices; /**< Index room per chunk this frame; chunk sizes follow the geometry of recent frames */
+		DWORD chunkVertexBytes;
+		DWORD highWaterIndices; /**< Most indices written in a frame so far */
+		DWORD highWaterVertexBytes;
+		DWORD draws; /**< Draw calls */
+		DWORD writtenFans; /**< Fans (and quads) that had their indices written */
+		DWORD templatedFans; /**< Fans drawn from the index templates */
+		DWORD tileInstances; /**< Tiles drawn as instances */
+		DWORD lines; /**< Editor lines */
+		DWORD points; /**< Editor points, drawn as instances */
+		DWORD sharedVertices; /**< Fan vertices that reused one buffered for an earlier fan instead of being buffered again */
+		DWORD surfaces; /**< Map surface table entries written; counted in vertexBytes */
+		DWORD indexBytes; /**< Index data written */
+		DWORD vertexBytes; /**< Vertex data written */
+		DWORD groups; /**< Sets of draws sharing state, one per render() that had something to draw */
+		DWORD sortedGroups; /**< Groups held back and sorted by state */
+		DWORD sortedTranslucentGroups; /**< Sorted groups that were translucent */
+		DWORD planeBarriers; /**< Times held back draws were submitted early because a map surface was in the plane of one of them */
+		DWORD stateChanges; /**< State switches between the groups as submitted */
+		DWORD unsortedStateChanges; /**< State switches the groups would have needed in engine order */
+	};
+
+	/** Static geometry cache counters for a frame */
+	struct GeometryCacheStats
+	{
+		DWORD hits;
+		DWORD misses;
+		DWORD evictions; /**< Entries thrown out because the cache was full or flushed */
+		DWORD savedBytes; /**< Vertex and index data not uploaded thanks to hits */
+		DWORD uploadBytes; /**< Data copied into the cache */
+		DWORD entries; /**< Cached facets */
+		DWORD usedBytes;
 	};
 
 	/** Options, some user configurable */
@@ -112,6 +283,23 @@ public:
 		int POM; /**< Parallax occlusion mapping */
 		int alphaToCoverage; /**< Alpha to coverage support */
 		float zNear; /**< Near Z value used in shader and for projection matrix */
+		int lightmapAtlas; /**< Pack lightmaps and fog maps into shared atlas pages */
+		int compactLightmaps; /**< Store lightmaps and fog maps as 16 bit where possible */
+		int singleChannelTextures; /**< Store grayscale textures as a single channel */
+		int generateMips; /**< Generate mipmaps for textures that come without them */
+		int mipStreamBudget; /**< KB of mip data streamed in per frame; 0 uploads textures whole */
+		int mipStreamTime; /**< Microseconds per frame spent streaming mips; 0 for no time limit */
+		int framesInFlight; /**< Frames the upload ring has room for before the CPU has to wait for the GPU */
+		int indexTemplates; /**< Draw runs of small fans from static index templates instead of writing their indices */
+		int geometryCacheSize; /**< MB of GPU memory for caching map geometry; 0 disables the cache */
+		int sortDraws; /**< Hold back opaque map surface draws and submit them sorted by state */
+		int sortTranslucentDraws; /**< Sort runs of translucent draws by state as well */
+		int shortIndices; /**< Use 16 bit indices for batches and index templates */
+		int instancedTiles; /**< Send tiles as one instance each instead of four vertices */
+		int stageVertices; /**< Build vertices in cached memory and copy them to the upload ring in whole cache lines */
+		int shareVertices; /**< Buffer vertices shared by the polygons of a surface or mesh once, and index them from each */
+		int parallelVertices; /**< Generate map surface vertices on the worker threads at the end of the frame */
+		int cullDetail; /**< Leave out the detail texture of map surfaces too far away for it to show */
 	};
 	
 	/**@name API initialization/upkeep */
@@ -137,9 +325,37 @@ public:
 
 	/**@name Index and buffer vertices */
 	//@{
-	static void indexTriangleFan(int num);
-	static void indexQuad();
+	static bool indexTriangleFan(int num);
+	static bool indexQuad();
 	static D3D::Vertex* getVertex();
+	static D3D::WorldVertex* getWorldVertex();
+	static D3D::WorldVertex* getWorldVertices(int num);
+	static D3D::WorldVertex* reserveWorldVertices(int num);
+	static void setSurface(const D3D::SurfacePasses &passes);
+	static void setSurfacePlane(const D3D::Vec3 &normal, float distance);
+	static DWORD getSurfaceOffset();
+	static D3D::MeshVertex* getMeshVertex();
+	static D3D::TileVertex* getTileVertex();
+	static D3D::TileInstance* getTileInstance();
+	static D3D::LineVertex* getLineVertices();
+	static D3D::PointInstance* getPointInstance();
+	static bool beginSharedFan(int num, DWORD &epoch);
+	static UINT vertexIndex();
+	static void indexSharedFan(const UINT *vertices, int num);
+
+	/**
+	Pack a color with [0,1] components into the 8 bit per channel (R8G8B8A8_UNORM) form used by the compact vertex formats. Out of range components are clamped.
+	*/
+	static DWORD packColor(const FLOAT *color)
+	{
+		DWORD packed = 0;
+		for(int i=0;i<4;i++)
+		{
+			FLOAT c = color[i]*255.0f+0.5f;
+			packed |= (c<=0.0f ? 0 : (c>=255.0f ? 255 : (DWORD)c)) << (i*8);
+		}
+		return packed;
+	}
 	
 	//@}
 	
@@ -149,6 +365,16 @@ public:
 	static void setProjectionMode(D3D::ProjectionMode mode);
 	static void setProjection(float aspect, float XoverZ);
 	static void setFlags(int flags, int d3dflags);
+	static void setVertexFormat(D3D::VertexFormat format);
+	static DWORD getStateSerial();
+	static void setView(const D3D::Vec3 &origin, const D3D::Vec3 &xAxis, const D3D::Vec3 &yAxis, const D3D::Vec3 &zAxis);
+	//@}
+
+	/**@name Static geometry cache */
+	//@{
+	static bool drawCachedGeometry(DWORD64 key, const D3D::Vec3 *check, unsigned int numCheck);
+	static void beginCachedGeometry(DWORD64 key, const D3D::Vec3 *check, unsigned int numCheck);
+	static void endCachedGeometry();
 	//@}
 	
 	/**@name Texture cache */
@@ -156,6 +382,8 @@ public:
 	static ID3D11Texture2D *createTexture(D3D11_TEXTURE2D_DESC &desc, D3D11_SUBRESOURCE_DATA &data);
 	static void updateMip(DWORD64 id,int mipNum,D3D11_SUBRESOURCE_DATA &data);
 	static void cacheTexture(DWORD64 id,TextureMetaData &metadata,ID3D11Texture2D *tex);
+	static bool cacheAtlasTexture(DWORD64 id,TextureMetaData &metadata,D3D11_TEXTURE2D_DESC &desc,D3D11_SUBRESOURCE_DATA &data);
+	static bool cacheStreamedTexture(DWORD64 id,TextureMetaData &metadata,D3D11_TEXTURE2D_DESC &desc,D3D11_SUBRESOURCE_DATA *data);
 	static bool textureIsCached(DWORD64 id);	
 	static D3D::TextureMetaData &getTextureMetaData(DWORD64 id);
 	static D3D::TextureMetaData *setTexture(D3D::TexturePass pass,DWORD64 id);
@@ -170,5 +398,23 @@ public:
 	static TCHAR *getModes();
 	static void getScreenshot(D3D::Vec4_byte* buf);
 	static void setBrightness(float brightness);
+	static const D3D::Options &getOptions();
+	//@}
+
+	/**@name Statistics */
+	//@{
+	static void addConversionTime(DWORD64 id,double ms);
+	static void getTextureStats(std::vector<D3D::TextureStats> &stats);
+	static void resetTextureStats();
+	static const D3D::CacheStats &getCacheStats();
+	static const UploadRing::Stats &getRingStats();
+	static const CommandRecorder::Stats &getRecordStats();
+	static const VertexStaging::Stats &getStagingStats();
+	static bool benchmarkStaging(double &directMBs, double &stagedMBs);
+	static const D3D::BatchStats &getBatchStats();
+	static UINT64 getWrittenBatchBytes();
+	static const D3D::GeometryCacheStats &getGeometryCacheStats();
+	static bool startTextureTrace(const char *fileName);
+	static void stopTextureTrace();
 	//@}
 };
\ No newline at end of file
@@ -17,11 +17,16 @@ Called UD3D11RenderDevice as Unreal leaves out first letter when accessing the c
 #include <stdio.h>
 #include <io.h>
 #include <FCNTL.H>
+#include <vector>
+#include <algorithm>
 #include "resource.h"
 #include "d3d12drv.h"
 #include "texconversion.h"
 #include "customflags.h"
 #include "misc.h"
+#include "workers.h"
+#include "vertexgen.h"
+#include "vertexdedup.h"
 
 
 //UObject glue
@@ -30,8 +35,26 @@ IMPLEMENT_CLASS(UD3D12RenderDevice);
 
 static bool drawingWeapon; /** Whether the depth buffer was cleared and projection parameters set to draw the weapon model */
 static int customFOV; /**Field of view calculated from aspect ratio */
+static VertexDedup surfaceVertices; /** Vertices buffered for the points of the facet being drawn, see DrawComplexSurface() */
+static VertexDedup meshVertices; /** Vertices buffered for recent mesh points, see DrawGouraudPolygon() */
+static DWORD meshVerticesEpoch; /** Vertex epoch meshVertices is valid for */
+/** Texture and flags set up by the last mesh or tile call, see setPolyState() */
+static struct
+{
+	DWORD64 cacheID;
+	DWORD polyFlags;
+	DWORD serial; /**< D3D::getStateSerial() right after setting them up */
+	D3D::TextureMetaData *diffuse;
+} polyState;
+static bool lineStateSet; /** Whether the untextured state for editor lines and points was set up, at D3D::getStateSerial() lineStateSerial */
+static DWORD lineStateSerial;
+static int lineBenchLines; /** Lines to draw in the next frame's benchmark scene, see the LineBench command */
+static int fanBenchFans; /** Fans to buffer in the next frame, see the FanBench command */
+static int tileBenchTiles; /** Tiles to buffer in the next frame, see the TileBench command */
 /** See SetSceneNode() */
 const float Z_NEAR = 7.0f;
+/** Distance from which the shader has faded the detail texture out entirely; see the detail pass in unreal.fx */
+const float DETAIL_FADE_DISTANCE = 380.0f;
 
 /**
 Prints text to the game's log and the standard output if in debug mode.
@@ -80,6 +103,81 @@ int UD3D12RenderDevice::getOption(TCHAR* name,int defaultVal, bool isBool)
 	return out;
 }
 
+/**
+Write per texture statistics to a file, worst offenders first.
+\param Cmd Rest of the TexStats command: SORT=TIME|UPLOAD|COMMITS|BINDS|BYTES (default TIME) and TOP=n (default all).
+\param json Write JSON instead of CSV.
+\param Ar Logs where the file was written.
+*/
+void UD3D12RenderDevice::writeTextureStats(const TCHAR* Cmd,bool json,FOutputDevice& Ar)
+{
+	std::vector<D3D::TextureStats> stats;
+	D3D::getTextureStats(stats);
+
+	TCHAR sortBy[16] = L"TIME";
+	Parse(Cmd,L"SORT=",sortBy,16);
+	INT top = stats.size();
+	Parse(Cmd,L"TOP=",top);
+	top = Clamp<INT>(top,0,stats.size());
+
+	//Sort descending on the chosen cost
+	std::vector<std::pair<double,unsigned int>> order;
+	for(unsigned int i=0;i<stats.size();i++)
+	{
+		order.push_back(std::make_pair(textureCost(stats[i],sortBy),i));
+	}
+	std::sort(order.rbegin(),order.rend());
+
+	const char *fileName = json ? "D3D12TexStats.json" : "D3D12TexStats.csv";
+	FILE *f;
+	if(fopen_s(&f,fileName,"w")!=0)
+	{
+		Ar.Log(L"Could not open texture statistics file.");
+		return;
+	}
+	if(json)
+		fprintf(f,"[\n");
+	else
+		fprintf(f,"id,format,width,height,mips,bytes,convert_ms,creations,uploads,upload_bytes,binds,max_frame_binds,commits\n");
+	for(int i=0;i<top;i++)
+	{
+		const D3D::TextureStats &t = stats[order[i].second];
+		if(json)
+		{
+			fprintf(f,"\t{\"id\":\"%016I64x\",\"format\":\"%s\",\"width\":%u,\"height\":%u,\"mips\":%u,\"bytes\":%u,\"convert_ms\":%.3f,\"creations\":%u,\"uploads\":%u,\"upload_bytes\":%I64u,\"binds\":%u,\"max_frame_binds\":%u,\"commits\":%u}%s\n",
+				t.id,t.format,t.width,t.height,t.mips,t.bytes,t.convertTime,t.creations,t.uploads,t.uploadBytes,t.binds,t.maxFrameBinds,t.commits,i<top-1?",":"");
+		}
+		else
+		{
+			fprintf(f,"%016I64x,%s,%u,%u,%u,%u,%.3f,%u,%u,%I64u,%u,%u,%u\n",
+				t.id,t.format,t.width,t.height,t.mips,t.bytes,t.convertTime,t.creations,t.uploads,t.uploadBytes,t.binds,t.maxFrameBinds,t.commits);
+		}
+	}
+	if(json)
+		fprintf(f,"]\n");
+	fclose(f);
+
+	TCHAR buf[128];
+	swprintf_s(buf,128,L"Wrote statistics for %d of %d textures to %S.",top,(int)stats.size(),fileName);
+	Ar.Log(buf);
+}
+
+/**
+\return A texture's cost as chosen for sorting the statistics.
+*/
+double UD3D12RenderDevice::textureCost(const D3D::TextureStats &stats,const TCHAR* sortBy)
+{
+	if(!wcscmp(sortBy,L"UPLOAD"))
+		return (double)stats.uploadBytes;
+	if(!wcscmp(sortBy,L"COMMITS"))
+		return stats.commits;
+	if(!wcscmp(sortBy,L"BINDS"))
+		return stats.binds;
+	if(!wcscmp(sortBy,L"BYTES"))
+		return stats.bytes;
+	return stats.convertTime;
+}
+
 /**
 Constructor called by the game when the renderer is first created.
 \note Required to compile for Unreal Tournament. 
@@ -89,6 +187,7 @@ void UD3D12RenderDevice::StaticConstructor()
 {
 	//Make the property appear in the preferences window; this will automatically pick up the current value and write back changes.
 	new(GetClass(), L"Precache", RF_Public) UBoolProperty(CPP_PROPERTY(options.precache), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"WorkerThreads", RF_Public) UIntProperty(CPP_PROPERTY(options.workerThreads), TEXT("Options"), CPF_Config);
 
 	new(GetClass(), L"Antialiasing", RF_Public) UIntProperty(CPP_PROPERTY(D3DOptions.samples), TEXT("Options"), CPF_Config);
 	new(GetClass(), L"Anisotropy", RF_Public) UIntProperty(CPP_PROPERTY(D3DOptions.aniso), TEXT("Options"), CPF_Config);
@@ -97,6 +196,23 @@ void UD3D12RenderDevice::StaticConstructor()
 	new(GetClass(), L"ParallaxOcclusionMapping", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.POM), TEXT("Options"), CPF_Config);
 	new(GetClass(), L"LODBias", RF_Public) UIntProperty(CPP_PROPERTY(D3DOptions.LODBias), TEXT("Options"), CPF_Config);
 	new(GetClass(), L"AlphaToCoverage", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.alphaToCoverage), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"LightmapAtlas", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.lightmapAtlas), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"CompactLightmaps", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.compactLightmaps), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"SingleChannelTextures", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.singleChannelTextures), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"GenerateMips", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.generateMips), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"MipStreamBudget", RF_Public) UIntProperty(CPP_PROPERTY(D3DOptions.mipStreamBudget), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"MipStreamTime", RF_Public) UIntProperty(CPP_PROPERTY(D3DOptions.mipStreamTime), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"FramesInFlight", RF_Public) UIntProperty(CPP_PROPERTY(D3DOptions.framesInFlight), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"IndexTemplates", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.indexTemplates), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"GeometryCacheSize", RF_Public) UIntProperty(CPP_PROPERTY(D3DOptions.geometryCacheSize), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"SortDraws", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.sortDraws), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"SortTranslucentDraws", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.sortTranslucentDraws), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"ShortIndices", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.shortIndices), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"InstancedTiles", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.instancedTiles), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"StageVertices", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.stageVertices), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"ShareVertices", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.shareVertices), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"ParallelVertices", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.parallelVertices), TEXT("Options"), CPF_Config);
+	new(GetClass(), L"CullDetail", RF_Public) UBoolProperty(CPP_PROPERTY(D3DOptions.cullDetail), TEXT("Options"), CPF_Config);
 
 	//Create a console to print debug stuff to.
 	#ifdef _DEBUG
@@ -162,6 +278,9 @@ UBOOL UD3D12RenderDevice::Init(UViewport *InViewport,INT NewX, INT NewY, INT New
 
 	//Get/set config options.
 	options.precache = getOption(L"Precache",0,true);
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+	options.workerThreads = getOption(L"WorkerThreads",min((int)sysInfo.dwNumberOfProcessors-1,4),false);
 	D3DOptions.samples = getOption(L"Antialiasing",4,false);
 	D3DOptions.aniso = getOption(L"Anisotropy",8,false);
 	D3DOptions.VSync = getOption(L"VSync",1,true);	
@@ -172,14 +291,36 @@ UBOOL UD3D12RenderDevice::Init(UViewport *InViewport,INT NewX, INT NewY, INT New
 	atocDefault=1;
 	#endif
 	D3DOptions.alphaToCoverage = getOption(L"AlphaToCoverage",atocDefault,true);
+	D3DOptions.lightmapAtlas = getOption(L"LightmapAtlas",1,true);
+	D3DOptions.compactLightmaps = getOption(L"CompactLightmaps",0,true);
+	D3DOptions.singleChannelTextures = getOption(L"SingleChannelTextures",1,true);
+	D3DOptions.generateMips = getOption(L"GenerateMips",1,true);
+	D3DOptions.mipStreamBudget = getOption(L"MipStreamBudget",2048,false);
+	D3DOptions.mipStreamTime = getOption(L"MipStreamTime",2000,false);
+	D3DOptions.framesInFlight = getOption(L"FramesInFlight",3,false);
+	D3DOptions.indexTemplates = getOption(L"IndexTemplates",1,true);
+	D3DOptions.geometryCacheSize = getOption(L"GeometryCacheSize",32,false);
+	D3DOptions.sortDraws = getOption(L"SortDraws",1,true);
+	D3DOptions.sortTranslucentDraws = getOption(L"SortTranslucentDraws",1,true);
+	D3DOptions.shortIndices = getOption(L"ShortIndices",1,true);
+	D3DOptions.instancedTiles = getOption(L"InstancedTiles",1,true);
+	D3DOptions.stageVertices = getOption(L"StageVertices",1,true);
+	D3DOptions.shareVertices = getOption(L"ShareVertices",1,true);
+	D3DOptions.parallelVertices = getOption(L"ParallelVertices",1,true);
+	D3DOptions.cullDetail = getOption(L"CullDetail",1,true);
 	GConfig->GetFloat(L"WinDrv.WindowsClient",L"Brightness",D3DOptions.brightness);
 	D3DOptions.zNear = Z_NEAR;
 	 
 	//Set parent options
 	URenderDevice::Viewport = InViewport;
 
-	//Do some nice compatibility fixing: set processor affinity to single-cpu
-	SetProcessAffinityMask(GetCurrentProcess(),0x1);
+	//Do some nice compatibility fixing: set processor affinity to single-cpu.
+	//With worker threads, only the game thread is pinned so the workers can use the other CPUs.
+	if(options.workerThreads>0)
+		SetThreadAffinityMask(GetCurrentThread(),0x1);
+	else
+		SetProcessAffinityMask(GetCurrentProcess(),0x1);
+	Workers::init(options.workerThreads);
 
 	//Initialize Direct3D
 	if(!D3D::init((HWND) InViewport->GetWindow(),D3DOptions))
@@ -247,6 +388,7 @@ void UD3D12RenderDevice::Exit()
 {
 	UD3D12RenderDevice::debugs("Direct3D 12 renderer exiting.");
 	D3D::uninit();
+	Workers::uninit();
 	//FreeConsole();
 }
 
@@ -331,6 +473,22 @@ Finish rendering.
 */
 void UD3D12RenderDevice::Unlock(UBOOL Blit)
 {
+	if(lineBenchLines>0)
+	{
+		drawLineBench(lineBenchLines);
+		lineBenchLines = 0;
+	}
+	if(fanBenchFans>0)
+	{
+		drawFanBench(fanBenchFans);
+		fanBenchFans = 0;
+	}
+	if(tileBenchTiles>0)
+	{
+		drawTileBench(tileBenchTiles);
+		tileBenchTiles = 0;
+	}
+	VertexGen::runQueue(Workers::getNumThreads()>0); //Map surface vertices queued by DrawComplexSurface()
 	D3D::render();
 
 	if(Blit)
@@ -339,6 +497,30 @@ void UD3D12RenderDevice::Unlock(UBOOL Blit)
 	}
 }
 
+/**
+\return A lower bound for the distance from the viewer to any point of a facet: the distance to the bounding box of its polygons' points.
+The nearest point can be well inside a polygon, e.g. of a floor below the viewer, so the nearest vertex won't do.
+\param first The facet's first valid polygon.
+*/
+static float facetDistance(const FSavedPoly *first)
+{
+	//Points are in view space, so the viewer is at the origin
+	FVector lo = first->Pts[0]->Point;
+	FVector hi = lo;
+	for(const FSavedPoly* Poly=first; Poly; Poly=Poly->Next )
+	{
+		for(INT i=0; i<Poly->NumPts; i++)
+		{
+			const FVector &p = Poly->Pts[i]->Point;
+			lo.X = Min(lo.X,p.X); hi.X = Max(hi.X,p.X);
+			lo.Y = Min(lo.Y,p.Y); hi.Y = Max(hi.Y,p.Y);
+			lo.Z = Min(lo.Z,p.Z); hi.Z = Max(hi.Z,p.Z);
+		}
+	}
+	FVector d(Max(Max(lo.X,-hi.X),0.0f),Max(Max(lo.Y,-hi.Y),0.0f),Max(Max(lo.Z,-hi.Z),0.0f));
+	return d.Size();
+}
+
 /**
 Complex surfaces are used for map geometry. They consists of facets which in turn consist of polys (triangle fans).
 \param Frame The scene. See SetSceneNode().
@@ -354,13 +536,24 @@ Complex surfaces are used for map geometry. They consists of facets which in tur
 	- Polys is a linked list of triangle fan arrays; each element is similar to the models used in DrawGouraudPolygon().
 	
 \note DetailTexture and FogMap are mutually exclusive; D3D10 renderer just uses seperate binds for them anyway.
-\note D3D10 renderer handles DetailTexture range in shader.
+\note D3D10 renderer handles DetailTexture range in shader. With the CullDetail option, facets entirely out of that range aren't given it at all.
 \note Check if submitted polygons are valid (3 or more points).
 */
 void UD3D12RenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Surface, FSurfaceFacet& Facet )
 {	
-	D3D::setProjectionMode(D3D::PROJ_NORMAL);
+	FSavedPoly *first = Facet.Polys;
+	while(first && first->NumPts<3)
+		first = first->Next;
+	if(!first)
+		return;
+
+	//The detail texture fades out with distance in the shader; facets entirely beyond that don't need it bound or its coordinates generated
+	FTextureInfo *detailTexture = Surface.DetailTexture;
+	if(detailTexture && D3D::getOptions().cullDetail && facetDistance(first)>=DETAIL_FADE_DISTANCE)
+		detailTexture = NULL;
 
+	D3D::setProjectionMode(D3D::PROJ_NORMAL);
+	D3D::setVertexFormat(D3D::VF_WORLD);
 
 	D3D::setFlags(Surface.PolyFlags,0);
 
@@ -380,10 +573,10 @@ void UD3D12RenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Sur
 	{
 		D3D::setTexture(D3D::PASS_LIGHT,NULL);
 	}
-	if(Surface.DetailTexture)
+	if(detailTexture)
 	{
-		PrecacheTexture(*Surface.DetailTexture,0);
-		if(!(detail = D3D::setTexture(D3D::PASS_DETAIL,Surface.DetailTexture->CacheID)))
+		PrecacheTexture(*detailTexture,0);
+		if(!(detail = D3D::setTexture(D3D::PASS_DETAIL,detailTexture->CacheID)))
 			return;
 	}
 	else
@@ -411,63 +604,276 @@ void UD3D12RenderDevice::DrawComplexSurface(FSceneNode* Frame, FSurfaceInfo& Sur
 		macro = D3D::setTexture(D3D::PASS_MACRO,NULL);	
 	}
 
-	//Code from OpenGL renderer to calculate texture coordinates
-	FLOAT UDot = Facet.MapCoords.XAxis | Facet.MapCoords.Origin;
-	FLOAT VDot = Facet.MapCoords.YAxis | Facet.MapCoords.Origin;
-	
-	//Draw each polygon
-	for(FSavedPoly* Poly=Facet.Polys; Poly; Poly=Poly->Next )
+	//Opaque surfaces are drawn sorted by state, except where they meet others at equal depth; the plane tells. Newell's method, so it
+	//doesn't matter if the first points happen to be in a line.
+	FVector normal(0,0,0);
+	for(INT i=0; i<first->NumPts; i++)
 	{
-		if(Poly->NumPts < 3) //Skip invalid polygons
-			continue;
-
-		D3D::indexTriangleFan(Poly->NumPts); //Reserve space and generate indices for fan		
-		for( INT i=0; i<Poly->NumPts; i++ )
+		const FVector &a = first->Pts[i]->Point;
+		const FVector &b = first->Pts[(i+1)%first->NumPts]->Point;
+		normal.X += (a.Y-b.Y)*(a.Z+b.Z);
+		normal.Y += (a.Z-b.Z)*(a.X+b.X);
+		normal.Z += (a.X-b.X)*(a.Y+b.Y);
+	}
+	normal = normal.SafeNormal().TransformVectorBy(Frame->Uncoords);
+	FLOAT distance = normal | first->Pts[0]->Point.TransformPointBy(Frame->Uncoords);
+	D3D::setSurfacePlane(*(D3D::Vec3*)&normal.X,distance);
+
+	//Vertices are sent in world space, so unless the texture coordinates change every frame the facet can come from the geometry cache.
+	//It's identified by the world positions of its polygons' points and everything that goes into the texture coordinates.
+	//The engine's point structures are reused from frame to frame, so their addresses say nothing.
+	bool cacheable = !(Surface.PolyFlags & (PF_AutoUPan|PF_AutoVPan));
+	FTextureInfo *passes[D3D::DUMMY_NUM_PASSES] = {Surface.Texture,Surface.LightMap,detailTexture,Surface.FogMap,Surface.MacroTexture};
+	D3D::TextureMetaData *metadata[D3D::DUMMY_NUM_PASSES] = {diffuse,lightMap,detail,fogMap,macro};
+	DWORD64 key = 0;
+	static std::vector<D3D::Vec3> check;
+	if(cacheable)
+	{
+		check.clear();
+		key = Misc::hashBytes(Misc::HASH_INIT,&Surface.PolyFlags,sizeof(Surface.PolyFlags));
+		for(int i=0;i<D3D::DUMMY_NUM_PASSES;i++)
 		{
-			D3D::Vertex *v = D3D::getVertex();
-			
-			//Code from OpenGL renderer to calculate texture coordinates
-			FLOAT U = Facet.MapCoords.XAxis | Poly->Pts[i]->Point;
-			FLOAT V = Facet.MapCoords.YAxis | Poly->Pts[i]->Point;
-			FLOAT UCoord = U-UDot;
-			FLOAT VCoord = V-VDot;
-
-			//Diffuse texture coordinates
-			v->TexCoord[0].x = (UCoord-Surface.Texture->Pan.X)*diffuse->multU;
-			v->TexCoord[0].y = (VCoord-Surface.Texture->Pan.Y)*diffuse->multV;
+			if(!passes[i])
+				continue;
+			key = Misc::hashBytes(key,&passes[i]->CacheID,sizeof(passes[i]->CacheID));
+			key = Misc::hashBytes(key,&passes[i]->Pan,sizeof(passes[i]->Pan));
+			key = Misc::hashBytes(key,&passes[i]->UScale,sizeof(passes[i]->UScale));
+			key = Misc::hashBytes(key,&passes[i]->VScale,sizeof(passes[i]->VScale));
+			key = Misc::hashBytes(key,&metadata[i]->multU,4*sizeof(FLOAT)); //multU, multV, offsetU, offsetV
+		}
 
-			if(Surface.LightMap)
+		//Texture alignment: the map axes and where the origin falls on them, in world space as the view space ones move with the view.
+		//Rounded like the positions; to 1/4096 of an axis and 1/8 of a texel.
+		FVector xAxis = Facet.MapCoords.XAxis.TransformVectorBy(Frame->Uncoords);
+		FVector yAxis = Facet.MapCoords.YAxis.TransformVectorBy(Frame->Uncoords);
+		FVector origin = Facet.MapCoords.Origin.TransformPointBy(Frame->Uncoords);
+		INT alignment[8] = {appRound(xAxis.X*4096.0f),appRound(xAxis.Y*4096.0f),appRound(xAxis.Z*4096.0f),
+			appRound(yAxis.X*4096.0f),appRound(yAxis.Y*4096.0f),appRound(yAxis.Z*4096.0f),
+			appRound((xAxis|origin)*8.0f),appRound((yAxis|origin)*8.0f)};
+		key = Misc::hashBytes(key,alignment,sizeof(alignment));
+
+		for(FSavedPoly* Poly=first; Poly; Poly=Poly->Next )
+		{
+			if(Poly->NumPts < 3)
+				continue;
+			key = Misc::hashBytes(key,&Poly->NumPts,sizeof(Poly->NumPts));
+			for(INT i=0; i<Poly->NumPts; i++)
 			{
-				//Lightmaps require pan correction of -.5
-				v->TexCoord[1].x = (UCoord-(Surface.LightMap->Pan.X-0.5f*Surface.LightMap->UScale) )*lightMap->multU; 
-				v->TexCoord[1].y = (VCoord-(Surface.LightMap->Pan.Y-0.5f*Surface.LightMap->VScale) )*lightMap->multV;
+				//The view to world transform isn't exact, so the key uses rounded positions; the cache checks the exact ones
+				FVector world = Poly->Pts[i]->Point.TransformPointBy(Frame->Uncoords);
+				check.push_back(*(D3D::Vec3*)&world.X);
+				INT rounded[3] = {appRound(world.X),appRound(world.Y),appRound(world.Z)};
+				key = Misc::hashBytes(key,rounded,sizeof(rounded));
 			}
-			if(Surface.DetailTexture)
+		}
+		if(check.empty())
+			cacheable = false;
+		else if(D3D::drawCachedGeometry(key,&check[0],check.size()))
+			return;
+	}
+
+	//Code from OpenGL renderer to calculate texture coordinates: (MapCoords.XAxis|Point)-UDot, panned and scaled per pass.
+	//Vertices only get (MapCoords.XAxis|Point)-UDot; the pan and scale of each pass go into the surface table, applied by the vertex shader.
+	//Along with the position (the engine gives it in view space) these are folded into one affine transform for the facet; see VertexGen.
+	//No color as lighting comes from light maps (or is fullbright if none present); the world vertex shader sets it
+	VertexGen::Surface surface;
+	surface.mapXAxis = *(D3D::Vec3*)&Facet.MapCoords.XAxis.X;
+	surface.mapYAxis = *(D3D::Vec3*)&Facet.MapCoords.YAxis.X;
+	surface.uDot = Facet.MapCoords.XAxis | Facet.MapCoords.Origin;
+	surface.vDot = Facet.MapCoords.YAxis | Facet.MapCoords.Origin;
+	surface.viewOrigin = *(D3D::Vec3*)&Frame->Uncoords.Origin.X;
+	surface.viewAxes[0] = *(D3D::Vec3*)&Frame->Uncoords.XAxis.X;
+	surface.viewAxes[1] = *(D3D::Vec3*)&Frame->Uncoords.YAxis.X;
+	surface.viewAxes[2] = *(D3D::Vec3*)&Frame->Uncoords.ZAxis.X;
+	surface.flags = Surface.PolyFlags;
+	for(int i=0;i<D3D::DUMMY_NUM_PASSES;i++)
+	{
+		VertexGen::Pass &p = surface.passes[i];
+		p.enabled = passes[i]!=NULL;
+		if(!p.enabled)
+			continue;
+		p.panU = passes[i]->Pan.X;
+		p.panV = passes[i]->Pan.Y;
+		p.multU = metadata[i]->multU;
+		p.multV = metadata[i]->multV;
+		p.offsetU = p.offsetV = 0;
+		if(i==D3D::PASS_LIGHT || i==D3D::PASS_FOG)
+		{
+			//Light and fog maps require pan correction of -.5; offset places coordinates in atlas page
+			p.panU -= 0.5f*passes[i]->UScale;
+			p.panV -= 0.5f*passes[i]->VScale;
+			p.offsetU = metadata[i]->offsetU;
+			p.offsetV = metadata[i]->offsetV;
+		}
+	}
+	VertexGen::WorldTransform transform;
+	D3D::SurfacePasses surfacePasses;
+	VertexGen::setupWorld(surface,transform,surfacePasses);
+	D3D::setSurface(surfacePasses); //May move the batch on, so before capturing starts
+	if(cacheable)
+		D3D::beginCachedGeometry(key,&check[0],check.size());
+	bool queue = D3D::getOptions().parallelVertices!=0; //Only reserve room and copy the points; see VertexGen::runQueue()
+	if(queue)
+		VertexGen::queueSurface(transform);
+	
+	//Draw each polygon
+	if(D3D::getOptions().shareVertices)
+	{
+		//The polygons of a facet have most of their corners in common, as pointers to the same engine points.
+		//Each point is buffered once; the polygons index the vertices they share.
+		static std::vector<UINT> fanVertices;
+		static std::vector<const D3D::Vec3*> newPoints;
+		DWORD epoch = 0;
+		bool started = false;
+		for(FSavedPoly* Poly=first; Poly; Poly=Poly->Next )
+		{
+			if(Poly->NumPts < 3) //Skip invalid polygons
+				continue;
+
+			DWORD fanEpoch;
+			if(!D3D::beginSharedFan(Poly->NumPts,fanEpoch)) //Reserve space; fails if the upload ring couldn't grow, drop the rest then
+				break;
+			if(!started || fanEpoch!=epoch) //Batch went on in a new chunk; vertices from before can't be indexed
 			{
-				v->TexCoord[2].x = (UCoord-Surface.DetailTexture->Pan.X)*detail->multU; 
-				v->TexCoord[2].y = (VCoord-Surface.DetailTexture->Pan.Y)*detail->multV;
+				surfaceVertices.clear();
+				epoch = fanEpoch;
+				started = true;
+				VertexGen::setSurfaceOffset(transform,D3D::getSurfaceOffset());
 			}
-			if(Surface.FogMap)
+			fanVertices.resize(Poly->NumPts);
+			newPoints.resize(Poly->NumPts);
+			UINT nextVertex = D3D::vertexIndex();
+			int numNew = 0;
+			for(INT i=0; i<Poly->NumPts; i++)
 			{
-				//Fogmaps require pan correction of -.5
-				v->TexCoord[3].x = (UCoord-(Surface.FogMap->Pan.X-0.5f*Surface.FogMap->UScale) )*fogMap->multU; 
-				v->TexCoord[3].y = (VCoord-(Surface.FogMap->Pan.Y-0.5f*Surface.FogMap->VScale) )*fogMap->multV;			
+				if(surfaceVertices.find(Poly->Pts[i],0,fanVertices[i]))
+					continue;
+				fanVertices[i] = nextVertex+numNew;
+				surfaceVertices.insert(Poly->Pts[i],0,fanVertices[i]);
+				newPoints[numNew++] = (D3D::Vec3*)&Poly->Pts[i]->Point.X;
 			}
-			if(Surface.MacroTexture)
+			if(numNew>0 && queue)
+				VertexGen::queueWorld(&newPoints[0],numNew,D3D::getSurfaceOffset(),D3D::reserveWorldVertices(numNew));
+			else if(numNew>0)
+				VertexGen::generateWorld(transform,&newPoints[0],numNew,D3D::getWorldVertices(numNew));
+			D3D::indexSharedFan(&fanVertices[0],Poly->NumPts);
+		}
+		if(cacheable)
+			D3D::endCachedGeometry();
+		return;
+	}
+
+	const int GATHER_POINTS = 16;
+	const D3D::Vec3 *points[GATHER_POINTS];
+	for(FSavedPoly* Poly=first; Poly; Poly=Poly->Next )
+	{
+		if(Poly->NumPts < 3) //Skip invalid polygons
+			continue;
+
+		if(!D3D::indexTriangleFan(Poly->NumPts)) //Reserve space and generate indices for fan; fails if the upload ring couldn't grow, drop the rest then
+			break;
+		VertexGen::setSurfaceOffset(transform,D3D::getSurfaceOffset());
+		D3D::WorldVertex *v = queue ? D3D::reserveWorldVertices(Poly->NumPts) : D3D::getWorldVertices(Poly->NumPts);
+		for(INT i=0; i<Poly->NumPts; i+=GATHER_POINTS)
+		{
+			int num = min(Poly->NumPts-i,GATHER_POINTS);
+			for(int j=0;j<num;j++)
 			{
-				v->TexCoord[4].x = (UCoord-Surface.MacroTexture->Pan.X)*macro->multU; 
-				v->TexCoord[4].y = (VCoord-Surface.MacroTexture->Pan.Y)*macro->multV;			
+				points[j] = (D3D::Vec3*)&Poly->Pts[i+j]->Point.X;
 			}
-			
-			static D3D::Vec4 color = {1.0f,1.0f,1.0f,1.0f};
-			v->Color = color; //No color as lighting comes from light maps (or is fullbright if none present)	
-			v->flags = Surface.PolyFlags;
-			v->Pos = *(D3D::Vec3*)&Poly->Pts[i]->Point.X; //Position
+			if(queue)
+				VertexGen::queueWorld(points,num,D3D::getSurfaceOffset(),v+i);
+			else
+				VertexGen::generateWorld(transform,points,num,v+i);
+		}
+	}
+
+	if(cacheable)
+		D3D::endCachedGeometry();
+}
+
+/**
+Set up the texture and flags for a mesh or tile: precache the texture, bind it as the only one and set the flags.
+Meshes and runs of tiles come as many calls with the same texture and flags; if nothing changed the state since the previous call, it's all
+still set up and the texture needn't be looked up again.
+\param Info The texture.
+\param PolyFlags Flags, see polyflags.h.
+\return Diffuse texture metadata; NULL if the texture couldn't be set.
+*/
+D3D::TextureMetaData *UD3D12RenderDevice::setPolyState(FTextureInfo& Info, DWORD PolyFlags)
+{
+	if(Info.CacheID==polyState.cacheID && PolyFlags==polyState.polyFlags && !Info.bRealtimeChanged && polyState.diffuse && D3D::getStateSerial()==polyState.serial)
+		return polyState.diffuse;
+
+	PrecacheTexture(Info,PolyFlags);
+	D3D::TextureMetaData *diffuse = NULL;
+	if(!(diffuse=D3D::setTexture(D3D::PASS_DIFFUSE,Info.CacheID)))
+	{
+		polyState.diffuse = NULL;
+		return NULL;
+	}
+	D3D::setTexture(D3D::PASS_LIGHT,NULL);
+	D3D::setTexture(D3D::PASS_DETAIL,NULL);
+	D3D::setTexture(D3D::PASS_FOG,NULL);
+	D3D::setTexture(D3D::PASS_MACRO,NULL);
+	D3D::setFlags(PolyFlags,0);
+
+	polyState.cacheID = Info.CacheID;
+	polyState.polyFlags = PolyFlags;
+	polyState.serial = D3D::getStateSerial();
+	polyState.diffuse = diffuse;
+	return diffuse;
+}
 
+/**
+Set the projection mode for a mesh. Deus Ex clears the depth before drawing weapons; Unreal and UT don't.
+Detect them for those games and clear depth and draw shifted forwards (resulting in higher possible zNear).
+\param first A point of the mesh.
+*/
+static void setMeshProjection(const FTransTexture &first)
+{
+	#if(UNREALTOURNAMENT || UNREALGOLD)	
+	if(!drawingWeapon)
+	{
+		if(first.Point.Z<12)
+		{							
+			D3D::clearDepth();
+			drawingWeapon=true;
 		}
-	
 	}
+	#endif
+
+	if(!drawingWeapon)
+		D3D::setProjectionMode(D3D::PROJ_NORMAL);
+	else
+		D3D::setProjectionMode(D3D::PROJ_COMPENSATE_Z_NEAR); //Have shader compensate w for moving
+}
+
+/**
+Fill in a mesh vertex from an engine point.
+\param v Vertex to fill in.
+\param p Point.
+\param Info The mesh texture.
+\param diffuse Its metadata.
+\param PolyFlags Flags, see polyflags.h.
+*/
+static inline void fillMeshVertex(D3D::MeshVertex *v, const FTransTexture &p, const FTextureInfo &Info, const D3D::TextureMetaData &diffuse, DWORD PolyFlags)
+{
+	v->Pos = *(D3D::Vec3*)&p.Point.X;
+	v->TexCoord.x = p.U*diffuse.multU;
+	v->TexCoord.y = p.V*diffuse.multV;
+	v->Fog = D3D::packColor(&p.Fog.X);
+	v->flags = PolyFlags;
 
+	#ifdef RUNE
+	if(PolyFlags & PF_AlphaBlend)
+	{
+		FLOAT color[4] = {p.Light.X,p.Light.Y,p.Light.Z,Info.Texture->Alpha};
+		v->Color = D3D::packColor(color);
+	}
+	else
+	#endif		
+	v->Color = D3D::packColor(&p.Light.X);
 }
 
 /**
@@ -489,56 +895,91 @@ void UD3D12RenderDevice::DrawGouraudPolygon( FSceneNode* Frame, FTextureInfo& In
 	if(NumPts<3) //Invalid triangle
 		return;
 
-	//Deus Ex clears the depth before drawing weapons; Unreal and UT don't. 
-	//Detect them for those games and clear depth and draw shifted forwards (resulting in higher possible zNear).	
-	#if(UNREALTOURNAMENT || UNREALGOLD)	
-	if(!drawingWeapon)
-	{
-		if(Pts[0]->Point.Z<12)
-		{							
-			D3D::clearDepth();
-			drawingWeapon=true;
-		}
-	}
-	#endif
-
-	if(!drawingWeapon)
-		D3D::setProjectionMode(D3D::PROJ_NORMAL);
-	else
-		D3D::setProjectionMode(D3D::PROJ_COMPENSATE_Z_NEAR); //Have shader compensate w for moving
+	setMeshProjection(*Pts[0]);
+	D3D::setVertexFormat(D3D::VF_MESH);
 
 	//Set texture
-	PrecacheTexture(Info,PolyFlags);
-	D3D::TextureMetaData *diffuse = NULL;
-	if(!(diffuse=D3D::setTexture(D3D::PASS_DIFFUSE,Info.CacheID)))
+	D3D::TextureMetaData *diffuse = setPolyState(Info,PolyFlags);
+	if(!diffuse)
 		return;
-	D3D::setTexture(D3D::PASS_LIGHT,NULL);
-	D3D::setTexture(D3D::PASS_DETAIL,NULL);
-	D3D::setTexture(D3D::PASS_FOG,NULL);
-	D3D::setTexture(D3D::PASS_MACRO,NULL);
-	D3D::setFlags(PolyFlags,0);
 
 	//Buffer triangle fans
-	D3D::indexTriangleFan(NumPts); //Reserve space and generate indices for fan
+	bool share = D3D::getOptions().shareVertices!=0;
+	UINT fanVertices[32];
+	if(share && NumPts<=ARRAY_COUNT(fanVertices))
+	{
+		DWORD epoch;
+		if(!D3D::beginSharedFan(NumPts,epoch)) //Reserve space; fails if the upload ring couldn't grow
+			return;
+		if(epoch!=meshVerticesEpoch)
+		{
+			meshVertices.clear();
+			meshVerticesEpoch = epoch;
+		}
+	}
+	else
+	{
+		share = false;
+		if(!D3D::indexTriangleFan(NumPts)) //Reserve space and generate indices for fan; fails if the upload ring couldn't grow
+			return;
+	}
 	for(INT i=0; i<NumPts; i++) //Set fan verts
 	{
-		D3D::Vertex *v = D3D::getVertex();				
-		v->Pos = *(D3D::Vec3*)&Pts[i]->Point.X;
-		v->Normal = *(D3D::Vec3*)&Pts[i]->Normal.X;
-		v->TexCoord[0].x = (Pts[i]->U)*diffuse->multU;
-		v->TexCoord[0].y = (Pts[i]->V)*diffuse->multV;
-		v->Color = *(D3D::Vec4*)&Pts[i]->Light.X;
-		v->Fog = *(D3D::Vec4*)&Pts[i]->Fog.X;
-		v->flags = PolyFlags;
-
-		#ifdef RUNE
-		if(PolyFlags & PF_AlphaBlend)
+		//Mesh fans come one triangle at a time, pointing into an array of the mesh's points; consecutive ones share corners.
+		//The array is reused for the next mesh, so a vertex is only reused if its contents are the same.
+		D3D::MeshVertex shared;
+		D3D::MeshVertex *v = share ? &shared : D3D::getMeshVertex();
+		fillMeshVertex(v,*Pts[i],Info,*diffuse,PolyFlags);
+
+		if(share)
 		{
-			v->Color.w = (Info.Texture->Alpha);
+			UINT64 check = Misc::hashDwords(Misc::HASH_INIT,(const unsigned int*)v,sizeof(D3D::MeshVertex)/sizeof(unsigned int));
+			if(!meshVertices.find(Pts[i],check,fanVertices[i]))
+			{
+				fanVertices[i] = D3D::vertexIndex();
+				*D3D::getMeshVertex() = shared;
+				meshVertices.insert(Pts[i],check,fanVertices[i]);
+			}
 		}
-		#endif		
+	}
+	if(share)
+		D3D::indexSharedFan(fanVertices,NumPts);
+}
+
+#if POLY_LIST_INTERFACE
+/**
+A whole mesh, or a large part of it, in one call; engines with this interface send meshes like this instead of one DrawGouraudPolygon() per triangle.
+State is set up once for the list and the triangles' vertices are buffered back to back.
+\param Frame The scene. See SetSceneNode().
+\param Info The texture for the model.
+\param Pts Triangles, three points each.
+\param NumPts Number of points; three times the number of triangles.
+\param PolyFlags Contains the correct flags for this model. See polyflags.h
+\param Span Probably for software renderers.
+\note The points are copies rather than pointers to shared ones, so there's nothing to share vertices by; every triangle gets its own.
+*/
+void UD3D12RenderDevice::DrawGouraudPolyList( FSceneNode* Frame, FTextureInfo& Info, FTransTexture* Pts, INT NumPts, DWORD PolyFlags, FSpanBuffer* Span )
+{
+	if(NumPts<3) //No triangles
+		return;
+
+	setMeshProjection(Pts[0]);
+	D3D::setVertexFormat(D3D::VF_MESH);
+
+	D3D::TextureMetaData *diffuse = setPolyState(Info,PolyFlags);
+	if(!diffuse)
+		return;
+
+	for(INT i=0; i+3<=NumPts; i+=3)
+	{
+		if(!D3D::indexTriangleFan(3)) //Runs of triangles share index templates
+			return;
+		fillMeshVertex(D3D::getMeshVertex(),Pts[i],Info,*diffuse,PolyFlags);
+		fillMeshVertex(D3D::getMeshVertex(),Pts[i+1],Info,*diffuse,PolyFlags);
+		fillMeshVertex(D3D::getMeshVertex(),Pts[i+2],Info,*diffuse,PolyFlags);
 	}
 }
+#endif
 
 /**
 Used for 2D UI elements, coronas, etc. 
@@ -562,25 +1003,61 @@ Used for 2D UI elements, coronas, etc.
 \note Drawn by converting pixel coordinates to -1,1 ranges in vertex shader and drawing quads with X/Y perspective transform disabled.
 The Z coordinate however is transformed and divided by W; then W is set to 1 in the shader to get correct depth and yet preserve X and Y.
 Other renderers take the opposite approach and multiply X by RProjZ*Z and Y by RProjZ*Z*aspect so they are preserved and then transform everything.
+\note With the InstancedTiles option a tile is a single D3D::TileInstance instead of 4 vertices and 6 indices; runs of tiles are one instanced draw.
 */
 void UD3D12RenderDevice::DrawTile( FSceneNode* Frame, FTextureInfo& Info, FLOAT X, FLOAT Y, FLOAT XL, FLOAT YL, FLOAT U, FLOAT V, FLOAT UL, FLOAT VL, class FSpanBuffer* Span, FLOAT Z, FPlane Color, FPlane Fog, DWORD PolyFlags )
 {
 	D3D::setProjectionMode(D3D::PROJ_Z_ONLY);
+	D3D::setVertexFormat(D3D::getOptions().instancedTiles ? D3D::VF_TILE_INSTANCE : D3D::VF_TILE);
 	SetSceneNode(Frame); //Set scene node fix.
-	PrecacheTexture(Info,PolyFlags);
-	D3D::TextureMetaData *diffuse = NULL;
-	if(!(diffuse=D3D::setTexture(D3D::PASS_DIFFUSE,Info.CacheID)))
-		return;
-	D3D::setTexture(D3D::PASS_LIGHT,NULL);
-	D3D::setTexture(D3D::PASS_DETAIL,NULL);
-	D3D::setTexture(D3D::PASS_FOG,NULL);
-	D3D::setTexture(D3D::PASS_MACRO,NULL);
 	
 	//if(Info.bRealtimeChanged) //DEUS EX: use this  to catch zyme, toxins etc
 	{}
 
-	D3D::setFlags(PolyFlags,0);
-	D3D::indexQuad();
+	D3D::TextureMetaData *diffuse = setPolyState(Info,PolyFlags);
+	if(!diffuse)
+		return;
+
+	#ifdef RUNE
+	if(PolyFlags & PF_AlphaBlend)
+	{
+		Color.W = (Info.Texture->Alpha);
+	}
+	#endif
+
+	bufferTile(*diffuse,X,Y,XL,YL,U,V,UL,VL,Z,Color,Fog,PolyFlags,D3D::getOptions().instancedTiles!=0);
+}
+
+/**
+Buffer a tile whose state is set up; see DrawTile() for the parameters.
+\param diffuse Metadata of the bound diffuse texture, to normalize the texture coordinates with.
+\param instanced Whether to buffer it as a D3D::TileInstance instead of a quad; the vertex format must match.
+*/
+void UD3D12RenderDevice::bufferTile(const D3D::TextureMetaData &diffuse, FLOAT X, FLOAT Y, FLOAT XL, FLOAT YL, FLOAT U, FLOAT V, FLOAT UL, FLOAT VL, FLOAT Z, const FPlane &Color, const FPlane &Fog, DWORD PolyFlags, bool instanced)
+{
+	//One instance per tile, the shader makes the quad
+	if(instanced)
+	{
+		D3D::TileInstance *t = D3D::getTileInstance();
+		if(!t)
+			return;
+		t->Rect.x = X;
+		t->Rect.y = Y;
+		t->Rect.z = X+XL;
+		t->Rect.w = Y+YL;
+		t->TexRect.x = U*diffuse.multU;
+		t->TexRect.y = V*diffuse.multV;
+		t->TexRect.z = (U+UL)*diffuse.multU;
+		t->TexRect.w = (V+VL)*diffuse.multV;
+		t->Z = Z;
+		t->Color = D3D::packColor(&Color.X);
+		t->Fog = D3D::packColor(&Fog.X);
+		t->flags = PolyFlags;
+		return;
+	}
+
+	if(!D3D::indexQuad())
+		return;
 
 	float left = X;
 	float right =X+XL;
@@ -591,18 +1068,12 @@ void UD3D12RenderDevice::DrawTile( FSceneNode* Frame, FTextureInfo& Info, FLOAT
 	float texRight = texLeft+UL;
 	float texTop = V;
 	float texBottom = texTop+VL;
-	texLeft *= diffuse->multU; texRight *= diffuse->multU;
-	texTop *= diffuse->multV; texBottom *= diffuse->multV;
+	texLeft *= diffuse.multU; texRight *= diffuse.multU;
+	texTop *= diffuse.multV; texBottom *= diffuse.multV;
 
-	D3D::Vertex v;	
-	v.Color = *((D3D::Vec4*)&Color.X);
-	#ifdef RUNE
-	if(PolyFlags & PF_AlphaBlend)
-	{
-		v.Color.w = (Info.Texture->Alpha);
-	}
-	#endif
-	v.Fog = *((D3D::Vec4*)&Fog.X);
+	D3D::TileVertex v;	
+	v.Color = D3D::packColor(&Color.X);
+	v.Fog = D3D::packColor(&Fog.X);
 	
 	
 	v.Pos.z = Z;
@@ -612,44 +1083,224 @@ void UD3D12RenderDevice::DrawTile( FSceneNode* Frame, FTextureInfo& Info, FLOAT
 	//Top left
 	v.Pos.x = left;
 	v.Pos.y = top;
-	v.TexCoord[0].x = texLeft;
-	v.TexCoord[0].y = texTop;
-	*D3D::getVertex() = v;
+	v.TexCoord.x = texLeft;
+	v.TexCoord.y = texTop;
+	*D3D::getTileVertex() = v;
 
 	//Top right
 	v.Pos.x = right;
 	v.Pos.y = top;
-	v.TexCoord[0].x = texRight;
-	v.TexCoord[0].y = texTop;
-	*D3D::getVertex() = v;
+	v.TexCoord.x = texRight;
+	v.TexCoord.y = texTop;
+	*D3D::getTileVertex() = v;
 
 	//Bottom right
 	v.Pos.x = right;
 	v.Pos.y = bottom;
-	v.TexCoord[0].x = texRight;
-	v.TexCoord[0].y = texBottom;
-	*D3D::getVertex() = v;
+	v.TexCoord.x = texRight;
+	v.TexCoord.y = texBottom;
+	*D3D::getTileVertex() = v;
 
 	//Bottom left
 	v.Pos.x = left;
 	v.Pos.y = bottom;
-	v.TexCoord[0].x = texLeft;
-	v.TexCoord[0].y = texBottom;
-	*D3D::getVertex() = v;
+	v.TexCoord.x = texLeft;
+	v.TexCoord.y = texBottom;
+	*D3D::getTileVertex() = v;
 }
 
 /**
-For UnrealED.
+For UnrealED; wireframe, grids, brush outlines. Also called by the engine's Draw3DLine() once it has projected a line.
+\param Frame The scene.
+\param Color Color.
+\param LineFlags Line flags; depth cueing isn't done, lines are depth tested and written like other geometry.
+\param P1 Start, in screen space like tiles (X and Y in pixels, Z the depth).
+\param P2 End.
+\note Lines are buffered as two D3D::LineVertex each, and consecutive ones are a single line list draw.
 */
 void UD3D12RenderDevice::Draw2DLine( FSceneNode* Frame, FPlane Color, DWORD LineFlags, FVector P1, FVector P2 )
 {
+	D3D::setProjectionMode(D3D::PROJ_Z_ONLY);
+	D3D::setVertexFormat(D3D::VF_LINE);
+	setLineState();
+
+	DWORD color = D3D::packColor(&Color.X);
+	D3D::LineVertex *v = D3D::getLineVertices();
+	if(!v)
+		return;
+	v[0].Pos = *(D3D::Vec3*)&P1.X;
+	v[0].Color = color;
+	v[1].Pos = *(D3D::Vec3*)&P2.X;
+	v[1].Color = color;
 }
 
 /**
-For UnrealED.
+For UnrealED; vertices, pivots and the like. A filled rectangle, in screen space like tiles.
+\param Frame The scene.
+\param Color Color.
+\param LineFlags Flags, see Draw2DLine().
+\param X1 Left pixel.
+\param Y1 Top pixel.
+\param X2 Right pixel; inclusive, so a single pixel point has X1==X2.
+\param Y2 Bottom pixel; inclusive.
+\param Z Depth.
+\note Points are buffered as one D3D::PointInstance each, and consecutive ones are a single instanced draw.
 */
 void UD3D12RenderDevice::Draw2DPoint( FSceneNode* Frame, FPlane Color, DWORD LineFlags, FLOAT X1, FLOAT Y1, FLOAT X2, FLOAT Y2, FLOAT Z )
 {
+	D3D::setProjectionMode(D3D::PROJ_Z_ONLY);
+	D3D::setVertexFormat(D3D::VF_POINT_INSTANCE);
+	setLineState();
+
+	D3D::PointInstance *p = D3D::getPointInstance();
+	if(!p)
+		return;
+	p->Rect.x = X1;
+	p->Rect.y = Y1;
+	p->Rect.z = X2+1;
+	p->Rect.w = Y2+1;
+	p->Z = Z;
+	p->Color = D3D::packColor(&Color.X);
+}
+
+/**
+Set up the state for editor lines and points: no textures, opaque. Only done if something changed the state since it was last set up.
+*/
+void UD3D12RenderDevice::setLineState()
+{
+	if(lineStateSet && lineStateSerial==D3D::getStateSerial())
+		return;
+	D3D::setTexture(D3D::PASS_DIFFUSE,NULL);
+	D3D::setTexture(D3D::PASS_LIGHT,NULL);
+	D3D::setTexture(D3D::PASS_DETAIL,NULL);
+	D3D::setTexture(D3D::PASS_FOG,NULL);
+	D3D::setTexture(D3D::PASS_MACRO,NULL);
+	D3D::setFlags(0,0);
+	lineStateSet = true;
+	lineStateSerial = D3D::getStateSerial();
+}
+
+/**
+Benchmark scene for the line and point batcher: draws lines criss-crossing the viewport, and a point for every eight lines, and logs how
+many were buffered per millisecond. Run from Unlock() for the frame after the LineBench command.
+\param lines Number of lines.
+*/
+void UD3D12RenderDevice::drawLineBench(int lines)
+{
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	FLOAT width = (FLOAT)Max(Viewport->SizeX,1);
+	FLOAT height = (FLOAT)Max(Viewport->SizeY,1);
+	int points = lines/8;
+
+	QueryPerformanceCounter(&start);
+	for(int i=0;i<lines;i++)
+	{
+		FLOAT x = (FLOAT)(i%(int)width);
+		FPlane color((i&255)/255.0f,((i>>8)&255)/255.0f,1.0f,1.0f);
+		Draw2DLine(NULL,color,0,FVector(x,0,1.0f),FVector(width-1-x,height-1,1.0f));
+	}
+	QueryPerformanceCounter(&end);
+	double lineTime = (double)(end.QuadPart-start.QuadPart)*1000.0/(double)frequency.QuadPart;
+
+	QueryPerformanceCounter(&start);
+	for(int i=0;i<points;i++)
+	{
+		FLOAT x = (FLOAT)(i%(int)width);
+		FLOAT y = (FLOAT)((i/(int)width)%(int)height);
+		Draw2DPoint(NULL,FPlane(1.0f,1.0f,0.0f,1.0f),0,x,y,x+2,y+2,1.0f);
+	}
+	QueryPerformanceCounter(&end);
+	double pointTime = (double)(end.QuadPart-start.QuadPart)*1000.0/(double)frequency.QuadPart;
+
+	TCHAR line[256];
+	swprintf_s(line,256,L"Line benchmark: %d lines in %.3f ms (%.0f lines/ms), %d points in %.3f ms (%.0f points/ms)",
+		lines,lineTime,lineTime>0 ? lines/lineTime : 0.0,points,pointTime,pointTime>0 ? points/pointTime : 0.0);
+	GLog->Log(line);
+}
+
+/**
+Benchmark for the fan batcher: buffers mesh fans of 3 to 10 vertices, in runs of equally sized ones as meshes send them, and logs the
+CPU time per 10000 fans. The fans are degenerate so the scene is left as it was. Run from Unlock() for the frame after the FanBench command.
+\param fans Number of fans.
+*/
+void UD3D12RenderDevice::drawFanBench(int fans)
+{
+	const int RUN_LENGTH = 16;
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	D3D::setProjectionMode(D3D::PROJ_NORMAL);
+	D3D::setVertexFormat(D3D::VF_MESH);
+	setLineState();
+	D3D::MeshVertex vertex;
+	vertex.Pos.x = vertex.Pos.y = 0;
+	vertex.Pos.z = Z_NEAR+1.0f;
+	vertex.Color = 0xFFFFFFFF;
+	vertex.Fog = 0;
+	vertex.TexCoord.x = vertex.TexCoord.y = 0;
+	vertex.flags = 0;
+
+	int buffered = 0;
+	int vertices = 0;
+	QueryPerformanceCounter(&start);
+	for(int i=0;i<fans;i++)
+	{
+		int num = 3+(i/RUN_LENGTH)%8;
+		if(!D3D::indexTriangleFan(num))
+			break;
+		for(int v=0;v<num;v++)
+			*D3D::getMeshVertex() = vertex;
+		buffered++;
+		vertices += num;
+	}
+	QueryPerformanceCounter(&end);
+	double time = (double)(end.QuadPart-start.QuadPart)*1000.0/(double)frequency.QuadPart;
+
+	TCHAR line[256];
+	swprintf_s(line,256,L"Fan benchmark: %d fans (%d vertices) in %.3f ms, %.3f ms per 10k fans",
+		buffered,vertices,time,buffered>0 ? time*10000.0/buffered : 0.0);
+	GLog->Log(line);
+}
+
+/**
+Benchmark for tiles: buffers font-sized tiles, as text comes in, once as instances and once as quads whatever the InstancedTiles option, and logs
+the CPU time and the bytes written to the batches per 10000 tiles for each. The tiles are left of the viewport so the scene is left as it was.
+Run from Unlock() for the frame after the TileBench command.
+\param tiles Number of tiles per run.
+*/
+void UD3D12RenderDevice::drawTileBench(int tiles)
+{
+	const FLOAT GLYPH_SIZE = 8.0f;
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	D3D::TextureMetaData font;
+	ZeroMemory(&font,sizeof(font));
+	font.multU = font.multV = 1.0f/256.0f; //Glyphs from a 256x256 font page
+	FPlane color(1.0f,1.0f,1.0f,1.0f);
+	FPlane fog(0.0f,0.0f,0.0f,0.0f);
+
+	for(int instanced=1;instanced>=0;instanced--)
+	{
+		D3D::setProjectionMode(D3D::PROJ_Z_ONLY);
+		D3D::setVertexFormat(instanced ? D3D::VF_TILE_INSTANCE : D3D::VF_TILE);
+		setLineState();
+		UINT64 bytes = D3D::getWrittenBatchBytes();
+		QueryPerformanceCounter(&start);
+		for(int i=0;i<tiles;i++)
+		{
+			FLOAT u = (FLOAT)(i%32)*GLYPH_SIZE;
+			FLOAT v = (FLOAT)((i/32)%32)*GLYPH_SIZE;
+			bufferTile(font,-2*GLYPH_SIZE,(FLOAT)(i%64)*GLYPH_SIZE,GLYPH_SIZE,GLYPH_SIZE,u,v,GLYPH_SIZE,GLYPH_SIZE,1.0f,color,fog,0,instanced!=0);
+		}
+		QueryPerformanceCounter(&end);
+		double time = (double)(end.QuadPart-start.QuadPart)*1000.0/(double)frequency.QuadPart;
+		bytes = D3D::getWrittenBatchBytes()-bytes;
+
+		TCHAR line[256];
+		swprintf_s(line,256,L"Tile benchmark, %s: %d tiles in %.3f ms, %.3f ms and %I64u KB per 10k tiles",
+			instanced ? L"instanced" : L"quads",tiles,time,time*10000.0/tiles,bytes*10000/tiles/1024);
+		GLog->Log(line);
+	}
 }
 
 /**
@@ -676,11 +1327,14 @@ void UD3D12RenderDevice::PopHit( INT Count, UBOOL bForce )
 }
 
 /**
-Something to do with FPS counters etc, not needed. 
+Report texture cache counters for the last frame.
+\param Result String to print the stats to; assumed to hold 256 characters.
 */
 void UD3D12RenderDevice::GetStats( TCHAR* Result )
 {
-
+	const D3D::CacheStats &stats = D3D::getCacheStats();
+	swprintf_s(Result,256,L"Textures: %d hits, %d misses, %d evictions, %d binds, %d commits, %d uploads (%d KB)",
+		stats.hits,stats.misses,stats.evictions,stats.binds,stats.commits,stats.uploads,stats.uploadBytes/1024);
 }
 
 /**
@@ -700,6 +1354,16 @@ Various command from the game. Can be used to intercept input. First let the par
 \param Cmd The command
 	- GetRes Should return a list of resolutions in string form "HxW HxW" etc.
 	- Brightness is intercepted here
+	- TexStats [CSV|JSON|RESET] [SORT=TIME|UPLOAD|COMMITS|BINDS|BYTES] [TOP=n] logs the last frame's texture cache counters and writes the per texture statistics to D3D12TexStats.csv/.json
+	- TexTrace START|STOP writes a binary trace of texture binds, creations and deletions to D3D12TexTrace.bin, for Tools/texcachesim
+	- RingStats logs upload ring occupancy and how often the CPU had to wait for the GPU, and the last frame's batching, batch chunk and draw sorting counters
+	- GeoStats logs the last frame's static geometry cache counters
+	- RecStats logs how many draws and clears the last frame recorded and how often the draw list was executed, and the map vertices queued for the worker threads
+	- VertexBench times map surface vertex generation, the SSE path against the scalar one
+	- UploadBench times writing vertices to the upload ring directly and through the staging block, and logs staging counters
+	- LineBench [LINES=n] draws a benchmark scene of editor lines and points in the next frame and logs how many were buffered per millisecond; RingStats then shows the draws they took
+	- FanBench [FANS=n] buffers n mesh fans in the next frame and logs the CPU time per 10k fans; RingStats then shows the batching counters
+	- TileBench [TILES=n] buffers n font-sized tiles in the next frame, once instanced and once as quads, and logs the CPU time and bytes uploaded per 10k tiles
 \param Ar A class to which to log responses using Ar.Log().
 
 \note Deus Ex ignores resolutions it does not like.
@@ -724,6 +1388,136 @@ UBOOL UD3D12RenderDevice::Exec(const TCHAR* Cmd, FOutputDevice& Ar)
 		UD3D12RenderDevice::debugs("Done.");
 		return 1;
 	}	
+	else if(ParseCommand(&Cmd,L"TexStats"))
+	{
+		TCHAR stats[256];
+		GetStats(stats);
+		Ar.Log(stats);
+		if(ParseCommand(&Cmd,L"RESET"))
+		{
+			D3D::resetTextureStats();
+		}
+		else if(ParseCommand(&Cmd,L"CSV"))
+		{
+			writeTextureStats(Cmd,false,Ar);
+		}
+		else if(ParseCommand(&Cmd,L"JSON"))
+		{
+			writeTextureStats(Cmd,true,Ar);
+		}
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"TexTrace"))
+	{
+		if(ParseCommand(&Cmd,L"START"))
+		{
+			if(D3D::startTextureTrace("D3D12TexTrace.bin"))
+				Ar.Log(L"Writing texture cache trace to D3D12TexTrace.bin.");
+			else
+				Ar.Log(L"Could not open texture cache trace file.");
+		}
+		else if(ParseCommand(&Cmd,L"STOP"))
+		{
+			D3D::stopTextureTrace();
+			Ar.Log(L"Texture cache trace stopped.");
+		}
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"RingStats"))
+	{
+		const UploadRing::Stats &ring = D3D::getRingStats();
+		TCHAR line[256];
+		swprintf_s(line,256,L"Upload ring: %I64u/%I64u KB in use over %d frames, peak %I64u KB, last frame %I64u KB; %d waits (%.2f ms), grown %d times, %d failed allocations",
+			ring.used/1024,ring.size/1024,ring.framesInFlight,ring.peak/1024,ring.frameBytes/1024,ring.waits,ring.waitTime,ring.growths,ring.failures);
+		Ar.Log(line);
+		const D3D::BatchStats &batches = D3D::getBatchStats();
+		swprintf_s(line,256,L"Batching: %d batches, %d draws, %d fans indexed, %d fans from templates, %d tile instances, %d shared vertices, %d KB indices, %d KB vertices",
+			batches.batches,batches.draws,batches.writtenFans,batches.templatedFans,batches.tileInstances,batches.sharedVertices,batches.indexBytes/1024,batches.vertexBytes/1024);
+		Ar.Log(line);
+		if(batches.lines || batches.points)
+		{
+			swprintf_s(line,256,L"Editor: %d lines, %d points",batches.lines,batches.points);
+			Ar.Log(line);
+		}
+		swprintf_s(line,256,L"Chunks: %d chained, %d indices and %d KB vertices each; high-water mark %d indices, %d KB vertices per frame; %d surface table entries",
+			batches.chainedChunks,batches.chunkIndices,batches.chunkVertexBytes/1024,batches.highWaterIndices,batches.highWaterVertexBytes/1024,batches.surfaces);
+		Ar.Log(line);
+		swprintf_s(line,256,L"Sorting: %d of %d draw groups sorted by state (%d translucent), %d state changes (%d in engine order); %d coplanar barriers",
+			batches.sortedGroups,batches.groups,batches.sortedTranslucentGroups,batches.stateChanges,batches.unsortedStateChanges,batches.planeBarriers);
+		Ar.Log(line);
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"RecStats"))
+	{
+		const CommandRecorder::Stats &rec = D3D::getRecordStats();
+		TCHAR line[256];
+		swprintf_s(line,256,L"Command recording: %d draws and %d clears in %d lists; %d allocator waits",rec.draws,rec.clears,rec.lists,rec.waits);
+		Ar.Log(line);
+		const VertexGen::QueueStats &queue = VertexGen::getQueueStats();
+		swprintf_s(line,256,L"Queued map vertices: %d in %d fans, %d parts; %.3f ms at Unlock for %.3f ms of work (%.2fx)",
+			queue.vertices,queue.fans,queue.items,queue.runTime,queue.workTime,queue.runTime>0 ? queue.workTime/queue.runTime : 0.0);
+		Ar.Log(line);
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"VertexBench"))
+	{
+		double scalarNs, vectorNs;
+		float maxError;
+		VertexGen::benchmark(65536,100,scalarNs,vectorNs,maxError);
+		TCHAR line[256];
+		swprintf_s(line,256,L"Map vertex generation: scalar %.2f ns/vertex, SSE %.2f ns/vertex (%.2fx); largest difference %g",
+			scalarNs,vectorNs,vectorNs>0 ? scalarNs/vectorNs : 0.0,maxError);
+		Ar.Log(line);
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"UploadBench"))
+	{
+		double directMBs, stagedMBs;
+		TCHAR line[256];
+		if(D3D::benchmarkStaging(directMBs,stagedMBs))
+		{
+			swprintf_s(line,256,L"Vertex upload: direct %.0f MB/s, staged %.0f MB/s (%.2fx)",directMBs,stagedMBs,directMBs>0 ? stagedMBs/directMBs : 0.0);
+			Ar.Log(line);
+		}
+		const VertexStaging::Stats &staging = D3D::getStagingStats();
+		swprintf_s(line,256,L"Staging: %I64u KB streamed in whole lines, %I64u KB partial lines, %I64u KB too large to stage, %d flushes",
+			staging.streamedBytes/1024,staging.copiedBytes/1024,staging.directBytes/1024,staging.flushes);
+		Ar.Log(line);
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"LineBench"))
+	{
+		INT lines = 100000;
+		Parse(Cmd,L"LINES=",lines);
+		lineBenchLines = Max(lines,1);
+		Ar.Log(L"Line benchmark scene is drawn next frame.");
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"FanBench"))
+	{
+		INT fans = 100000;
+		Parse(Cmd,L"FANS=",fans);
+		fanBenchFans = Max(fans,1);
+		Ar.Log(L"Fan benchmark is run next frame.");
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"TileBench"))
+	{
+		INT tiles = 100000;
+		Parse(Cmd,L"TILES=",tiles);
+		tileBenchTiles = Max(tiles,1);
+		Ar.Log(L"Tile benchmark is run next frame.");
+		return 1;
+	}
+	else if(ParseCommand(&Cmd,L"GeoStats"))
+	{
+		const D3D::GeometryCacheStats &geo = D3D::getGeometryCacheStats();
+		TCHAR line[256];
+		swprintf_s(line,256,L"Geometry cache: %d hits, %d misses (%.1f%% hit rate), %d KB saved, %d KB uploaded, %d evictions, %d entries using %d KB",
+			geo.hits,geo.misses,geo.hits+geo.misses ? 100.0*geo.hits/(geo.hits+geo.misses) : 0.0,geo.savedBytes/1024,geo.uploadBytes/1024,geo.evictions,geo.entries,geo.usedBytes/1024);
+		Ar.Log(line);
+		return 1;
+	}
 	else if((ptr=(wchar_t*)wcswcs(Cmd,L"Brightness"))) //Brightness is sent as "brightness [val]".
 	{
 		UD3D12RenderDevice::debugs("Setting brightness.");
@@ -754,6 +1548,7 @@ void UD3D12RenderDevice::SetSceneNode(FSceneNode* Frame )
 
 	D3D::setViewPort(Frame->X,Frame->Y,Frame->XB,Frame->YB); //Viewport is set here as it changes during gameplay. For example in DX conversations
 	D3D::setProjection(aspect,RProjZ);		
+	D3D::setView(*(D3D::Vec3*)&Frame->Coords.Origin.X,*(D3D::Vec3*)&Frame->Coords.XAxis.X,*(D3D::Vec3*)&Frame->Coords.YAxis.X,*(D3D::Vec3*)&Frame->Coords.ZAxis.X);
 }
 
 /**
@@ -767,11 +1562,19 @@ Store a texture in the renderer-kept texture cache. Only called by the game if U
 */
 void UD3D12RenderDevice::PrecacheTexture( FTextureInfo& Info, DWORD PolyFlags )
 {
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER start, end;
+	if(!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+
 	if(D3D::textureIsCached(Info.CacheID))
 	{
 		if(Info.bRealtimeChanged) //Update already cached realtime textures
 		{
+			QueryPerformanceCounter(&start);
 			TexConversion::update(Info,PolyFlags);
+			QueryPerformanceCounter(&end);
+			D3D::addConversionTime(Info.CacheID,(end.QuadPart-start.QuadPart)*1000.0/frequency.QuadPart);
 			return;
 		}
 		else if((PolyFlags & PF_Masked)&&!D3D::getTextureMetaData(Info.CacheID).masked) //Mask bit changed. Static texture, so must be deleted and recreated.
@@ -785,7 +1588,10 @@ void UD3D12RenderDevice::PrecacheTexture( FTextureInfo& Info, DWORD PolyFlags )
 	}
 
 	//Cache texture
+	QueryPerformanceCounter(&start);
 	TexConversion::convertAndCache(Info,PolyFlags); //Fills TextureInfo with metadata and a D3D format texture		
+	QueryPerformanceCounter(&end);
+	D3D::addConversionTime(Info.CacheID,(end.QuadPart-start.QuadPart)*1000.0/frequency.QuadPart);
 
 }
 
@@ -811,6 +1617,7 @@ void UD3D12RenderDevice::DrawFogSurface(FSceneNode* Frame, FFogSurf &FogSurf)
 {
 	float mult = 1.0/FogSurf.FogDistance;
 	D3D::setProjectionMode(D3D::PROJ_NORMAL);
+	D3D::setVertexFormat(D3D::VF_MESH);
 	
 	D3D::setFlags(PF_AlphaBlend,0);
 	D3D::setTexture(D3D::PASS_DIFFUSE,NULL);
@@ -820,14 +1627,15 @@ void UD3D12RenderDevice::DrawFogSurface(FSceneNode* Frame, FFogSurf &FogSurf)
 	D3D::setTexture(D3D::PASS_MACRO,NULL);	
 	for(FSavedPoly* Poly = FogSurf.Polys; Poly; Poly = Poly->Next)
 	{
-		D3D::indexTriangleFan(Poly->NumPts);
+		if(!D3D::indexTriangleFan(Poly->NumPts))
+			return;
 		for(int i=0; i<Poly->NumPts; i++ )
 		{
-			D3D::Vertex* v = D3D::getVertex();
-			v->flags=FogSurf.PolyFlags;
-			v->Color=*((D3D::Vec4*)&FogSurf.FogColor.X);			
+			D3D::MeshVertex* v = D3D::getMeshVertex();
 			v->Pos = *(D3D::Vec3*)&Poly->Pts[i]->Point.X;
-			v->Color.w = v->Pos.z*mult;		
+			FLOAT color[4] = {FogSurf.FogColor.X,FogSurf.FogColor.Y,FogSurf.FogColor.Z,v->Pos.z*mult};
+			v->Color = D3D::packColor(color);
+			v->Fog = 0;
 			v->flags = PF_AlphaBlend;
 		}
 	}
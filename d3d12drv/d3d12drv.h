@@ -6,6 +6,12 @@
 #include "Engine.h"
 #include "UnRender.h"
 #include "d3d.h"
+
+/** Define as 1 when building against engine headers whose URenderDevice declares DrawGouraudPolyList() (UT v469 and some mod engines) */
+#ifndef POLY_LIST_INTERFACE
+#define POLY_LIST_INTERFACE 0
+#endif
+
 class UD3D12RenderDevice:public URenderDevice
 {
 
@@ -22,6 +28,7 @@ private:
 	struct
 	{
 		int precache; /**< Turn on precaching */
+		int workerThreads; /**< Number of worker threads for texture processing; 0 does everything on the game thread */
 	} options;
 
 public:
@@ -29,6 +36,14 @@ public:
 	//@{	
 	static void debugs(char *s);
 	int getOption(TCHAR* name,int defaultVal, bool isBool);
+	void writeTextureStats(const TCHAR* Cmd,bool json,FOutputDevice& Ar);
+	static double textureCost(const D3D::TextureStats &stats,const TCHAR* sortBy);
+	D3D::TextureMetaData *setPolyState(FTextureInfo& Info, DWORD PolyFlags);
+	void setLineState();
+	void bufferTile(const D3D::TextureMetaData &diffuse, FLOAT X, FLOAT Y, FLOAT XL, FLOAT YL, FLOAT U, FLOAT V, FLOAT UL, FLOAT VL, FLOAT Z, const FPlane &Color, const FPlane &Fog, DWORD PolyFlags, bool instanced);
+	void drawLineBench(int lines);
+	void drawFanBench(int fans);
+	void drawTileBench(int tiles);
 	//@}
 	
 	/**@name Abstract in parent class */
@@ -62,6 +77,9 @@ public:
 	void PrecacheTexture( FTextureInfo& Info, DWORD PolyFlags );
 	void EndFlash();
 	void StaticConstructor();
+	#if POLY_LIST_INTERFACE
+	void DrawGouraudPolyList( FSceneNode* Frame, FTextureInfo& Info, FTransTexture* Pts, INT NumPts, DWORD PolyFlags, FSpanBuffer* Span );
+	#endif
 	//@}
 
 	#ifdef RUNE
@@ -9,6 +9,14 @@
 	Exposes various API-neutral structures with which the renderer interface can pass data.
 	- texconversion.cpp is the glue that prepares Unreal textures to be saved in the D3D texture cache. Assigns or converts textures to formats D3D can work with.
 	TexConversion class.
+	- atlas.cpp packs small textures (lightmaps, fog maps) into shared pages. Atlas class.
+	- workers.cpp runs CPU heavy jobs (mip generation etc.) on a small thread pool. Workers class.
+	- uploadring.cpp suballocates per batch vertex and index data from a persistently mapped buffer, reclaimed by fence once the GPU is done. UploadRing class.
+	- cmdrecorder.cpp records the frame's draws and clears into a D3D12 command list, in order, rebinding only what changed. CommandRecorder class.
+	- vertexgen.cpp builds map surface vertices with SSE, 4 floats at a time. VertexGen class.
+	- vertexstaging.cpp builds vertices in cached memory and writes them to the upload ring in whole cache lines. VertexStaging class.
+	- vertexdedup.cpp remembers which batch vertex was made from which engine point, so polygons can share vertices. VertexDedup class.
+	- textrace.h describes the binary texture cache trace written by the TexTrace command; Tools/texcachesim replays it against eviction policies and budgets.
 
 	An effort was made to keep the renderer interface reasonably API neutral. Ports to future Direct3D versions should only influence the D3D and to a lesser extent TexConversion classes.
 
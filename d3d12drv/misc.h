@@ -4,5 +4,9 @@
 
 namespace Misc
 {
+	const unsigned long long HASH_INIT = 14695981039346656037ULL; /**< Starting value for hashBytes() */
+
 	int getFov(int defaultFOV, int resX, int resY);
+	unsigned long long hashBytes(unsigned long long hash, const void *data, size_t size);
+	unsigned long long hashDwords(unsigned long long hash, const unsigned int *data, size_t count);
 }
\ No newline at end of file
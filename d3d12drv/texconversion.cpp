@@ -25,25 +25,42 @@ Additional notes:
 - BRGA7 textures have garbage data outside their UClamp and reading outside the VClamp can lead to access violations. To be able to still direct assign them,
 all textures are made only as large as the UClamp*VClamp and the texture coordinates are scaled to reflect this. Furthermore, the D3D_SUBRESOURCE_DATA's stride
 parameter is set so the data outside the UClamp is skipped.
+- Static 32 bit textures without mips get a box filtered mip chain generated (GenerateMips option), split over the worker threads. Atlased lightmaps don't, as the atlas pages have a single level.
 */
 #include <stdio.h>
+#include <emmintrin.h>
 #include <D3DX11.h>
 #include "texconversion.h"
 #include "polyflags.h"
+#include "workers.h"
+
+/** Rows of a mip level filtered per worker job item */
+static const int MIP_ROWS_PER_ITEM = 16;
 
 /**
 Mappings from Unreal to our texture info
 */
 TexConversion::TextureFormat TexConversion::formats[] = 
 {
-	{true,0,false,DXGI_FORMAT_R8G8B8A8_UNORM,&TexConversion::fromPaletted},		/**< TEXF_P8 = 0x00 */
-	{true,0,true,DXGI_FORMAT_R8G8B8A8_UNORM,NULL},								/**< TEXF_RGBA7	= 0x01 */
-	{false,0,true,DXGI_FORMAT_R8G8B8A8_UNORM,NULL},								/**< TEXF_RGB16	= 0x02 */
-	{true,4,true,DXGI_FORMAT_BC1_UNORM,NULL},									/**< TEXF_DXT1 = 0x03 */
-	{false,0,true,DXGI_FORMAT_UNKNOWN,NULL},									/**< TEXF_RGB8 = 0x04 */
-	{true,0,true,DXGI_FORMAT_R8G8B8A8_UNORM,NULL},								/**< TEXF_RGBA8	= 0x05 */
+	{true,0,4,false,DXGI_FORMAT_R8G8B8A8_UNORM,&TexConversion::fromPaletted},		/**< TEXF_P8 = 0x00 */
+	{true,0,4,true,DXGI_FORMAT_R8G8B8A8_UNORM,NULL},								/**< TEXF_RGBA7	= 0x01 */
+	{false,0,4,true,DXGI_FORMAT_R8G8B8A8_UNORM,NULL},								/**< TEXF_RGB16	= 0x02 */
+	{true,4,0,true,DXGI_FORMAT_BC1_UNORM,NULL},									/**< TEXF_DXT1 = 0x03 */
+	{false,0,0,true,DXGI_FORMAT_UNKNOWN,NULL},									/**< TEXF_RGB8 = 0x04 */
+	{true,0,4,true,DXGI_FORMAT_R8G8B8A8_UNORM,NULL},								/**< TEXF_RGBA8	= 0x05 */
 };
 
+/**
+16 bit storage for lightmaps and fog maps with uniform alpha, see chooseFormat()
+*/
+TexConversion::TextureFormat TexConversion::compactBGRA7Format = {true,0,2,false,DXGI_FORMAT_B5G6R5_UNORM,&TexConversion::toCompactBGRA7};
+
+/**
+Single channel storage for grayscale textures with uniform alpha, see chooseFormat()
+*/
+TexConversion::TextureFormat TexConversion::grayPalettedFormat = {true,0,1,false,DXGI_FORMAT_R8_UNORM,&TexConversion::fromPalettedGray};
+TexConversion::TextureFormat TexConversion::grayRGBA8Format = {true,0,1,false,DXGI_FORMAT_R8_UNORM,&TexConversion::fromRGBA8Gray};
+
 /**
 Fill texture info structure and execute proper conversion of pixel data.
 
@@ -58,8 +75,7 @@ void TexConversion::convertAndCache(FTextureInfo& Info,DWORD PolyFlags)
 		return;
 	}
 	
-	TextureFormat &format=formats[Info.Format];
-	if(format.supported == false)
+	if(formats[Info.Format].supported == false)
 	{
 		UD3D11RenderDevice::debugs("Unsupported texture type.");
 		return;
@@ -67,6 +83,7 @@ void TexConversion::convertAndCache(FTextureInfo& Info,DWORD PolyFlags)
 
 	//Set texture info. These parameters are the same for each usage of the texture.
 	D3D::TextureMetaData metadata;	
+	TextureFormat &format=chooseFormat(Info,PolyFlags,metadata);
 	//Mult is a multiplier (so division is only done once here instead of when texture is applied) to normalize texture coordinates.
 	//metadata.width = Info.USize;
 	//metadata.height = Info.VSize;	
@@ -74,10 +91,12 @@ void TexConversion::convertAndCache(FTextureInfo& Info,DWORD PolyFlags)
 	//metadata.multV = 1.0 / (Info.VScale * Info.VSize);
 	metadata.multU = 1.0 / (Info.UScale * Info.UClamp);
 	metadata.multV = 1.0 / (Info.VScale * Info.VClamp);
+	metadata.offsetU = 0;
+	metadata.offsetV = 0;
 	metadata.masked = (PolyFlags & PF_Masked)!=0;
 
-	//Convert each mip level
-	D3D11_SUBRESOURCE_DATA* data = new D3D11_SUBRESOURCE_DATA[Info.NumMips];
+	//Convert each mip level; leave room for any generated ones
+	D3D11_SUBRESOURCE_DATA* data = new D3D11_SUBRESOURCE_DATA[max(Info.NumMips,numMipLevels(Info.UClamp,Info.VClamp))];
 	for(int i=0;i<Info.NumMips;i++)
 	{
 		convertMip(Info,format,PolyFlags,i,data[i]);
@@ -107,11 +126,26 @@ void TexConversion::convertAndCache(FTextureInfo& Info,DWORD PolyFlags)
 		desc.Height += Info.VSize%format.blocksize;
 	}
 
-	ID3D11Texture2D* texture = D3D::createTexture(desc,*data);
-	if(texture==NULL)
-		return;
+	//Lightmaps and fog maps (the only BGRA7 textures) are put in a shared atlas page if possible, saving texture switches
+	ID3D11Texture2D* texture = NULL;
+	if(Info.Format!=TEXF_RGBA7 || !D3D::cacheAtlasTexture(Info.CacheID,metadata,desc,*data))
+	{
+		//Static 32 bit textures that come without mips (lightmaps, fog maps, some mod textures) get a generated chain so they don't shimmer in the distance
+		if(D3D::getOptions().generateMips && Info.NumMips==1 && !dynamic && format.blocksize==0 && format.texelSize==4)
+		{
+			desc.MipLevels = generateMips(desc.Width,desc.Height,data);
+		}
+
+		//Large static textures have their big mips streamed in over the next frames instead of uploaded all at once
+		if(!D3D::cacheStreamedTexture(Info.CacheID,metadata,desc,data))
+		{
+			texture = D3D::createTexture(desc,*data);
+			if(texture==NULL)
+				return;
 
-	D3D::cacheTexture(Info.CacheID,metadata,texture);
+			D3D::cacheTexture(Info.CacheID,metadata,texture);
+		}
+	}
 
 /*
 	if(Info.Format == 0  )
@@ -121,13 +155,11 @@ void TexConversion::convertAndCache(FTextureInfo& Info,DWORD PolyFlags)
 		D3DX10SaveTextureToFileA(texture,D3DX10_IFF_PNG,buf);
 	}
 */
-	//Delete temporary data
-	if(!format.directAssign)
+	//Delete temporary data; generated mips are always temporary
+	for(UINT i=0;i<desc.MipLevels;i++)
 	{
-		for(int i=0;i<Info.NumMips;i++)
-		{
+		if(!format.directAssign || i>=(UINT)Info.NumMips)
 			delete [] data[i].pSysMem;
-		}		
 	}
 	delete [] data;
 	SAFE_RELEASE(texture);
@@ -141,7 +173,18 @@ void TexConversion::update(FTextureInfo& Info,DWORD PolyFlags)
 
 	D3D11_SUBRESOURCE_DATA data;
 	Info.bRealtimeChanged=0; //Clear this flag (from other renderes)
-	TextureFormat format = formats[Info.Format];
+
+	//If the new contents don't fit the format the texture was stored in (e.g. a compact lightmap's alpha changed), recreate it
+	D3D::TextureMetaData metadata;
+	TextureFormat &format = chooseFormat(Info,PolyFlags,metadata);
+	D3D::TextureMetaData &cached = D3D::getTextureMetaData(Info.CacheID);
+	if(metadata.shaderFormat!=cached.shaderFormat || metadata.constAlpha!=cached.constAlpha)
+	{
+		D3D::deleteTexture(Info.CacheID);
+		convertAndCache(Info,PolyFlags);
+		return;
+	}
+
 	convertMip(Info,format,PolyFlags,0,data);
 	D3D::updateMip(Info.CacheID,0,data);
 	if(!format.directAssign)
@@ -167,7 +210,7 @@ void TexConversion::convertMip(FTextureInfo& Info,TextureFormat &format,DWORD Po
 	}
 	else
 	{
-		data.SysMemPitch=Info.Mips[mipLevel]->USize*sizeof(DWORD); //Pitch is set so garbage data outside of UClamp is skipped
+		data.SysMemPitch=Info.Mips[mipLevel]->USize*format.texelSize; //Pitch is set so garbage data outside of UClamp is skipped
 	}
 
 	//Assign or convert
@@ -188,6 +231,132 @@ void TexConversion::convertMip(FTextureInfo& Info,TextureFormat &format,DWORD Po
 	}
 }
 
+/**
+Pick the format a texture is stored in. Normally that's the one from the formats table for its Unreal format; some textures can be stored more compactly.
+- Lightmaps and fog maps (BGRA7) whose alpha is the same for every texel are stored as B5G6R5 if the CompactLightmaps option is on.
+This halves their memory and the upload bandwidth for dynamic lightmaps. The alpha value is passed to the shader per texture pass instead.
+- Static P8 and RGBA8 textures that are grayscale with uniform alpha are stored as R8 if the SingleChannelTextures option is on. This is common for detail and macro textures.
+The shader replicates the channel and uses the constant alpha. Masked textures are excluded as their alpha varies by definition.
+
+\param Info Unreal texture info.
+\param PolyFlags Polyflags. See polyflags.h.
+\param metadata Receives the shader side format and constant alpha.
+\return Conversion parameters to use.
+*/
+TexConversion::TextureFormat &TexConversion::chooseFormat(FTextureInfo& Info,DWORD PolyFlags,D3D::TextureMetaData &metadata)
+{
+	metadata.shaderFormat = D3D::SHADERFMT_RGBA;
+	metadata.constAlpha = 0;
+
+	BYTE alpha;
+	if(Info.Format==TEXF_RGBA7 && D3D::getOptions().compactLightmaps && alphaIsUniform(Info,alpha))
+	{
+		metadata.shaderFormat = D3D::SHADERFMT_BGRA7_COMPACT;
+		metadata.constAlpha = alpha*2/255.0f; //Same scale the shader applies to 7 bit color channels
+		return compactBGRA7Format;
+	}
+
+	bool dynamic = (Info.bRealtime || Info.bParametric)!=0; //Not worth scanning these on every update
+	if((Info.Format==TEXF_P8 || Info.Format==TEXF_RGBA8) && D3D::getOptions().singleChannelTextures && !dynamic && !(PolyFlags&PF_Masked) && isGrayscale(Info,alpha))
+	{
+		metadata.shaderFormat = D3D::SHADERFMT_GRAY;
+		metadata.constAlpha = alpha/255.0f;
+		return Info.Format==TEXF_P8 ? grayPalettedFormat : grayRGBA8Format;
+	}
+	return formats[Info.Format];
+}
+
+/**
+Check whether all texels of a 32 bit texture's 0th mip inside the U/VClamp have the same alpha.
+\param Info Unreal texture info.
+\param alpha Receives the alpha value if uniform.
+*/
+bool TexConversion::alphaIsUniform(FTextureInfo& Info,BYTE &alpha)
+{
+	const DWORD *row = (const DWORD*) Info.Mips[0]->DataPtr;
+	alpha = (BYTE) (row[0]>>24);
+	for(int v=0;v<Info.VClamp;v++)
+	{
+		for(int u=0;u<Info.UClamp;u++)
+		{
+			if((row[u]>>24)!=alpha)
+				return false;
+		}
+		row+=Info.Mips[0]->USize;
+	}
+	return true;
+}
+
+/**
+Check whether a P8 or RGBA8 texture only has gray (R=G=B) texels, all with the same alpha. All mips are checked as they're not necessarily derived exactly from the 0th.
+For P8 the palette is checked first; only if it contains colored entries are the texels scanned to see if those are actually used.
+\param Info Unreal texture info.
+\param alpha Receives the alpha value if grayscale.
+*/
+bool TexConversion::isGrayscale(FTextureInfo& Info,BYTE &alpha)
+{
+	if(Info.Format==TEXF_P8)
+	{
+		const FColor *palette = Info.Palette;
+		bool gray[256];
+		bool allGray = true;
+		alpha = palette[0].A;
+		for(int i=0;i<256;i++)
+		{
+			gray[i] = palette[i].R==palette[i].G && palette[i].G==palette[i].B && palette[i].A==alpha;
+			allGray &= gray[i];
+		}
+		if(allGray)
+			return true;
+
+		//Alpha must match that of the entries actually used, which need not include entry 0
+		bool alphaSet = false;
+		for(int mip=0;mip<Info.NumMips;mip++)
+		{
+			const BYTE *row = (const BYTE*) Info.Mips[mip]->DataPtr;
+			int rows = max(Info.VClamp>>mip,1);
+			int cols = max(Info.UClamp>>mip,1);
+			for(int v=0;v<rows;v++)
+			{
+				for(int u=0;u<cols;u++)
+				{
+					const FColor &c = palette[row[u]];
+					if(c.R!=c.G || c.G!=c.B)
+						return false;
+					if(!alphaSet)
+					{
+						alpha = c.A;
+						alphaSet = true;
+					}
+					else if(c.A!=alpha)
+						return false;
+				}
+				row+=Info.Mips[mip]->USize;
+			}
+		}
+		return true;
+	}
+
+	//RGBA8: check each texel
+	alpha = ((const BYTE*) Info.Mips[0]->DataPtr)[3];
+	for(int mip=0;mip<Info.NumMips;mip++)
+	{
+		const BYTE *row = (const BYTE*) Info.Mips[mip]->DataPtr;
+		int rows = max(Info.VClamp>>mip,1);
+		int cols = max(Info.UClamp>>mip,1);
+		for(int v=0;v<rows;v++)
+		{
+			for(const BYTE *texel=row;texel<row+cols*4;texel+=4)
+			{
+				if(texel[0]!=texel[1] || texel[1]!=texel[2] || texel[3]!=alpha)
+					return false;
+			}
+			row+=Info.Mips[mip]->USize*4;
+		}
+	}
+	return true;
+}
+
 /**
 Convert from palleted 8bpp to r8g8b8a8.
 */
@@ -249,3 +418,189 @@ void TexConversion::fromBGRA7(FTextureInfo& Info,DWORD PolyFlags,void *target,in
 		dst2+=USize;
 	}*/
 }
+
+/**
+BGRA7 to B5G6R5, for lightmaps and fog maps with uniform alpha (see chooseFormat()). Alpha is dropped.
+Channels are scaled so the 7 bit range maps to the full 5/6 bit one; the shader then doesn't need the 2x scale and swizzle it uses for the 32 bit version.
+Converts 8 texels at a time using SSE2; the remainder is done one by one.
+\note As with direct assignment, rows are converted at full USize so the pitch matches; only up to the VClamp though, see fromBGRA7().
+*/
+void TexConversion::toCompactBGRA7(FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel)
+{
+	const DWORD *source = (const DWORD*) Info.Mips[mipLevel]->DataPtr;
+	WORD *dest = (WORD*) target;
+	int num = Info.Mips[mipLevel]->USize*max((Info.VClamp>>mipLevel),1);
+
+	//5 bit: (v*62+127)/255, 6 bit: (v*126+127)/255, i.e. v/127.5 rounded to the new range. Division by 255 is done as (x+1+(x>>8))>>8, exact for these ranges.
+	const __m128i byteMask = _mm_set1_epi32(0xff);
+	const __m128i mul5 = _mm_set1_epi32(62);
+	const __m128i mul6 = _mm_set1_epi32(126);
+	const __m128i round = _mm_set1_epi32(127);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i max5 = _mm_set1_epi32(31);
+	const __m128i max6 = _mm_set1_epi32(63);
+	int i=0;
+	for(;i+8<=num;i+=8)
+	{
+		__m128i packed[2];
+		for(int j=0;j<2;j++)
+		{
+			__m128i texels = _mm_loadu_si128((const __m128i*)(source+i+j*4));
+			__m128i b = _mm_and_si128(texels,byteMask);
+			__m128i g = _mm_and_si128(_mm_srli_epi32(texels,8),byteMask);
+			__m128i r = _mm_and_si128(_mm_srli_epi32(texels,16),byteMask);
+
+			//Values stay below 2^16, so 16 bit multiplies on the 32 bit lanes are fine
+			b = _mm_add_epi32(_mm_mullo_epi16(b,mul5),round);
+			g = _mm_add_epi32(_mm_mullo_epi16(g,mul6),round);
+			r = _mm_add_epi32(_mm_mullo_epi16(r,mul5),round);
+			b = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(b,one),_mm_srli_epi32(b,8)),8);
+			g = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(g,one),_mm_srli_epi32(g,8)),8);
+			r = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(r,one),_mm_srli_epi32(r,8)),8);
+			b = _mm_min_epi16(b,max5); //Guard against values outside the 7 bit range
+			g = _mm_min_epi16(g,max6);
+			r = _mm_min_epi16(r,max5);
+
+			__m128i texel16 = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r,11),_mm_slli_epi32(g,5)),b);
+			packed[j] = _mm_srai_epi32(_mm_slli_epi32(texel16,16),16); //Sign extend so the saturating pack keeps the bits intact
+		}
+		_mm_storeu_si128((__m128i*)(dest+i),_mm_packs_epi32(packed[0],packed[1]));
+	}
+	for(;i<num;i++)
+	{
+		DWORD texel = source[i];
+		DWORD b = texel&0xff;
+		DWORD g = (texel>>8)&0xff;
+		DWORD r = (texel>>16)&0xff;
+		dest[i] = (WORD) ((min((r*62+127)/255,31)<<11) | (min((g*126+127)/255,63)<<5) | min((b*62+127)/255,31));
+	}
+}
+
+/**
+Palleted 8bpp to r8 for grayscale textures; only the red channel of each palette entry is needed.
+*/
+void TexConversion::fromPalettedGray(FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel)
+{
+	BYTE lookup[256];
+	for(int i=0;i<256;i++)
+	{
+		lookup[i] = Info.Palette[i].R;
+	}
+
+	BYTE *dest = (BYTE*) target;
+	BYTE *source = (BYTE*) Info.Mips[mipLevel]->DataPtr;
+	BYTE *sourceEnd = source + Info.Mips[mipLevel]->USize*max((Info.VClamp>>mipLevel),1);
+	while(source<sourceEnd)
+	{
+		*dest=lookup[*source];
+		source++;
+		dest++;
+	}
+}
+
+/**
+RGBA8 to r8 for grayscale textures.
+*/
+void TexConversion::fromRGBA8Gray(FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel)
+{
+	BYTE *dest = (BYTE*) target;
+	DWORD *source = (DWORD*) Info.Mips[mipLevel]->DataPtr;
+	DWORD *sourceEnd = source + Info.Mips[mipLevel]->USize*max((Info.VClamp>>mipLevel),1);
+	while(source<sourceEnd)
+	{
+		*dest=(BYTE) *source;
+		source++;
+		dest++;
+	}
+}
+
+/**
+\return Number of levels in a full mip chain for a texture of the given size.
+*/
+int TexConversion::numMipLevels(int width, int height)
+{
+	int levels = 1;
+	for(int size=max(width,height);size>1;size>>=1)
+	{
+		levels++;
+	}
+	return levels;
+}
+
+/**
+Fill out a full mip chain below the 0th level with a 2x2 box filter. Each level's rows are split among the worker threads.
+Only for 4 byte per texel formats.
+\param width Width of the 0th level.
+\param height Height of the 0th level.
+\param data Subresource data; the 0th element must be filled in, the rest (up to numMipLevels()) is allocated and filled here and must be deleted by the caller.
+\return The number of mip levels, including the 0th.
+*/
+int TexConversion::generateMips(int width, int height, D3D11_SUBRESOURCE_DATA *data)
+{
+	int levels = numMipLevels(width,height);
+	for(int i=1;i<levels;i++)
+	{
+		MipJob job;
+		job.src = (const BYTE*) data[i-1].pSysMem;
+		job.srcPitch = data[i-1].SysMemPitch;
+		job.srcWidth = max(width>>(i-1),1);
+		job.srcHeight = max(height>>(i-1),1);
+		job.dstWidth = max(width>>i,1);
+		job.dstHeight = max(height>>i,1);
+		job.dst = new BYTE[job.dstWidth*job.dstHeight*4];
+
+		Workers::run(&TexConversion::boxFilterRows,&job,(job.dstHeight+MIP_ROWS_PER_ITEM-1)/MIP_ROWS_PER_ITEM);
+
+		data[i].pSysMem = job.dst;
+		data[i].SysMemPitch = job.dstWidth*4;
+		data[i].SysMemSlicePitch = 0;
+	}
+	return levels;
+}
+
+/**
+Worker job: filter a block of rows of a mip level from the level above.
+Averages 2x2 texel blocks, rounded; where the source level is only a single texel wide or high, that texel is used twice.
+\param param MipJob.
+\param item Block of rows to do.
+*/
+void TexConversion::boxFilterRows(void *param, int item)
+{
+	const MipJob &job = *(const MipJob*) param;
+	int yEnd = min((item+1)*MIP_ROWS_PER_ITEM,job.dstHeight);
+	__m128i zero = _mm_setzero_si128();
+	__m128i two = _mm_set1_epi16(2);
+	for(int y=item*MIP_ROWS_PER_ITEM;y<yEnd;y++)
+	{
+		const BYTE *row0 = job.src + (2*y)*job.srcPitch;
+		const BYTE *row1 = job.src + min(2*y+1,job.srcHeight-1)*job.srcPitch;
+		BYTE *out = job.dst + y*job.dstWidth*4;
+		int x=0;
+
+		//2 output texels at a time
+		if(job.srcWidth>1)
+		{
+			for(;x+2<=job.dstWidth;x+=2)
+			{
+				__m128i a = _mm_loadu_si128((const __m128i*)(row0+x*8));
+				__m128i b = _mm_loadu_si128((const __m128i*)(row1+x*8));
+				__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a,zero),_mm_unpacklo_epi8(b,zero));
+				__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a,zero),_mm_unpackhi_epi8(b,zero));
+				lo = _mm_add_epi16(lo,_mm_srli_si128(lo,8));
+				hi = _mm_add_epi16(hi,_mm_srli_si128(hi,8));
+				__m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo,hi),two),2);
+				_mm_storel_epi64((__m128i*)(out+x*4),_mm_packus_epi16(sum,zero));
+			}
+		}
+
+		for(;x<job.dstWidth;x++)
+		{
+			int x0 = 2*x;
+			int x1 = min(2*x+1,job.srcWidth-1);
+			for(int c=0;c<4;c++)
+			{
+				out[x*4+c] = (row0[x0*4+c] + row0[x1*4+c] + row1[x0*4+c] + row1[x1*4+c] + 2)>>2;
+			}
+		}
+	}
+}
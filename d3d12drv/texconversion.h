@@ -17,19 +17,48 @@ private:
 	{
 		bool supported; /**< Is format supported by us */
 		char blocksize; /**< Block size for compressed textures */
+		char texelSize; /**< Bytes per texel for uncompressed formats */
 		bool directAssign; /**< No conversion and temporary storage needed */
 		DXGI_FORMAT d3dFormat; /**< D3D format to use when creating texture */
 		void (*conversionFunc)(FTextureInfo&, DWORD, void *, int);	/**< Conversion function to use if no direct assignment possible */
 	};
 	static TexConversion::TextureFormat formats[];
+	static TexConversion::TextureFormat compactBGRA7Format;
+	static TexConversion::TextureFormat grayPalettedFormat;
+	static TexConversion::TextureFormat grayRGBA8Format;
 
 	/**@name Format conversion functions */
 	//@{
 	static void fromPaletted(FTextureInfo& Info,DWORD PolyFlags,void *target, int mipLevel);
 	static void fromBGRA7(FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel);
+	static void toCompactBGRA7(FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel);
+	static void fromPalettedGray(FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel);
+	static void fromRGBA8Gray(FTextureInfo& Info,DWORD PolyFlags,void *target,int mipLevel);
 	//@}
 
+	static TextureFormat &chooseFormat(FTextureInfo& Info,DWORD PolyFlags,D3D::TextureMetaData &metadata);
+	static bool alphaIsUniform(FTextureInfo& Info,BYTE &alpha);
+	static bool isGrayscale(FTextureInfo& Info,BYTE &alpha);
+
 	static void convertMip(FTextureInfo& Info,TextureFormat &format, DWORD PolyFlags,int mipLevel, D3D11_SUBRESOURCE_DATA &data);
+
+	/**@name Mipmap generation */
+	//@{
+	/** One level of the mip chain to be filtered down from the level above; processed in blocks of rows */
+	struct MipJob
+	{
+		const BYTE *src;
+		UINT srcPitch;
+		int srcWidth;
+		int srcHeight;
+		BYTE *dst;
+		int dstWidth;
+		int dstHeight;
+	};
+	static int numMipLevels(int width, int height);
+	static int generateMips(int width, int height, D3D11_SUBRESOURCE_DATA *data);
+	static void boxFilterRows(void *param, int item);
+	//@}
 	
 public:
 	static void convertAndCache(FTextureInfo& Info, DWORD PolyFlags);
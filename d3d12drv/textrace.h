@@ -0,0 +1,38 @@
+/**
+\file textrace.h
+Binary texture cache trace format. Written by the D3D class when tracing is on (TexTrace console command), read by Tools/texcachesim.
+Kept free of Windows and engine types so the tool builds anywhere.
+
+A trace is a TexTraceHeader followed by TexTraceRecords, little endian, packed.
+A TEXTRACE_FRAME record starts each frame; binds, creations and deletions that follow belong to it.
+Version 2 added TEXTRACE_DELETE; version 1 traces are the same without those records.
+*/
+
+#pragma once
+
+#define TEXTRACE_MAGIC 0x52545854 /**< "TXTR" */
+#define TEXTRACE_VERSION 2
+
+/** Record types */
+enum TexTraceRecordType
+{
+	TEXTRACE_FRAME, /**< value is the frame number */
+	TEXTRACE_BIND, /**< Texture bound; value is its size in bytes */
+	TEXTRACE_CREATE, /**< Texture created or recreated; value is its size in bytes */
+	TEXTRACE_DELETE /**< Texture deleted by the engine or thrown out when the cache is flushed; value is its size in bytes */
+};
+
+#pragma pack(push,1)
+struct TexTraceHeader
+{
+	unsigned int magic;
+	unsigned int version;
+};
+
+struct TexTraceRecord
+{
+	unsigned char type; /**< TexTraceRecordType */
+	unsigned long long id; /**< CacheID; 0 for frame records */
+	unsigned int value;
+};
+#pragma pack(pop)
@@ -21,10 +21,27 @@ float4 directCopy(float2 coords, Texture2DMS<float4,SAMPLES> tex)
 
 #include "unreal_pom.fx"
 
+/** Convert a lightmap or fog map sample to RGBA in the 8 bit range. 32 bit maps are BGRA 7 bit; compact ones are RGB scaled to the full range, without alpha. */
+float4 decodeBGRA7(float4 sample, int pass)
+{
+	if(passFormat[pass]==SHADERFMT_BGRA7_COMPACT)
+		return float4(sample.rgb,passAlpha[pass]);
+	return sample.bgra*2;
+}
+
+/** Expand single channel textures; other formats are returned as is. */
+float4 decodeRGBA(float4 sample, int pass)
+{
+	if(passFormat[pass]==SHADERFMT_GRAY)
+		return float4(sample.rrr,passAlpha[pass]);
+	return sample;
+}
+
 //--------------------------------------------------------------------------------------
 // Vertex Shader
 //--------------------------------------------------------------------------------------
-GS_INPUT VS( VS_INPUT input )
+/** Shared by the vertex shaders of all vertex formats; formats without some attributes pass defaults, which the compiler folds away */
+GS_INPUT transformVertex( VS_INPUT input )
 {
 	GS_INPUT output = (GS_INPUT)0;
 
@@ -103,6 +120,73 @@ GS_INPUT VS( VS_INPUT input )
 	return output;
 }
 
+/** Full vertex */
+GS_INPUT VS( VS_INPUT input )
+{
+	return transformVertex(input);
+}
+
+/** Map surfaces; world space, white, unfogged, all texture passes */
+GS_INPUT VS_World( VS_INPUT_WORLD input )
+{
+	VS_INPUT v = (VS_INPUT)0;
+	v.pos = mul(float4(input.pos.xyz,1),view);
+	v.color = float4(1,1,1,1);
+	for(int i=0;i<NUM_TEXTURE_PASSES;i++)
+	{
+		float4 scaleBias = asfloat(surfaceTable.Load4(input.surface+16*i));
+		v.tex[i] = input.tex*scaleBias.xy+scaleBias.zw;
+	}
+	v.flags = input.flags;
+	return transformVertex(v);
+}
+
+/** Models and fog surfaces; diffuse texture only */
+GS_INPUT VS_Mesh( VS_INPUT_MESH input )
+{
+	VS_INPUT v = (VS_INPUT)0;
+	v.pos = input.pos;
+	v.color = input.color;
+	v.fog = input.fog;
+	v.tex[0] = input.tex;
+	v.flags = input.flags;
+	return transformVertex(v);
+}
+
+/** Tiles sent as one instance each; the corner comes from the quad's vertex index */
+GS_INPUT VS_TileInstance( VS_INPUT_TILE_INSTANCE input )
+{
+	VS_INPUT v = (VS_INPUT)0;
+	bool right = input.corner==1 || input.corner==2;
+	bool bottom = input.corner>=2;
+	v.pos = float4(right ? input.rect.z : input.rect.x, bottom ? input.rect.w : input.rect.y, input.z, 1);
+	v.color = input.color;
+	v.fog = input.fog;
+	v.tex[0] = float2(right ? input.texRect.z : input.texRect.x, bottom ? input.texRect.w : input.texRect.y);
+	v.flags = input.flags;
+	return transformVertex(v);
+}
+
+/** Editor lines */
+GS_INPUT VS_Line( VS_INPUT_LINE input )
+{
+	VS_INPUT v = (VS_INPUT)0;
+	v.pos = input.pos;
+	v.color = input.color;
+	return transformVertex(v);
+}
+
+/** Editor points, sent as one instance each like tiles */
+GS_INPUT VS_PointInstance( VS_INPUT_POINT_INSTANCE input )
+{
+	VS_INPUT v = (VS_INPUT)0;
+	bool right = input.corner==1 || input.corner==2;
+	bool bottom = input.corner>=2;
+	v.pos = float4(right ? input.rect.z : input.rect.x, bottom ? input.rect.w : input.rect.y, input.z, 1);
+	v.color = input.color;
+	return transformVertex(v);
+}
+
 
 //--------------------------------------------------------------------------------------
 // Geometry Shader
@@ -155,6 +239,28 @@ void GS( triangle GS_INPUT input[3], inout TriangleStream <PS_INPUT> triStream )
 	triStream.RestartStrip();
 }
 
+/** Lines have no texture space to work out; their vertices are passed on as they are */
+[maxvertexcount(2)]
+void GS_Line( line GS_INPUT input[2], inout LineStream <PS_INPUT> lineStream )
+{
+	PS_INPUT output = (PS_INPUT)0;
+	for(int i=0; i<2; i++ )
+	{
+		output.pos = input[i].pos;
+		output.fog = input[i].fog;
+		for(int j=0;j<NUM_TEXTURE_PASSES;j++)
+		{
+			output.tex[j] = input[i].tex[j];
+		}
+		output.texCentroid=input[i].tex[0];
+		output.flags = input[i].flags;
+		output.origPos = input[i].origPos;
+		output.color = input[i].color;
+		lineStream.Append(output);
+	}
+	lineStream.RestartStrip();
+}
+
 //--------------------------------------------------------------------------------------
 // Pixel Shader
 //--------------------------------------------------------------------------------------
@@ -173,8 +279,8 @@ PS_OUTPUT PS( PS_INPUT input)
 	//Handle texture passes
 	if(useTexturePass[0]) //Diffuse
 	{
-		diffuse = textures[0].SampleBias(sam,input.tex[0],LODBIAS);
-		float4 diffusePoint = textures[0].SampleBias(samPoint,input.texCentroid,LODBIAS); //Centroid sampling for better behaviour with AA
+		diffuse = decodeRGBA(textures[0].SampleBias(sam,input.tex[0],LODBIAS),0);
+		float4 diffusePoint = decodeRGBA(textures[0].SampleBias(samPoint,input.texCentroid,LODBIAS),0); //Centroid sampling for better behaviour with AA
 		
 			
 		//Alpha test; point sample to get rid of seams
@@ -195,20 +301,21 @@ PS_OUTPUT PS( PS_INPUT input)
 			//Sample skies a 2nd time for nice effect
 			if(input.flags&PF_AutoUPan || input.flags&PF_AutoVPan) 
 			{
-				diffuse = .5*diffuse+.5*textures[0].SampleBias(sam,input.tex[0]*2,LODBIAS);
+				diffuse = .5*diffuse+.5*decodeRGBA(textures[0].SampleBias(sam,input.tex[0]*2,LODBIAS),0);
 			}
 		}
 	
 	}
 	if(useTexturePass[1]) //Light
 	{
-		light = textures[1].SampleLevel(sam,input.tex[1],0);		
-		light.rgba = light.bgra*2*LIGHT_SCALE; //Convert BGRA 7 bit to RGBA 8 bit	
+		light = textures[1].Sample(sam,input.tex[1]);		
+		light = decodeBGRA7(light,1)*LIGHT_SCALE; //Convert BGRA 7 bit to RGBA 8 bit	
 
 	}
 	if(useTexturePass[2]) //Detail (blend two detail texture samples with no detail for a nice effect).
 	{
 		//Interpolate between no detail and detail depending on how close the object is. Z=380 comes from UT D3D renderer.
+		//The driver leaves the pass off for surfaces entirely beyond it (DETAIL_FADE_DISTANCE); keep the two the same.
 		const int zFar = 380;
 		float far = saturate(length(input.origPos)/zFar);
 		if(far<1)
@@ -216,18 +323,18 @@ PS_OUTPUT PS( PS_INPUT input)
 			#if(POM_ENABLED==1)
 			input.tex[2] = POM(input.origPos,input.viewTS,input.normal,input.tex[2],input.vParallaxOffsetTS,textures[2]);
 			#endif
-			detail = textures[2].SampleLevel(sam,input.tex[2],0);
+			detail = decodeRGBA(textures[2].SampleLevel(sam,input.tex[2],0),2);
 			detail = lerp(detail,float4(1,1,1,1),far);
 		}	
 	}
 	if(useTexturePass[3]) //Fog
 	{		
-		fogmap = textures[3].SampleLevel(sam,input.tex[3],0);				
-		fogmap.rgba = fogmap.bgra*2*FOG_SCALE; //Convert BGRA 7 bit to RGBA 8 bit
+		fogmap = textures[3].Sample(sam,input.tex[3]);				
+		fogmap = decodeBGRA7(fogmap,3)*FOG_SCALE; //Convert BGRA 7 bit to RGBA 8 bit
 	}
 	if(useTexturePass[4]) //Macro
 	{		
-		macro = textures[4].SampleLevel(sam,input.tex[4],0);
+		macro = decodeRGBA(textures[4].Sample(sam,input.tex[4]),4);
 	}
 		
 	output.color = color*diffuse*light*detail*macro+fogmap+fog;
@@ -265,4 +372,48 @@ technique11 Render
 		//SetDepthStencilState(dstate_Enable,1.0);
 		//SetBlendState(bstate_NoBlend,float4(0,0,0,0),0xffffffff);
 	}
+	
+	//Passes for the compact vertex formats, in D3D::VertexFormat order
+	pass World
+	{
+		SetVertexShader( CompileShader( vs_5_0, VS_World() ) ); //5.0 for the surface table's raw buffer
+		SetGeometryShader( CompileShader( gs_4_0, GS() ) );
+		SetPixelShader( CompileShader( ps_4_0, PS() ) );
+		SetRasterizerState(rstate_Default);
+	}
+	pass Mesh
+	{
+		SetVertexShader( CompileShader( vs_4_0, VS_Mesh() ) );
+		SetGeometryShader( CompileShader( gs_4_0, GS() ) );
+		SetPixelShader( CompileShader( ps_4_0, PS() ) );
+		SetRasterizerState(rstate_Default);
+	}
+	pass Tile
+	{
+		SetVertexShader( CompileShader( vs_4_0, VS_Mesh() ) );
+		SetGeometryShader( CompileShader( gs_4_0, GS() ) );
+		SetPixelShader( CompileShader( ps_4_0, PS() ) );
+		SetRasterizerState(rstate_Default);
+	}
+	pass TileInstance
+	{
+		SetVertexShader( CompileShader( vs_4_0, VS_TileInstance() ) );
+		SetGeometryShader( CompileShader( gs_4_0, GS() ) );
+		SetPixelShader( CompileShader( ps_4_0, PS() ) );
+		SetRasterizerState(rstate_Default);
+	}
+	pass Line
+	{
+		SetVertexShader( CompileShader( vs_4_0, VS_Line() ) );
+		SetGeometryShader( CompileShader( gs_4_0, GS_Line() ) );
+		SetPixelShader( CompileShader( ps_4_0, PS() ) );
+		SetRasterizerState(rstate_Default);
+	}
+	pass PointInstance
+	{
+		SetVertexShader( CompileShader( vs_4_0, VS_PointInstance() ) );
+		SetGeometryShader( CompileShader( gs_4_0, GS() ) );
+		SetPixelShader( CompileShader( ps_4_0, PS() ) );
+		SetRasterizerState(rstate_Default);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,257 @@
+/**
+\class UploadRing
+Persistently mapped upload heap buffer from which per batch vertex and index data is suballocated, replacing the D3D11 style
+WRITE_DISCARD/NO_OVERWRITE mapping of a single fixed buffer.
+
+Allocations are handed out front to back and wrap around at the end; an allocation never straddles the end of the buffer.
+At the end of each frame the position up to which that frame allocated is queued along with the fence value signaled after
+the frame's commands. Once the fence reaches that value the space is reclaimed. The ring is sized for several frames in flight,
+so allocations only wait on the GPU when it falls that far behind; those waits are counted.
+If a single frame fills the ring, waiting doesn't help; the ring then continues in a buffer twice the size. The old buffer is kept
+until the GPU is done with the frame, as data in it is still to be drawn; allocations made from it stay valid.
+*/
+
+#include "include/directx/d3dx12.h"
+#include "uploadring.h"
+#include "d3d12drv.h"
+
+UploadRing::UploadRing() : device(NULL), fence(NULL), fenceEvent(NULL), data(NULL), gpuAddress(0), size(0), head(0), tail(0), lastAlloc(0), frameStart(0), grownBytes(0)
+{
+	ZeroMemory(&stats,sizeof(stats));
+}
+
+/**
+Create and map the ring buffer.
+\param device Device to create the buffer with.
+\param fence Fence that endFrame()'s values are signaled on.
+\param size Size in bytes.
+\return false on failure.
+*/
+bool UploadRing::init(ID3D12Device *device, ID3D12Fence *fence, UINT64 size)
+{
+	this->device = device;
+	if(!createBuffer(size))
+		return false;
+
+	fenceEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+	this->fence = fence;
+	head = tail = lastAlloc = frameStart = grownBytes = 0;
+	frames.clear();
+	retired.clear();
+	ZeroMemory(&stats,sizeof(stats));
+	stats.size = size;
+	return true;
+}
+
+/**
+Create and map a buffer for the ring to continue in. The current buffer is only replaced on success.
+\param size Size in bytes.
+\return false on failure.
+*/
+bool UploadRing::createBuffer(UINT64 size)
+{
+	HRESULT hr;
+	Microsoft::WRL::ComPtr<ID3D12Resource> newBuffer;
+	hr = device->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(size),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(newBuffer.GetAddressOf())
+	);
+	if(FAILED(hr))
+	{
+		UD3D12RenderDevice::debugs("Error creating upload ring buffer.");
+		return false;
+	}
+
+	//Upload heaps can stay mapped for their whole lifetime; the CPU never reads, so an empty read range is passed
+	BYTE *newData;
+	CD3DX12_RANGE readRange(0,0);
+	hr = newBuffer->Map(0,&readRange,(void**)&newData);
+	if(FAILED(hr))
+	{
+		UD3D12RenderDevice::debugs("Error mapping upload ring buffer.");
+		return false;
+	}
+
+	buffer = newBuffer;
+	data = newData;
+	gpuAddress = buffer->GetGPUVirtualAddress();
+	this->size = size;
+	return true;
+}
+
+/**
+Continue in a larger buffer because the current frame alone fills the ring. Earlier frames' data is in the old buffer too, and the GPU
+is done with it before it's done with this frame, so the old buffer can be released along with this frame's space.
+\param bytes Size of the allocation that didn't fit.
+\return false if the buffer couldn't be created; the ring stays as it was.
+*/
+bool UploadRing::grow(UINT64 bytes)
+{
+	UINT64 newSize = size*2;
+	while(newSize<bytes)
+		newSize *= 2;
+	UploadRing::Retired old = {buffer,0};
+	if(!createBuffer(newSize))
+		return false;
+	retired.push_back(old);
+
+	grownBytes += head-frameStart;
+	head = tail = lastAlloc = frameStart = 0;
+	frames.clear();
+	stats.size = newSize;
+	stats.growths++;
+
+	char message[128];
+	sprintf_s(message,sizeof(message),"Upload ring grown to %I64u KB.",newSize/1024);
+	UD3D12RenderDevice::debugs(message);
+	return true;
+}
+
+/**
+Release the buffer. The GPU must be done with it.
+*/
+void UploadRing::uninit()
+{
+	if(buffer)
+		buffer->Unmap(0,NULL);
+	buffer.Reset();
+	retired.clear();
+	if(fenceEvent)
+		CloseHandle(fenceEvent);
+	fenceEvent = NULL;
+	data = NULL;
+	frames.clear();
+}
+
+/**
+Allocate space.
+\param bytes Size of the allocation.
+\param gpuAddress Set to the GPU virtual address of the allocation.
+\return CPU address to write the data to, or NULL if the ring had to grow and the larger buffer couldn't be created.
+*/
+BYTE *UploadRing::alloc(UINT64 bytes, D3D12_GPU_VIRTUAL_ADDRESS &gpuAddress)
+{
+	if(data==NULL)
+		return NULL;
+	bytes = (bytes+ALIGNMENT-1)&~(ALIGNMENT-1);
+	if(bytes>size && !grow(bytes))
+	{
+		stats.failures++;
+		return NULL;
+	}
+
+	reclaim();
+	if(head==tail) //Empty; restart at the beginning so the whole ring is available
+	{
+		head = tail = lastAlloc = ((head+size-1)/size)*size;
+	}
+
+	//Skip the rest of the buffer if the allocation doesn't fit before the end
+	UINT64 offset = head%size;
+	UINT64 start = offset+bytes>size ? head+size-offset : head;
+	while(start+bytes-tail>size)
+	{
+		if(!waitForOldestFrame())
+		{
+			if(!grow(bytes))
+			{
+				stats.failures++;
+				return NULL;
+			}
+			start = head;
+			break;
+		}
+	}
+
+	lastAlloc = start;
+	head = start+bytes;
+	if(head-tail>stats.peak)
+		stats.peak = head-tail;
+
+	gpuAddress = this->gpuAddress+start%size;
+	return data+start%size;
+}
+
+/**
+Shrink the most recent allocation, returning the unused part to the ring.
+\param allocation CPU address alloc() returned; if anything was allocated after it, nothing is done.
+\param bytes New size of the allocation; can't be larger than it was.
+*/
+void UploadRing::shrink(const BYTE *allocation, UINT64 bytes)
+{
+	if(data==NULL || allocation!=data+lastAlloc%size)
+		return;
+	bytes = (bytes+ALIGNMENT-1)&~(ALIGNMENT-1);
+	if(lastAlloc+bytes<head)
+		head = lastAlloc+bytes;
+}
+
+/**
+Mark the end of a frame.
+\param fenceValue Value that the fence will be signaled with once the GPU is done with the frame's commands.
+*/
+void UploadRing::endFrame(UINT64 fenceValue)
+{
+	if(head!=frameStart)
+	{
+		UploadRing::Frame f = {fenceValue,head};
+		frames.push_back(f);
+	}
+	stats.frameBytes = grownBytes+head-frameStart;
+	frameStart = head;
+	grownBytes = 0;
+	for(std::vector<UploadRing::Retired>::iterator i=retired.begin();i!=retired.end();i++)
+	{
+		if(i->fenceValue==0)
+			i->fenceValue = fenceValue;
+	}
+	reclaim();
+	stats.used = head-tail;
+	stats.framesInFlight = (int)frames.size();
+}
+
+/**
+Free the space of frames the GPU has finished, and the buffers that were replaced before them.
+*/
+void UploadRing::reclaim()
+{
+	UINT64 completed = fence->GetCompletedValue();
+	while(!frames.empty() && frames.front().fenceValue<=completed)
+	{
+		tail = frames.front().end;
+		frames.pop_front();
+	}
+	while(!retired.empty() && retired.front().fenceValue!=0 && retired.front().fenceValue<=completed)
+	{
+		retired.erase(retired.begin());
+	}
+}
+
+/**
+Block until the GPU finishes the oldest frame in flight, then reclaim its space.
+\return false if there's no frame to wait for; i.e. the current frame alone fills the ring.
+*/
+bool UploadRing::waitForOldestFrame()
+{
+	if(frames.empty())
+		return false;
+
+	LARGE_INTEGER start, end, freq;
+	QueryPerformanceCounter(&start);
+	if(fence->GetCompletedValue()<frames.front().fenceValue)
+	{
+		fence->SetEventOnCompletion(frames.front().fenceValue,fenceEvent);
+		WaitForSingleObject(fenceEvent,INFINITE);
+	}
+	QueryPerformanceCounter(&end);
+	QueryPerformanceFrequency(&freq);
+
+	stats.waits++;
+	stats.waitTime += (end.QuadPart-start.QuadPart)*1000.0/freq.QuadPart;
+	reclaim();
+	return true;
+}
@@ -0,0 +1,76 @@
+/**
+\file uploadring.h
+*/
+
+#pragma once
+#include <d3d12.h>
+#include <wrl.h>
+#include <deque>
+#include <vector>
+
+class UploadRing
+{
+public:
+	/** Ring usage counters */
+	struct Stats
+	{
+		UINT64 size; /**< Ring size in bytes */
+		UINT64 used; /**< Bytes in use (not yet reclaimed) at the end of the last frame */
+		UINT64 peak; /**< Most bytes ever in use */
+		UINT64 frameBytes; /**< Bytes allocated in the last frame */
+		int framesInFlight; /**< Frames whose data the GPU may still be reading, at the end of the last frame */
+		DWORD waits; /**< Times an allocation had to wait for the GPU */
+		double waitTime; /**< Total time spent waiting, in milliseconds */
+		DWORD growths; /**< Times the ring was replaced by a larger buffer because a single frame filled it */
+		DWORD failures; /**< Allocations that failed because no larger buffer could be created */
+	};
+
+	UploadRing();
+
+	bool init(ID3D12Device *device, ID3D12Fence *fence, UINT64 size);
+	void uninit();
+
+	BYTE *alloc(UINT64 bytes, D3D12_GPU_VIRTUAL_ADDRESS &gpuAddress);
+	void shrink(const BYTE *allocation, UINT64 bytes);
+	void endFrame(UINT64 fenceValue);
+	const UploadRing::Stats &getStats() const { return stats; }
+	ID3D12Resource *getResource() const { return buffer.Get(); }
+
+private:
+	/** Where a frame's allocations end in the ring, and the fence value that is signaled once the GPU is done with them */
+	struct Frame
+	{
+		UINT64 fenceValue;
+		UINT64 end;
+	};
+
+	/** A buffer replaced by a larger one; kept until the GPU is done with the frames that used it */
+	struct Retired
+	{
+		Microsoft::WRL::ComPtr<ID3D12Resource> buffer;
+		UINT64 fenceValue; /**< 0 until the frame that replaced it has ended */
+	};
+
+	bool createBuffer(UINT64 size);
+	bool grow(UINT64 bytes);
+	void reclaim();
+	bool waitForOldestFrame();
+
+	static const UINT64 ALIGNMENT = 256; /**< Allocation alignment; satisfies constant buffer placement as well as vertex and index data */
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> buffer;
+	ID3D12Device *device;
+	ID3D12Fence *fence;
+	HANDLE fenceEvent;
+	BYTE *data; /**< Persistently mapped CPU address */
+	D3D12_GPU_VIRTUAL_ADDRESS gpuAddress;
+	UINT64 size;
+	UINT64 head; /**< Allocation position; head and tail keep counting up, the ring offset is the position modulo size */
+	UINT64 tail; /**< Start of the oldest data the GPU may still read */
+	UINT64 lastAlloc; /**< Start of the most recent allocation, for shrink() */
+	UINT64 frameStart; /**< Head at the end of the previous frame */
+	UINT64 grownBytes; /**< Bytes allocated this frame from buffers that have since been replaced */
+	std::deque<UploadRing::Frame> frames; /**< Submitted frames not yet known to be finished, oldest first */
+	std::vector<UploadRing::Retired> retired;
+	UploadRing::Stats stats;
+};
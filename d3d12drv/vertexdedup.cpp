@@ -0,0 +1,94 @@
+/**
+\class VertexDedup
+Remembers which batch vertex was made from which engine point, so polygons sharing a corner can reference one vertex by index.
+
+The engine passes polygons as arrays of pointers to transformed points; polygons of a BSP facet, and fans of a mesh, point at the same
+ones for shared corners. This is a small open addressing table keyed by that pointer, with linear probing.
+A check value is stored along with each entry for callers whose points get reused for other data (mesh points are a per-frame pool);
+a lookup only hits if it matches, so a stale entry is never used.
+Clearing is done by bumping a generation counter, so it costs nothing however often it's done.
+*/
+
+#include "vertexdedup.h"
+
+VertexDedup::VertexDedup() : generation(1), count(0)
+{
+	ZeroMemory(entries,sizeof(entries));
+}
+
+/**
+Forget all vertices. Needed whenever the batch vertices can no longer be referenced, see D3D::beginSharedFan().
+*/
+void VertexDedup::clear()
+{
+	generation++;
+	count = 0;
+	if(generation==0) //Wrapped; entries from long ago could look current
+	{
+		ZeroMemory(entries,sizeof(entries));
+		generation = 1;
+	}
+}
+
+/**
+\return Where probing for a point starts.
+*/
+UINT VertexDedup::slot(const void *point)
+{
+	//Points are structs in arrays, so the low bits say little; multiplicative hash, taking the well mixed top bits
+	return ((UINT)(((UINT_PTR)point)>>3)*2654435761u)>>(32-SIZE_BITS);
+}
+
+/**
+Look up the vertex for a point.
+\param point Engine point.
+\param check Must match the value the vertex was inserted with.
+\param vertex Receives the vertex index.
+\return Whether the vertex was found.
+*/
+bool VertexDedup::find(const void *point, UINT64 check, UINT &vertex) const
+{
+	for(UINT i=slot(point);;i=(i+1)&(SIZE-1))
+	{
+		const VertexDedup::Entry &e = entries[i];
+		if(e.generation!=generation)
+			return false;
+		if(e.point==point)
+		{
+			if(e.check!=check)
+				return false;
+			vertex = e.vertex;
+			return true;
+		}
+	}
+}
+
+/**
+Remember the vertex for a point, replacing any earlier one. If the table is full it's cleared first; the vertices just buffered are the
+ones most likely to be shared.
+\param point Engine point.
+\param check Value a lookup has to match.
+\param vertex Vertex index.
+*/
+void VertexDedup::insert(const void *point, UINT64 check, UINT vertex)
+{
+	if(count>=MAX_ENTRIES)
+		clear();
+	for(UINT i=slot(point);;i=(i+1)&(SIZE-1))
+	{
+		VertexDedup::Entry &e = entries[i];
+		if(e.generation!=generation)
+		{
+			count++;
+		}
+		else if(e.point!=point)
+		{
+			continue;
+		}
+		e.point = point;
+		e.check = check;
+		e.vertex = vertex;
+		e.generation = generation;
+		return;
+	}
+}
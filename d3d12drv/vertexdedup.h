@@ -0,0 +1,36 @@
+/**
+\file vertexdedup.h
+*/
+
+#pragma once
+#include <windows.h>
+
+class VertexDedup
+{
+public:
+	static const UINT SIZE_BITS = 10;
+	static const UINT SIZE = 1<<SIZE_BITS; /**< Table entries */
+	static const UINT MAX_ENTRIES = SIZE*3/4; /**< Fill limit; past it, the table starts over */
+
+	VertexDedup();
+
+	void clear();
+	bool find(const void *point, UINT64 check, UINT &vertex) const;
+	void insert(const void *point, UINT64 check, UINT vertex);
+
+private:
+	/** A remembered vertex */
+	struct Entry
+	{
+		const void *point; /**< Engine point the vertex was made from */
+		UINT64 check; /**< Caller's check value; a lookup only matches if it's the same */
+		UINT vertex; /**< Vertex index in the batch */
+		DWORD generation; /**< Entry is only in use if this matches the table's */
+	};
+
+	static UINT slot(const void *point);
+
+	VertexDedup::Entry entries[SIZE];
+	DWORD generation; /**< Bumped by clear(), which makes all entries unused without touching them */
+	UINT count;
+};
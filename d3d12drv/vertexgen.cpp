@@ -0,0 +1,378 @@
+/**
+\class VertexGen
+Builds map surface vertices with SSE, 4 floats at a time.
+
+Everything in a world vertex follows from the engine's view space point through an affine function: the position is the point moved back to world space,
+and the texture coordinates are dot products with the map axes. Each pass' coordinates are those panned and scaled, which the vertex shader does from
+the surface's D3D::SurfacePasses. setupWorld() folds those steps into one set of coefficients per
+vertex float for a surface, laid out in the vertex' own order. generateWorld() then splats each point's x, y and z and evaluates 4 floats
+per instruction, so results come out in vertex order and are written front to back, 16 bytes at a time, without any shuffling.
+Evaluating 4 vertices at once instead (structure of arrays) needs transposes in and out and more registers than 32 bit x86 has,
+which made it slower.
+generateWorldScalar() is the previous per vertex loop, kept as a reference for benchmark().
+
+Vertices can also be queued: queueWorld() copies the points and remembers where the vertices go, and runQueue() generates everything
+queued at the end of the frame, split over the worker threads. The game thread then only reserves room and copies points.
+API independent.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <emmintrin.h>
+#include <vector>
+#include "vertexgen.h"
+#include "workers.h"
+
+std::vector<VertexGen::QueuedTransform> VertexGen::queuedTransforms;
+std::vector<VertexGen::QueuedFan> VertexGen::queuedFans;
+std::vector<D3D::Vec3> VertexGen::queuedPoints;
+std::vector<double> VertexGen::itemTimes;
+VertexGen::QueueStats VertexGen::queueStats;
+VertexGen::QueueStats VertexGen::lastQueueStats;
+
+C_ASSERT(sizeof(D3D::WorldVertex)==7*sizeof(float)); //generateWorld() writes the vertex as 5 floats, the flags and the surface offset
+
+/**
+Work out the coefficients for a surface.
+\param surface The surface.
+\param transform Receives the coefficients. The surface offset is 0; see setSurfaceOffset().
+\param passes Receives the per pass texture coordinate transforms, for D3D::setSurface().
+*/
+void VertexGen::setupWorld(const VertexGen::Surface &surface, VertexGen::WorldTransform &transform, D3D::SurfacePasses &passes)
+{
+	FLOAT c[WorldTransform::NUM_OUTPUTS][4];
+
+	//Position: (p-origin).axis
+	for(int a=0;a<3;a++)
+	{
+		const D3D::Vec3 &axis = surface.viewAxes[a];
+		c[a][0] = axis.x;
+		c[a][1] = axis.y;
+		c[a][2] = axis.z;
+		c[a][3] = -(axis.x*surface.viewOrigin.x+axis.y*surface.viewOrigin.y+axis.z*surface.viewOrigin.z);
+	}
+
+	//Texture coordinates: p.mapAxis-dot
+	FLOAT *u = c[3];
+	FLOAT *v = c[4];
+	u[0] = surface.mapXAxis.x;
+	u[1] = surface.mapXAxis.y;
+	u[2] = surface.mapXAxis.z;
+	u[3] = -surface.uDot;
+	v[0] = surface.mapYAxis.x;
+	v[1] = surface.mapYAxis.y;
+	v[2] = surface.mapYAxis.z;
+	v[3] = -surface.vDot;
+
+	//Per pass: (coordinate-pan)*mult+offset
+	for(int i=0;i<D3D::DUMMY_NUM_PASSES;i++)
+	{
+		const VertexGen::Pass &p = surface.passes[i];
+		D3D::Vec4 &t = passes.pass[i];
+		if(!p.enabled)
+		{
+			t.x = t.y = t.z = t.w = 0;
+			continue;
+		}
+		t.x = p.multU;
+		t.y = p.multV;
+		t.z = p.offsetU-p.panU*p.multU;
+		t.w = p.offsetV-p.panV*p.multV;
+	}
+
+	for(int b=0;b<WorldTransform::NUM_BLOCKS;b++)
+	{
+		for(int j=0;j<4;j++)
+		{
+			FLOAT block[4];
+			for(int k=0;k<4;k++)
+			{
+				block[k] = 4*b+k<WorldTransform::NUM_OUTPUTS ? c[4*b+k][j] : 0;
+			}
+			transform.coeffs[b][j] = _mm_loadu_ps(block);
+		}
+	}
+	transform.flags = surface.flags;
+	setSurfaceOffset(transform,0);
+}
+
+/**
+Write a world vertex.
+\param transform Coefficients from setupWorld().
+\param point View space point.
+\param out Vertex to write.
+*/
+inline void VertexGen::generateVertex(const VertexGen::WorldTransform &transform, const D3D::Vec3 &point, D3D::WorldVertex *out)
+{
+	const __m128 (*c)[4] = transform.coeffs;
+	__m128 x = _mm_set1_ps(point.x);
+	__m128 y = _mm_set1_ps(point.y);
+	__m128 z = _mm_set1_ps(point.z);
+	__m128 r[WorldTransform::NUM_BLOCKS];
+	for(int b=0;b<WorldTransform::NUM_BLOCKS;b++)
+	{
+		r[b] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[b][0],x),_mm_mul_ps(c[b][1],y)),_mm_add_ps(_mm_mul_ps(c[b][2],z),c[b][3]));
+	}
+
+	FLOAT *v = (FLOAT*)out;
+	_mm_storeu_ps(v,r[0]);
+	__m128 last = _mm_move_ss(transform.tail,r[1]); //Last output, then the flags and surface offset
+	_mm_storel_pi((__m64*)(v+4),last);
+	_mm_store_ss(v+6,_mm_movehl_ps(last,last));
+}
+
+/**
+Write world vertices for a fan.
+\param transform Coefficients from setupWorld().
+\param points View space points.
+\param num Number of points.
+\param out Vertices to write; num of them.
+*/
+void VertexGen::generateWorld(const VertexGen::WorldTransform &transform, const D3D::Vec3 *const *points, int num, D3D::WorldVertex *out)
+{
+	for(int i=0;i<num;i++)
+	{
+		generateVertex(transform,*points[i],&out[i]);
+	}
+}
+
+/**
+Start queueing fans of another surface.
+\param transform Coefficients from setupWorld(); the surface offset is given per fan instead.
+*/
+void VertexGen::queueSurface(const VertexGen::WorldTransform &transform)
+{
+	VertexGen::QueuedTransform t;
+	for(int b=0;b<WorldTransform::NUM_BLOCKS;b++)
+	{
+		for(int j=0;j<4;j++)
+		{
+			_mm_storeu_ps(t.coeffs[b][j],transform.coeffs[b][j]);
+		}
+	}
+	t.flags = transform.flags;
+	queuedTransforms.push_back(t);
+}
+
+/**
+Queue world vertices of the surface last passed to queueSurface(), to be written by runQueue().
+\param points View space points; copied, so they don't have to stay valid.
+\param num Number of points.
+\param surfaceOffset See D3D::getSurfaceOffset().
+\param out Where the vertices go; must stay valid until runQueue(). See D3D::reserveWorldVertices().
+*/
+void VertexGen::queueWorld(const D3D::Vec3 *const *points, int num, DWORD surfaceOffset, D3D::WorldVertex *out)
+{
+	VertexGen::QueuedFan f = {queuedTransforms.size()-1,queuedPoints.size(),num,surfaceOffset,out};
+	queuedFans.push_back(f);
+	for(int i=0;i<num;i++)
+	{
+		queuedPoints.push_back(*points[i]);
+	}
+	queueStats.vertices += num;
+	queueStats.fans++;
+}
+
+/**
+Generate one part of the queued fans; a Workers job item.
+\param param Number of items.
+\param item Item index.
+*/
+void VertexGen::runQueueItem(void *param, int item)
+{
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	int numItems = (int)(INT_PTR)param;
+	UINT first = (UINT)((UINT64)queuedFans.size()*item/numItems);
+	UINT last = (UINT)((UINT64)queuedFans.size()*(item+1)/numItems);
+	VertexGen::WorldTransform transform;
+	UINT loaded = UINT_MAX;
+	for(UINT i=first;i<last;i++)
+	{
+		const VertexGen::QueuedFan &f = queuedFans[i];
+		if(f.transform!=loaded)
+		{
+			const VertexGen::QueuedTransform &t = queuedTransforms[f.transform];
+			for(int b=0;b<WorldTransform::NUM_BLOCKS;b++)
+			{
+				for(int j=0;j<4;j++)
+				{
+					transform.coeffs[b][j] = _mm_loadu_ps(t.coeffs[b][j]);
+				}
+			}
+			transform.flags = t.flags;
+			loaded = f.transform;
+		}
+		setSurfaceOffset(transform,f.surfaceOffset);
+		const D3D::Vec3 *points = &queuedPoints[f.firstPoint];
+		for(UINT p=0;p<f.numPoints;p++)
+		{
+			generateVertex(transform,points[p],&f.out[p]);
+		}
+	}
+
+	QueryPerformanceCounter(&end);
+	itemTimes[item] = (double)(end.QuadPart-start.QuadPart)*1000.0/(double)frequency.QuadPart;
+}
+
+/**
+Generate all queued vertices and empty the queue; call this once per frame, before the GPU uses the vertices.
+\param parallel Whether to split the work over the worker threads.
+*/
+void VertexGen::runQueue(bool parallel)
+{
+	const UINT MIN_ITEM_FANS = 64; //Fewer fans than this per item aren't worth waking a thread for
+	const int ITEMS_PER_THREAD = 4; //Items are handed out as threads finish, which evens out the load
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	int numItems = parallel ? (Workers::getNumThreads()+1)*ITEMS_PER_THREAD : 1;
+	if((UINT)numItems>queuedFans.size()/MIN_ITEM_FANS)
+		numItems = max(1,(int)(queuedFans.size()/MIN_ITEM_FANS));
+	itemTimes.assign(numItems,0.0);
+	if(!queuedFans.empty())
+		Workers::run(&VertexGen::runQueueItem,(void*)(INT_PTR)numItems,numItems);
+
+	QueryPerformanceCounter(&end);
+	queueStats.items = queuedFans.empty() ? 0 : numItems;
+	queueStats.runTime = (double)(end.QuadPart-start.QuadPart)*1000.0/(double)frequency.QuadPart;
+	queueStats.workTime = 0;
+	for(int i=0;i<numItems;i++)
+	{
+		queueStats.workTime += itemTimes[i];
+	}
+	lastQueueStats = queueStats;
+	ZeroMemory(&queueStats,sizeof(queueStats));
+	queuedTransforms.clear();
+	queuedFans.clear();
+	queuedPoints.clear();
+}
+
+/**
+\return Counters for the vertices queued in the last frame.
+*/
+const VertexGen::QueueStats &VertexGen::getQueueStats()
+{
+	return lastQueueStats;
+}
+
+/**
+Write world vertices for a fan one by one, the way DrawComplexSurface() used to. The surface offset is 0.
+\param surface The surface.
+\param points View space points.
+\param num Number of points.
+\param out Vertices to write; num of them.
+*/
+void VertexGen::generateWorldScalar(const VertexGen::Surface &surface, const D3D::Vec3 *const *points, int num, D3D::WorldVertex *out)
+{
+	for(int i=0;i<num;i++)
+	{
+		const D3D::Vec3 &p = *points[i];
+		D3D::WorldVertex *v = &out[i];
+		v->TexCoord.x = surface.mapXAxis.x*p.x+surface.mapXAxis.y*p.y+surface.mapXAxis.z*p.z-surface.uDot;
+		v->TexCoord.y = surface.mapYAxis.x*p.x+surface.mapYAxis.y*p.y+surface.mapYAxis.z*p.z-surface.vDot;
+		v->flags = surface.flags;
+		v->surface = 0;
+		D3D::Vec3 d = {p.x-surface.viewOrigin.x,p.y-surface.viewOrigin.y,p.z-surface.viewOrigin.z};
+		v->Pos.x = d.x*surface.viewAxes[0].x+d.y*surface.viewAxes[0].y+d.z*surface.viewAxes[0].z;
+		v->Pos.y = d.x*surface.viewAxes[1].x+d.y*surface.viewAxes[1].y+d.z*surface.viewAxes[1].z;
+		v->Pos.z = d.x*surface.viewAxes[2].x+d.y*surface.viewAxes[2].y+d.z*surface.viewAxes[2].z;
+	}
+}
+
+/**
+Time both vertex paths on made up surfaces: fans of 3 to 9 points, 8 fans per surface, all texture passes in use.
+\param numVertices Vertices per iteration.
+\param iterations Times to generate them all.
+\param scalarNs Receives nanoseconds per vertex for generateWorldScalar().
+\param vectorNs Receives nanoseconds per vertex for generateWorld(), including setupWorld() for each surface.
+\param maxError Receives the largest difference between the two paths' floats.
+*/
+void VertexGen::benchmark(int numVertices, int iterations, double &scalarNs, double &vectorNs, float &maxError)
+{
+	const int FANS_PER_SURFACE = 8;
+	srand(1);
+	std::vector<D3D::Vec3> points(numVertices);
+	std::vector<const D3D::Vec3*> pointers(numVertices);
+	for(int i=0;i<numVertices;i++)
+	{
+		points[i].x = (FLOAT)(rand()%8192-4096);
+		points[i].y = (FLOAT)(rand()%8192-4096);
+		points[i].z = (FLOAT)(rand()%8192);
+		pointers[i] = &points[i];
+	}
+	std::vector<int> fans;
+	for(int left=numVertices;left>0;)
+	{
+		int n = min(3+(int)fans.size()%7,left);
+		fans.push_back(n);
+		left -= n;
+	}
+
+	VertexGen::Surface surface;
+	D3D::Vec3 x = {0.6f,0.8f,0}, y = {0,0,1}, o = {512,-256,128}, a0 = {0.8f,-0.6f,0}, a1 = {0,0,1}, a2 = {0.6f,0.8f,0};
+	surface.mapXAxis = x;
+	surface.mapYAxis = y;
+	surface.uDot = 37.0f;
+	surface.vDot = -12.0f;
+	surface.viewOrigin = o;
+	surface.viewAxes[0] = a0;
+	surface.viewAxes[1] = a1;
+	surface.viewAxes[2] = a2;
+	surface.flags = 0;
+	for(int i=0;i<D3D::DUMMY_NUM_PASSES;i++)
+	{
+		VertexGen::Pass p = {true,(FLOAT)(i*16),(FLOAT)(-i*8),1.0f/(64<<i),1.0f/(64<<i),i==1 ? 0.25f : 0.0f,i==1 ? 0.5f : 0.0f};
+		surface.passes[i] = p;
+	}
+
+	std::vector<D3D::WorldVertex> scalarOut(numVertices), vectorOut(numVertices);
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&start);
+	for(int it=0;it<iterations;it++)
+	{
+		int first = 0;
+		for(unsigned int f=0;f<fans.size();f++)
+		{
+			generateWorldScalar(surface,&pointers[first],fans[f],&scalarOut[first]);
+			first += fans[f];
+		}
+	}
+	QueryPerformanceCounter(&end);
+	scalarNs = (double)(end.QuadPart-start.QuadPart)*1e9/frequency.QuadPart/((double)numVertices*iterations);
+
+	VertexGen::WorldTransform transform;
+	D3D::SurfacePasses passes;
+	QueryPerformanceCounter(&start);
+	for(int it=0;it<iterations;it++)
+	{
+		int first = 0;
+		for(unsigned int f=0;f<fans.size();f++)
+		{
+			if(f%FANS_PER_SURFACE==0)
+				setupWorld(surface,transform,passes);
+			generateWorld(transform,&pointers[first],fans[f],&vectorOut[first]);
+			first += fans[f];
+		}
+	}
+	QueryPerformanceCounter(&end);
+	vectorNs = (double)(end.QuadPart-start.QuadPart)*1e9/frequency.QuadPart/((double)numVertices*iterations);
+
+	maxError = 0;
+	for(int i=0;i<numVertices;i++)
+	{
+		const FLOAT *s = (const FLOAT*)&scalarOut[i];
+		const FLOAT *v = (const FLOAT*)&vectorOut[i];
+		for(int k=0;k<WorldTransform::NUM_OUTPUTS;k++)
+		{
+			maxError = max(maxError,fabsf(s[k]-v[k]));
+		}
+	}
+}
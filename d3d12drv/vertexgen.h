@@ -0,0 +1,107 @@
+/**
+\file vertexgen.h
+*/
+
+#pragma once
+#include <emmintrin.h>
+#include <vector>
+#include "d3d.h"
+
+class VertexGen
+{
+public:
+	/** How a texture pass' coordinates follow from the surface's U and V; see UD3D12RenderDevice::DrawComplexSurface() */
+	struct Pass
+	{
+		bool enabled;
+		FLOAT panU; /**< Pan, including any pan correction (light and fog maps) */
+		FLOAT panV;
+		FLOAT multU; /**< See D3D::TextureMetaData */
+		FLOAT multV;
+		FLOAT offsetU;
+		FLOAT offsetV;
+	};
+
+	/** Everything needed to turn a map surface's view space points into world vertices */
+	struct Surface
+	{
+		D3D::Vec3 mapXAxis; /**< Texture U axis */
+		D3D::Vec3 mapYAxis; /**< Texture V axis */
+		FLOAT uDot; /**< Map origin projected onto the U axis */
+		FLOAT vDot;
+		D3D::Vec3 viewOrigin; /**< View to world transform (the frame's Uncoords) */
+		D3D::Vec3 viewAxes[3];
+		VertexGen::Pass passes[D3D::DUMMY_NUM_PASSES];
+		DWORD flags;
+	};
+
+	/**
+	Every float of a world vertex (position and texture coordinates) as an affine function of the view space point, c.x*x+c.y*y+c.z*z+c.w.
+	The coefficients are laid out to match the vertex, 4 floats per register, so a vertex is 2 blocks of 4 multiply-adds.
+	*/
+	struct WorldTransform
+	{
+		static const int NUM_OUTPUTS = 3+2;
+		static const int NUM_BLOCKS = 2; /**< 16 byte blocks per vertex; the last holds one output, then the flags and surface offset */
+		__m128 coeffs[NUM_BLOCKS][4]; /**< [block][x, y, z or constant term] */
+		__m128 tail; /**< Flags and surface offset in the second and third floats, so they land after the last output */
+		DWORD flags;
+	};
+
+	static void setupWorld(const VertexGen::Surface &surface, VertexGen::WorldTransform &transform, D3D::SurfacePasses &passes);
+
+	/**
+	Set the surface table offset written into the vertices; see D3D::getSurfaceOffset().
+	*/
+	static void setSurfaceOffset(VertexGen::WorldTransform &transform, DWORD offset)
+	{
+		transform.tail = _mm_castsi128_ps(_mm_setr_epi32(0,transform.flags,offset,0));
+	}
+
+	static void generateWorld(const VertexGen::WorldTransform &transform, const D3D::Vec3 *const *points, int num, D3D::WorldVertex *out);
+	static void generateWorldScalar(const VertexGen::Surface &surface, const D3D::Vec3 *const *points, int num, D3D::WorldVertex *out);
+	static void benchmark(int numVertices, int iterations, double &scalarNs, double &vectorNs, float &maxError);
+
+	/** Counters for the vertices queued in the last frame */
+	struct QueueStats
+	{
+		DWORD vertices;
+		DWORD fans;
+		int items; /**< Parts the work was split into for the worker threads */
+		double runTime; /**< Milliseconds the game thread spent in runQueue() */
+		double workTime; /**< Milliseconds spent generating, summed over all threads; above runTime when they overlapped */
+	};
+
+	static void queueSurface(const VertexGen::WorldTransform &transform);
+	static void queueWorld(const D3D::Vec3 *const *points, int num, DWORD surfaceOffset, D3D::WorldVertex *out);
+	static void runQueue(bool parallel);
+	static const VertexGen::QueueStats &getQueueStats();
+
+private:
+	/** A WorldTransform as plain floats, as vectors don't keep SSE types aligned */
+	struct QueuedTransform
+	{
+		FLOAT coeffs[WorldTransform::NUM_BLOCKS][4][4];
+		DWORD flags;
+	};
+
+	/** Fan waiting for its vertices */
+	struct QueuedFan
+	{
+		UINT transform; /**< Index into the queued transforms */
+		UINT firstPoint; /**< Index into the queued points */
+		UINT numPoints;
+		DWORD surfaceOffset;
+		D3D::WorldVertex *out;
+	};
+
+	static void generateVertex(const VertexGen::WorldTransform &transform, const D3D::Vec3 &point, D3D::WorldVertex *out);
+	static void runQueueItem(void *param, int item);
+
+	static std::vector<VertexGen::QueuedTransform> queuedTransforms;
+	static std::vector<VertexGen::QueuedFan> queuedFans;
+	static std::vector<D3D::Vec3> queuedPoints;
+	static std::vector<double> itemTimes;
+	static VertexGen::QueueStats queueStats; /**< Counters for the frame being queued */
+	static VertexGen::QueueStats lastQueueStats;
+};
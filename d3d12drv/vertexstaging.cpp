@@ -0,0 +1,169 @@
+/**
+\class VertexStaging
+Stages vertex data in cached memory before it goes to write-combined upload memory.
+
+The upload ring is write-combined: the CPU doesn't cache it, and writes only go out efficiently when whole cache lines are filled in one go.
+Vertices are filled in field by field, not always in address order, so they are built here first. flush() copies them out front to back:
+whole lines with non-temporal stores, and the partial lines at the start and end with ordinary stores. The partial line at the end is kept,
+so the next flush writes it out whole once the following vertices have filled it up.
+Writes go to increasing destination offsets only; anything skipped over (alignment gaps between vertex formats) is written with whatever
+the staging memory held, which nothing reads.
+*/
+
+#include <string.h>
+#include <emmintrin.h>
+#include "vertexstaging.h"
+
+VertexStaging::VertexStaging() : destination(NULL), base(0), end(0)
+{
+	ZeroMemory(&stats,sizeof(stats));
+}
+
+/**
+Start staging for a new destination; anything staged for the previous one must have been flushed.
+\param destination Memory to write to, cache line aligned. NULL to stage into nothing, e.g. after a failed allocation.
+*/
+void VertexStaging::begin(BYTE *destination)
+{
+	this->destination = destination;
+	base = end = 0;
+}
+
+/**
+reserve() for data that doesn't fit in the staging room: flush to make room.
+*/
+BYTE *VertexStaging::reserveFlushed(UINT offset, UINT bytes)
+{
+	flush();
+	UINT line = offset&~(LINE-1);
+	if(line>base) //Skip ahead; the bytes staged so far are written out already
+	{
+		base = end = line;
+	}
+	if(offset+bytes-base>SIZE) //Too large to stage; let the caller write the destination directly
+	{
+		stats.directBytes += bytes;
+		base = end = offset+bytes;
+		return destination+offset;
+	}
+	if(offset+bytes>end)
+		end = offset+bytes;
+	return data+(offset-base);
+}
+
+/**
+Write the staged data to the destination. The data must be in memory before the GPU reads it, so call this before submitting work that uses it.
+*/
+void VertexStaging::flush()
+{
+	if(end<=base || destination==NULL)
+		return;
+	UINT first = (base+LINE-1)&~(LINE-1); //First whole line
+	if(first>end)
+		first = end;
+	UINT last = end&~(LINE-1); //End of the last whole line
+	if(last<first)
+		last = first;
+
+	memcpy(destination+base,data,first-base);
+	for(UINT o=first;o<last;o+=LINE)
+	{
+		const __m128i *src = (const __m128i*)(data+(o-base));
+		__m128i *dst = (__m128i*)(destination+o);
+		_mm_stream_si128(dst,_mm_loadu_si128(src));
+		_mm_stream_si128(dst+1,_mm_loadu_si128(src+1));
+		_mm_stream_si128(dst+2,_mm_loadu_si128(src+2));
+		_mm_stream_si128(dst+3,_mm_loadu_si128(src+3));
+	}
+	memcpy(destination+last,data+(last-base),end-last);
+	_mm_sfence();
+
+	stats.streamedBytes += last-first;
+	stats.copiedBytes += (first-base)+(end-last);
+	stats.flushes++;
+
+	//Keep the partial last line; the next flush writes it whole
+	if(last>base)
+	{
+		memmove(data,data+(last-base),end-last);
+		base = last;
+	}
+}
+
+/**
+Leave the destination up to an offset to the caller, e.g. for data written later by other threads. Staged data is flushed first, and
+nothing staged later is written below the offset.
+\param offset Destination offset the next reservation starts at or beyond.
+*/
+void VertexStaging::skip(UINT offset)
+{
+	flush();
+	if(offset>base)
+		base = end = offset;
+}
+
+/**
+Time writing tile-like vertices into memory, directly field by field as the renderer used to, and through staging.
+\param destination Memory to write to; write-combined upload memory for a meaningful result. Cache line aligned.
+\param bytes Size of the destination.
+\param iterations Times to fill it.
+\param directMBs Receives the direct write throughput, in MB/s.
+\param stagedMBs Receives the staged throughput, in MB/s.
+*/
+void VertexStaging::benchmark(BYTE *destination, UINT bytes, int iterations, double &directMBs, double &stagedMBs)
+{
+	//Same layout as D3D::TileVertex; fields are written out of address order, as the draw functions do
+	struct BenchVertex
+	{
+		float x, y, z;
+		DWORD color;
+		DWORD fog;
+		float u, v;
+		DWORD flags;
+	};
+	UINT num = bytes/sizeof(BenchVertex);
+	LARGE_INTEGER frequency, start, stop;
+	QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&start);
+	for(int it=0;it<iterations;it++)
+	{
+		BenchVertex *v = (BenchVertex*)destination;
+		for(UINT i=0;i<num;i++)
+		{
+			v[i].color = 0xFFFFFFFF;
+			v[i].fog = 0;
+			v[i].z = 1.0f;
+			v[i].flags = i;
+			v[i].x = (float)i;
+			v[i].y = (float)it;
+			v[i].u = 0.5f;
+			v[i].v = 0.25f;
+		}
+	}
+	QueryPerformanceCounter(&stop);
+	directMBs = (double)num*sizeof(BenchVertex)*iterations/(1024.0*1024.0)/((double)(stop.QuadPart-start.QuadPart)/frequency.QuadPart);
+
+	VertexStaging *staging = new VertexStaging(); //Too large for the stack
+	QueryPerformanceCounter(&start);
+	for(int it=0;it<iterations;it++)
+	{
+		staging->begin(destination);
+		for(UINT i=0;i<num;i++)
+		{
+			BenchVertex *v = (BenchVertex*)staging->reserve(i*sizeof(BenchVertex),sizeof(BenchVertex));
+			v->color = 0xFFFFFFFF;
+			v->fog = 0;
+			v->z = 1.0f;
+			v->flags = i;
+			v->x = (float)i;
+			v->y = (float)it;
+			v->u = 0.5f;
+			v->v = 0.25f;
+		}
+		staging->flush();
+	}
+	QueryPerformanceCounter(&stop);
+	delete staging;
+	stagedMBs = (double)num*sizeof(BenchVertex)*iterations/(1024.0*1024.0)/((double)(stop.QuadPart-start.QuadPart)/frequency.QuadPart);
+}
@@ -0,0 +1,54 @@
+/**
+\file vertexstaging.h
+*/
+
+#pragma once
+#include <windows.h>
+
+class VertexStaging
+{
+public:
+	static const UINT SIZE = 16384; /**< Staging room; small enough to stay in the L1/L2 cache */
+	static const UINT LINE = 64; /**< Cache line, the unit write combining works in */
+
+	/** Counters, since init */
+	struct Stats
+	{
+		UINT64 streamedBytes; /**< Written to the destination as whole lines with non-temporal stores */
+		UINT64 copiedBytes; /**< Written with ordinary stores: partial lines at either end of a flush */
+		UINT64 directBytes; /**< Reservations too large to stage, written by the caller straight to the destination */
+		DWORD flushes;
+	};
+
+	VertexStaging();
+
+	void begin(BYTE *destination);
+	/**
+	Get room for data to be written to the destination.
+	\param offset Destination offset of the data; must not be below that of earlier reservations.
+	\param bytes Size of the data.
+	\return Where to write the data. Only valid until the next reserve() or flush().
+	*/
+	BYTE *reserve(UINT offset, UINT bytes)
+	{
+		if(offset+bytes-base>SIZE)
+			return reserveFlushed(offset,bytes);
+		if(offset+bytes>end)
+			end = offset+bytes;
+		return data+(offset-base);
+	}
+	void flush();
+	void skip(UINT offset);
+	const VertexStaging::Stats &getStats() const { return stats; }
+
+	static void benchmark(BYTE *destination, UINT bytes, int iterations, double &directMBs, double &stagedMBs);
+
+private:
+	BYTE *reserveFlushed(UINT offset, UINT bytes);
+
+	BYTE data[SIZE]; /**< Staged bytes; data[0] holds destination byte 'base' */
+	BYTE *destination; /**< Mapped memory being written; cache line aligned */
+	UINT base; /**< Destination offset of data[0] */
+	UINT end; /**< Destination offset just past the staged bytes */
+	VertexStaging::Stats stats;
+};
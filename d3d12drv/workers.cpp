@@ -0,0 +1,142 @@
+/**
+\class Workers
+Small pool of worker threads for splitting CPU heavy jobs (texture processing etc.) into items that are run in parallel.
+API independent.
+
+A job is a function and a parameter; the function is called once for each item index. Items are handed out through an atomic counter so
+faster threads pick up more of them. The calling thread works on items too, and run() only returns once every item is done and all workers
+have gone back to waiting, so jobs can't overlap.
+
+The game thread is pinned to the first CPU for compatibility (see UD3D12RenderDevice::Init()); workers are kept off that CPU.
+*/
+
+#include "workers.h"
+
+static struct
+{
+	HANDLE threads[Workers::MAX_THREADS];
+	HANDLE startEvents[Workers::MAX_THREADS]; /**< Signaled to have a worker start on the current job */
+	HANDLE finishedEvents[Workers::MAX_THREADS]; /**< Signaled by a worker when it runs out of items */
+	int numThreads;
+	volatile bool quit;
+
+	//Current job
+	Workers::JobFunc func;
+	void *param;
+	int numItems;
+	volatile LONG nextItem;
+} pool;
+
+/**
+Start the worker threads.
+\param numThreads Number of threads besides the calling one. 0 runs everything on the calling thread.
+*/
+void Workers::init(int numThreads)
+{
+	if(numThreads>MAX_THREADS)
+		numThreads = MAX_THREADS;
+	pool.quit = false;
+	pool.numThreads = 0;
+
+	DWORD_PTR processMask, systemMask;
+	GetProcessAffinityMask(GetCurrentProcess(),&processMask,&systemMask);
+	DWORD_PTR workerMask = processMask & ~(DWORD_PTR)1;
+
+	for(int i=0;i<numThreads;i++)
+	{
+		pool.startEvents[i] = CreateEvent(NULL,FALSE,FALSE,NULL);
+		pool.finishedEvents[i] = CreateEvent(NULL,FALSE,FALSE,NULL);
+		pool.threads[i] = CreateThread(NULL,0,&Workers::threadMain,(LPVOID)(INT_PTR)i,0,NULL);
+		if(pool.threads[i]==NULL)
+		{
+			CloseHandle(pool.startEvents[i]);
+			CloseHandle(pool.finishedEvents[i]);
+			break;
+		}
+		if(workerMask)
+			SetThreadAffinityMask(pool.threads[i],workerMask);
+		pool.numThreads++;
+	}
+}
+
+/**
+Stop and clean up the worker threads.
+*/
+void Workers::uninit()
+{
+	pool.quit = true;
+	for(int i=0;i<pool.numThreads;i++)
+	{
+		SetEvent(pool.startEvents[i]);
+	}
+	if(pool.numThreads>0)
+		WaitForMultipleObjects(pool.numThreads,pool.threads,TRUE,INFINITE);
+	for(int i=0;i<pool.numThreads;i++)
+	{
+		CloseHandle(pool.threads[i]);
+		CloseHandle(pool.startEvents[i]);
+		CloseHandle(pool.finishedEvents[i]);
+	}
+	pool.numThreads = 0;
+}
+
+/**
+Run a job and wait for it to finish.
+\param func Function to call for each item.
+\param param Passed to the function.
+\param numItems Number of items; func is called with item indices 0 to numItems-1.
+*/
+void Workers::run(Workers::JobFunc func, void *param, int numItems)
+{
+	pool.func = func;
+	pool.param = param;
+	pool.numItems = numItems;
+	pool.nextItem = 0;
+
+	//Don't bother waking workers for a single item
+	int wake = numItems>1 ? pool.numThreads : 0;
+	for(int i=0;i<wake;i++)
+	{
+		SetEvent(pool.startEvents[i]);
+	}
+	work();
+	if(wake>0)
+		WaitForMultipleObjects(wake,pool.finishedEvents,TRUE,INFINITE);
+}
+
+/**
+\return Number of worker threads, excluding the calling thread.
+*/
+int Workers::getNumThreads()
+{
+	return pool.numThreads;
+}
+
+/**
+Process items of the current job until there are none left.
+*/
+void Workers::work()
+{
+	LONG item;
+	while((item = InterlockedIncrement(&pool.nextItem)-1) < pool.numItems)
+	{
+		pool.func(pool.param,item);
+	}
+}
+
+/**
+Worker thread loop.
+*/
+DWORD WINAPI Workers::threadMain(LPVOID index)
+{
+	int i = (int)(INT_PTR)index;
+	for(;;)
+	{
+		WaitForSingleObject(pool.startEvents[i],INFINITE);
+		if(pool.quit)
+			break;
+		work();
+		SetEvent(pool.finishedEvents[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,25 @@
+/**
+\file workers.h
+*/
+
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+class Workers
+{
+public:
+	/** Function run for each item of a job; gets the job parameter and the item index */
+	typedef void (*JobFunc)(void *param, int item);
+
+	static const int MAX_THREADS = 8;
+
+	static void init(int numThreads);
+	static void uninit();
+	static void run(Workers::JobFunc func, void *param, int numItems);
+	static int getNumThreads();
+
+private:
+	static DWORD WINAPI threadMain(LPVOID index);
+	static void work();
+};